@@ -43,6 +43,15 @@ struct w_iov_sq;
 struct q_stream;
 
 
+/// Congestion controllers, for q_conn_conf.cc_algo.
+enum q_cc_algo {
+    q_cc_default = 0,
+    q_cc_newreno = 1,
+    q_cc_cubic = 2,
+    q_cc_bbr = 3,
+};
+
+
 struct q_conn_conf {
     uint_t idle_timeout;             // seconds
     uint_t tls_key_update_frequency; // seconds
@@ -51,7 +60,11 @@ struct q_conn_conf {
     uint8_t enable_tls_key_updates : 1; // TODO default to on eventually
     uint8_t disable_active_migration : 1;
     uint8_t enable_quantum_readiness_test : 1; // FIXME: is temporary
-    uint8_t : 3;
+    uint8_t disable_ecn : 1;
+    uint8_t enable_l4s : 1; // mark ECT(1), scalable CE response
+    uint8_t disable_ack_freq : 1;
+    uint8_t pacing_burst; // packets
+    uint8_t cc_algo;      // enum q_cc_algo
     uint32_t version;
 };
 
@@ -66,7 +79,10 @@ struct q_conf {
     uint32_t num_bufs;
     uint8_t enable_tls_cert_verify : 1;
     uint8_t force_retry : 1; // ignored on client
-    uint8_t : 6;
+    uint8_t enable_udp_gro : 1;  // Linux socket backend only
+    uint8_t enable_io_uring : 1; // Linux socket backend only
+    uint8_t enable_txtime : 1;   // Linux socket backend w/fq qdisc only
+    uint8_t : 3;
     uint8_t client_cid_len;
     uint8_t server_cid_len;
 };
@@ -89,14 +105,16 @@ struct q_conn_info {
     float rttvar;
     float min_rtt;
     float max_rtt;
+    float cc_min_rtt; // min RTT as seen by the congestion controller
+    float cc_bw;      // bottleneck bandwidth estimate (bytes/s)
 
     uint_t cwnd;
     uint_t max_cwnd;
     uint_t ssthresh;
     uint_t pto_cnt;
 
-    // 0x1e = max. frame type
-    uint_t frm_cnt[2][0x1e + 1]; // 0 = out (tx), 1 = in (rx)
+    // 0x20 = max. frame type (ACK_FREQUENCY is counted as 0x20)
+    uint_t frm_cnt[2][0x20 + 1]; // 0 = out (tx), 1 = in (rx)
 };
 
 
@@ -204,6 +222,11 @@ extern bool q_ready(struct w_engine * const w,
 extern bool __attribute__((nonnull))
 q_is_uni_stream(const struct q_stream * const s);
 
+extern void __attribute__((nonnull))
+q_stream_set_priority(struct q_stream * const s,
+                      const uint8_t urgency,
+                      const bool incremental);
+
 #ifndef NO_MIGRATION
 extern void __attribute__((nonnull(1)))
 q_migrate(struct q_conn * const c,
@@ -214,8 +237,61 @@ q_migrate(struct q_conn * const c,
 extern void __attribute__((nonnull))
 q_info(struct q_conn * const c, struct q_conn_info * const ci);
 
+struct q_callbacks {
+    void (*conn_accepted)(struct q_conn * const c, void * const arg);
+    void (*conn_closed)(struct q_conn * const c, void * const arg); // q_close()
+    void (*strm_readable)(struct q_stream * const s, void * const arg);
+    void (*strm_acked)(struct q_stream * const s, void * const arg); // all data
+};
+
+extern void __attribute__((nonnull(1, 2)))
+q_set_callbacks(struct w_engine * const w,
+                const struct q_callbacks * const cb,
+                void * const arg);
+
+extern void __attribute__((nonnull)) q_run(struct w_engine * const w);
+
+extern void __attribute__((nonnull))
+q_poll(struct w_engine * const w, const uint64_t nsec);
+
+extern void __attribute__((nonnull)) q_stop(struct w_engine * const w);
+
+extern size_t __attribute__((nonnull(1)))
+q_fds(struct w_engine * const w, int * const fds, const size_t num);
+
+extern uint64_t __attribute__((nonnull))
+q_next_timeout(struct w_engine * const w);
+
+extern bool __attribute__((nonnull)) q_process_io(struct w_engine * const w);
+
+extern void __attribute__((nonnull))
+q_process_timers(struct w_engine * const w);
+
 extern int __attribute__((nonnull)) q_conn_af(const struct q_conn * const c);
 
+#ifndef NO_SERVER
+typedef void (*q_shard_func)(struct w_engine * const w, void * const arg);
+
+extern struct w_engine * __attribute__((nonnull(1)))
+q_init_shards(const char * const ifname,
+              const struct q_conf * const conf,
+              const uint16_t num);
+
+extern struct w_engine * __attribute__((nonnull))
+q_shard(const struct w_engine * const w, const uint16_t idx);
+
+extern uint16_t __attribute__((nonnull))
+q_num_shards(const struct w_engine * const w);
+
+extern void __attribute__((nonnull(1, 2)))
+q_run_shards(struct w_engine * const w,
+             const q_shard_func func,
+             void * const arg);
+
+extern void __attribute__((nonnull))
+q_cleanup_shards(struct w_engine * const w);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
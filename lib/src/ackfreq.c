@@ -0,0 +1,109 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/param.h>
+
+#include <quant/quant.h>
+
+#include "ackfreq.h"
+#include "conn.h"
+#include "loop.h"
+#include "pn.h"
+#include "quic.h"
+#include "recovery.h"
+
+
+void init_ack_freq(struct q_conn * const c)
+{
+    c->afq = (struct ack_freq){.thresh_out = AFQ_DEF_THRESH,
+                               .thresh_in = AFQ_DEF_THRESH,
+                               .reor_in = AFQ_DEF_REOR};
+}
+
+
+uint64_t ack_del_ns(const struct q_conn * const c)
+{
+    return c->afq.del_in ? c->afq.del_in * NS_PER_US
+                         : c->tp_mine.max_ack_del * NS_PER_MS;
+}
+
+
+void ack_freq_update(struct q_conn * const c)
+{
+    if (c->tp_peer.min_ack_del == 0 || c->state != conn_estb)
+        return;
+
+    // don't update more than once per RTT
+    const uint64_t now = loop_now(c->w);
+    if (c->afq.seq_out &&
+        now < c->afq.tx_t + (uint64_t)c->rec.cur.srtt * NS_PER_US)
+        return;
+
+    // let a fraction of the cwnd go unACKed, for a similar fraction of an RTT
+    const uint_t cwnd_pkts = c->rec.cur.cwnd / c->rec.max_pkt_size;
+    const uint_t thresh = MAX(AFQ_DEF_THRESH,
+                              MIN(AFQ_MAX_THRESH, cwnd_pkts >> AFQ_CWND_SHIFT));
+    const uint_t del =
+        MAX(c->tp_peer.min_ack_del, MIN(c->rec.cur.srtt >> AFQ_CWND_SHIFT,
+                                        c->tp_peer.max_ack_del * US_PER_MS));
+
+    // only bother the peer if something changed by more than a quarter
+    const uint_t slack = c->afq.del_out >> 2;
+    if (thresh == c->afq.thresh_out && del + slack >= c->afq.del_out &&
+        del <= c->afq.del_out + slack)
+        return;
+
+    c->afq.thresh_out = thresh;
+    c->afq.del_out = del;
+    c->tx_ack_freq = true;
+}
+
+
+bool ack_freq_reordered(struct pn_space * const pn, const uint_t nr)
+{
+    struct q_conn * const c = pn->c;
+    const uint_t reor = pn->type == pn_data ? c->afq.reor_in : AFQ_DEF_REOR;
+    const struct rx_hist * const h = &pn->recv_all;
+    if (reor == 0 || rx_hist_empty(h))
+        return false;
+
+    // a late pkt filling a hole
+    const uint_t max = rx_hist_max(h);
+    if (nr < max)
+        return max - nr >= reor;
+
+    // unless the peer asked to thin out ACKs, leave gaps to the ACK timer
+    if (c->afq.thresh_in <= AFQ_DEF_THRESH)
+        return false;
+
+    // a gap whose missing pkt now has reor pkts received above it
+    const uint_t run = nr == max + 1 ? max - h->run_lo + 2 : 1;
+    return (nr > max + 1 || h->run_lo > h->base) && run == reor;
+}
@@ -0,0 +1,78 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <quant/quant.h>
+
+struct pn_space; // IWYU pragma: no_forward_declare pn_space
+struct q_conn;   // IWYU pragma: no_forward_declare q_conn
+
+
+/// Default ack-eliciting threshold, i.e., ACK every second ack-eliciting pkt.
+#define AFQ_DEF_THRESH 1
+
+/// Largest ack-eliciting threshold we request from the peer.
+#define AFQ_MAX_THRESH 10
+
+/// Default reordering threshold, i.e., ACK any out-of-order pkt immediately.
+#define AFQ_DEF_REOR 1
+
+/// Fraction of the congestion window (as a shift) to let go unACKed.
+#define AFQ_CWND_SHIFT 2
+
+
+/// ACK frequency state, see draft-ietf-quic-ack-frequency.
+struct ack_freq {
+    uint64_t tx_t; ///< Time the last ACK_FREQUENCY frame was sent.
+
+    // what we asked the peer for:
+    uint_t seq_out;    ///< Sequence number of the next ACK_FREQUENCY frame.
+    uint_t thresh_out; ///< Last requested ack-eliciting threshold.
+    uint_t del_out;    ///< Last requested max ack delay [us].
+
+    // what the peer asked us for:
+    uint_t seq_in;    ///< Largest received sequence number + 1 (0 = none).
+    uint_t thresh_in; ///< Ack-eliciting threshold requested by the peer.
+    uint_t del_in;    ///< Max ack delay requested by the peer [us] (0 = TP).
+    uint_t reor_in;   ///< Reordering threshold requested by the peer.
+};
+
+
+extern void __attribute__((nonnull)) init_ack_freq(struct q_conn * const c);
+
+extern void __attribute__((nonnull)) ack_freq_update(struct q_conn * const c);
+
+extern uint64_t __attribute__((nonnull))
+ack_del_ns(const struct q_conn * const c);
+
+extern bool __attribute__((nonnull))
+ack_freq_reordered(struct pn_space * const pn, const uint_t nr);
@@ -0,0 +1,422 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/param.h>
+
+#include <quant/quant.h>
+
+#include "cc.h"
+#include "conn.h"
+#include "loop.h"
+#include "pkt.h"
+#include "quic.h"
+#include "recovery.h"
+
+// A BBR congestion controller, following draft-cardwell-iccrg-bbr-congestion
+// -control with the BBRv2 loss response (inflight_hi) and ProbeBW phases.
+
+/// Fixed-point unit for the gains.
+#define BBR_UNIT 256
+
+#define BBR_STARTUP_GAIN 709 ///< 2.77 * BBR_UNIT
+#define BBR_DRAIN_GAIN 92    ///< BBR_UNIT / 2.77
+#define BBR_CWND_GAIN 512    ///< 2 * BBR_UNIT
+#define BBR_UP_GAIN 320      ///< 1.25 * BBR_UNIT
+#define BBR_DOWN_GAIN 192    ///< 0.75 * BBR_UNIT
+
+/// Length of the max bandwidth filter, in rounds.
+#define BBR_BW_ROUNDS 10
+
+/// Length of the min RTT filter; PROBE_RTT is entered when it expires.
+#define BBR_MIN_RTT_WIN (10 * NS_PER_S)
+
+/// Time to hold the window low in PROBE_RTT.
+#define BBR_PROBE_RTT_DUR (200 * NS_PER_MS)
+
+/// Rounds to cruise in PROBE_BW before probing for more bandwidth.
+#define BBR_CRUISE_ROUNDS 8
+
+/// Loss rate per round above which BBR reacts, as a fraction (2/100).
+#define BBR_LOSS_THRESH_NUM 2
+#define BBR_LOSS_THRESH_DEN 100
+
+/// Multiplicative decrease of inflight_hi on excessive loss (7/10).
+#define BBR_BETA_NUM 7
+#define BBR_BETA_DEN 10
+
+typedef enum {
+    bbr_startup,
+    bbr_drain,
+    bbr_probe_down,
+    bbr_probe_cruise,
+    bbr_probe_up,
+    bbr_probe_rtt,
+} bbr_state_t;
+
+
+static uint64_t __attribute__((nonnull))
+minmax_reset(struct minmax_sample * const m, const uint64_t t, const uint64_t v)
+{
+    m[0] = m[1] = m[2] = (struct minmax_sample){.t = t, .v = v};
+    return v;
+}
+
+
+static uint64_t __attribute__((nonnull))
+minmax_running_max(struct minmax_sample * const m,
+                   const uint64_t win,
+                   const uint64_t t,
+                   const uint64_t v)
+{
+    // Kathleen Nichols' windowed min/max tracker, as used by Linux BBR
+    const struct minmax_sample val = {.t = t, .v = v};
+    if (v >= m[0].v || t - m[2].t > win)
+        return minmax_reset(m, t, v);
+
+    if (v >= m[1].v)
+        m[2] = m[1] = val;
+    else if (v >= m[2].v)
+        m[2] = val;
+
+    const uint64_t dt = t - m[0].t;
+    if (unlikely(dt > win)) {
+        m[0] = m[1];
+        m[1] = m[2];
+        m[2] = val;
+        if (unlikely(t - m[0].t > win)) {
+            m[0] = m[1];
+            m[1] = m[2];
+            m[2] = val;
+        }
+    } else if (unlikely(m[1].t == m[0].t) && dt > win / 4)
+        m[2] = m[1] = val;
+    else if (unlikely(m[2].t == m[1].t) && dt > win / 2)
+        m[2] = val;
+    return m[0].v;
+}
+
+
+static inline struct bbr * __attribute__((nonnull))
+bbr(struct q_conn * const c)
+{
+    return &c->rec.cc_priv.bbr;
+}
+
+
+static inline uint64_t __attribute__((nonnull))
+max_bw(const struct q_conn * const c)
+{
+    return c->rec.cc_priv.bbr.max_bw[0].v;
+}
+
+
+static uint64_t __attribute__((nonnull))
+bdp(const struct q_conn * const c, const uint16_t gain)
+{
+    const struct bbr * const b = &c->rec.cc_priv.bbr;
+    if (unlikely(b->min_rtt == UINT64_MAX || max_bw(c) == 0))
+        return kInitialWindow(c->rec.max_pkt_size);
+    return max_bw(c) * b->min_rtt / US_PER_S * gain / BBR_UNIT;
+}
+
+
+static uint64_t __attribute__((nonnull))
+target_inflight(const struct q_conn * const c, const uint16_t gain)
+{
+    // leave room for three pkts of ACK aggregation and delayed ACKs
+    const uint64_t mss = c->rec.max_pkt_size;
+    return MAX(bdp(c, gain) + 3 * mss, kMinimumWindow(mss) * 2);
+}
+
+
+static void __attribute__((nonnull))
+enter(struct q_conn * const c, const bbr_state_t state)
+{
+    static const uint16_t pacing_gain[] = {
+        [bbr_startup] = BBR_STARTUP_GAIN, [bbr_drain] = BBR_DRAIN_GAIN,
+        [bbr_probe_down] = BBR_DOWN_GAIN, [bbr_probe_cruise] = BBR_UNIT,
+        [bbr_probe_up] = BBR_UP_GAIN,     [bbr_probe_rtt] = BBR_UNIT};
+
+    struct bbr * const b = bbr(c);
+#ifdef DEBUG_EXTRA
+    warn(DBG, "%s conn %s BBR state %u -> %u", conn_type(c), cid_str(c->scid),
+         b->state, state);
+#endif
+    b->state = (uint8_t)state;
+    b->pacing_gain = pacing_gain[state];
+    b->cwnd_gain = BBR_CWND_GAIN;
+    b->phase_round = b->round_count;
+    if (state == bbr_probe_up)
+        b->probe_up_cnt = 0;
+}
+
+
+static void __attribute__((nonnull)) bbr_init(struct q_conn * const c)
+{
+    c->rec.cur.cwnd = kInitialWindow(c->rec.max_pkt_size);
+    c->rec.cur.ssthresh = UINT_T_MAX;
+    struct bbr * const b = bbr(c);
+    *b = (struct bbr){.min_rtt = UINT64_MAX,
+                      .min_rtt_t = loop_now(c->w),
+                      .inflight_hi = UINT64_MAX,
+                      .next_round_delivered = c->rec.delivered,
+                      .round_delivered = c->rec.delivered,
+                      .round_lost = c->rec.lost};
+    enter(c, bbr_startup);
+}
+
+
+static void __attribute__((nonnull))
+update_round(struct q_conn * const c, const struct acked * const a)
+{
+    struct bbr * const b = bbr(c);
+    b->round_start = a->delivered >= b->next_round_delivered;
+    if (b->round_start) {
+        b->next_round_delivered = c->rec.delivered;
+        b->round_count++;
+    }
+}
+
+
+static bool __attribute__((nonnull))
+update_min_rtt(struct q_conn * const c, const struct acked * const a)
+{
+    // sample the RTT of the most recently sent pkt this ACK covers, and
+    // return whether the filter had expired before taking the sample
+    struct bbr * const b = bbr(c);
+    const uint64_t now = loop_now(c->w);
+    const bool expired = now > b->min_rtt_t + BBR_MIN_RTT_WIN;
+    const uint64_t rtt = a->sent_t ? NS_TO_US(now - a->sent_t) : 0;
+    if (rtt && (rtt <= b->min_rtt || expired)) {
+        b->min_rtt = rtt;
+        b->min_rtt_t = now;
+    }
+    return expired;
+}
+
+
+static bool __attribute__((nonnull)) check_loss(struct q_conn * const c)
+{
+    // BBRv2: only react when the loss rate of the last round was excessive,
+    // which ignores low levels of random, non-congestive loss
+    struct bbr * const b = bbr(c);
+    const uint64_t lost = c->rec.lost - b->round_lost;
+    const uint64_t delivered = c->rec.delivered - b->round_delivered;
+    b->round_lost = c->rec.lost;
+    b->round_delivered = c->rec.delivered;
+    if (lost * BBR_LOSS_THRESH_DEN <=
+        (lost + delivered) * BBR_LOSS_THRESH_NUM)
+        return false;
+
+    b->inflight_hi = MAX(MAX(c->rec.cur.in_flight, bdp(c, BBR_UNIT)) *
+                             BBR_BETA_NUM / BBR_BETA_DEN,
+                         kMinimumWindow(c->rec.max_pkt_size));
+    return true;
+}
+
+
+static void __attribute__((nonnull)) check_full_bw(struct q_conn * const c)
+{
+    struct bbr * const b = bbr(c);
+    if (b->full_bw_reached || c->rec.rs.is_app_limited)
+        return;
+
+    // still growing by at least 25% per round?
+    if (max_bw(c) >= b->full_bw * 5 / 4) {
+        b->full_bw = max_bw(c);
+        b->full_bw_cnt = 0;
+        return;
+    }
+    b->full_bw_reached = ++b->full_bw_cnt >= 3;
+}
+
+
+static void __attribute__((nonnull))
+update_state(struct q_conn * const c, const bool min_rtt_expired)
+{
+    struct bbr * const b = bbr(c);
+    const uint64_t now = loop_now(c->w);
+    const uint_t in_flight = c->rec.cur.in_flight;
+
+    if (min_rtt_expired && b->state != bbr_probe_rtt &&
+        b->state != bbr_startup) {
+        enter(c, bbr_probe_rtt);
+        b->probe_rtt_done_t = 0;
+        return;
+    }
+
+    switch (b->state) {
+    case bbr_startup:
+        if (b->full_bw_reached)
+            enter(c, bbr_drain);
+        break;
+    case bbr_drain:
+        if (in_flight <= target_inflight(c, BBR_UNIT))
+            enter(c, bbr_probe_down);
+        break;
+    case bbr_probe_down:
+        if (in_flight <= target_inflight(c, BBR_UNIT))
+            enter(c, bbr_probe_cruise);
+        break;
+    case bbr_probe_cruise:
+        if (b->round_count - b->phase_round >= BBR_CRUISE_ROUNDS)
+            enter(c, bbr_probe_up);
+        break;
+    case bbr_probe_up:
+        if (b->round_start) {
+            // grow inflight_hi exponentially while probing without loss
+            if (b->inflight_hi != UINT64_MAX)
+                b->inflight_hi += (uint64_t)c->rec.max_pkt_size
+                                  << MIN(b->probe_up_cnt, 20);
+            b->probe_up_cnt++;
+        }
+        if (b->round_count > b->phase_round &&
+            in_flight >= target_inflight(c, BBR_UP_GAIN))
+            enter(c, bbr_probe_down);
+        break;
+    case bbr_probe_rtt:
+        if (b->probe_rtt_done_t == 0) {
+            if (in_flight <= MAX(bdp(c, BBR_UNIT) / 2,
+                                 kMinimumWindow(c->rec.max_pkt_size)))
+                b->probe_rtt_done_t = now + BBR_PROBE_RTT_DUR;
+        } else if (now > b->probe_rtt_done_t) {
+            b->min_rtt_t = now;
+            enter(c, b->full_bw_reached ? bbr_probe_cruise : bbr_startup);
+        }
+        break;
+    }
+}
+
+
+static void __attribute__((nonnull))
+set_cwnd(struct q_conn * const c, const uint_t acked)
+{
+    struct bbr * const b = bbr(c);
+    const uint64_t mss = c->rec.max_pkt_size;
+    const uint64_t target = target_inflight(c, b->cwnd_gain);
+    uint64_t cwnd = c->rec.cur.cwnd;
+
+    if (b->full_bw_reached)
+        cwnd = MIN(cwnd + acked, target);
+    else if (cwnd < target || c->rec.delivered < kInitialWindow(mss))
+        cwnd += acked;
+
+    cwnd = MIN(cwnd, b->inflight_hi);
+    if (b->state == bbr_probe_rtt)
+        cwnd = MIN(cwnd, bdp(c, BBR_UNIT) / 2);
+    c->rec.cur.cwnd = (uint_t)MAX(cwnd, kMinimumWindow(mss));
+}
+
+
+static void __attribute__((nonnull))
+bbr_on_ack(struct q_conn * const c, const struct acked * const a)
+{
+    struct bbr * const b = bbr(c);
+    const struct rate_sample * const rs = &c->rec.rs;
+
+    update_round(c, a);
+    if (rs->bw && (rs->is_app_limited == false || rs->bw >= max_bw(c)))
+        minmax_running_max(b->max_bw, BBR_BW_ROUNDS, b->round_count, rs->bw);
+    const bool min_rtt_expired = update_min_rtt(c, a);
+
+    if (b->round_start) {
+        if (check_loss(c)) {
+            // excessive loss ends STARTUP and bandwidth probing
+            b->full_bw_reached = true;
+            if (b->state == bbr_startup || b->state == bbr_probe_up)
+                enter(c, b->state == bbr_startup ? bbr_drain
+                                                 : bbr_probe_down);
+        }
+        check_full_bw(c);
+    }
+
+    update_state(c, min_rtt_expired);
+    set_cwnd(c, a->bytes);
+}
+
+
+static void __attribute__((nonnull))
+bbr_on_loss(struct q_conn * const c __attribute__((unused)),
+            const uint64_t sent_t __attribute__((unused)))
+{
+    // losses are accounted for once per round, in check_loss()
+}
+
+
+static void __attribute__((nonnull))
+bbr_on_persistent_congestion(struct q_conn * const c)
+{
+    c->rec.cur.cwnd = kMinimumWindow(c->rec.max_pkt_size);
+}
+
+
+static uint64_t __attribute__((nonnull))
+bbr_pacing_rate(const struct q_conn * const c)
+{
+    const struct bbr * const b = &c->rec.cc_priv.bbr;
+    uint64_t bw = max_bw(c);
+    if (unlikely(bw == 0)) {
+        // no bandwidth sample yet, start from the initial window
+        if (c->rec.cur.srtt == 0)
+            return 0;
+        bw = (uint64_t)c->rec.cur.cwnd * US_PER_S / c->rec.cur.srtt;
+    }
+    // pace 1% below the estimate to drain queues that build up anyway
+    return bw * b->pacing_gain / BBR_UNIT * 99 / 100;
+}
+
+
+static void __attribute__((nonnull))
+bbr_app_limited(struct q_conn * const c __attribute__((unused)))
+{
+    // on_app_limited() marked the rate samples; the bw filter skips them
+}
+
+
+static void __attribute__((nonnull))
+bbr_info(const struct q_conn * const c, struct q_conn_info * const i)
+{
+    const struct bbr * const b = &c->rec.cc_priv.bbr;
+    i->cc_bw = (float)max_bw(c);
+    i->cc_min_rtt =
+        b->min_rtt == UINT64_MAX ? 0 : (float)b->min_rtt / US_PER_S;
+}
+
+
+const struct cc_ops cc_bbr = {
+    .name = "bbr",
+    .init = bbr_init,
+    .on_ack = bbr_on_ack,
+    .on_loss = bbr_on_loss,
+    .on_persistent_congestion = bbr_on_persistent_congestion,
+    .pacing_rate = bbr_pacing_rate,
+    .app_limited = bbr_app_limited,
+    .info = bbr_info,
+};
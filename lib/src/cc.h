@@ -0,0 +1,163 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <quant/quant.h>
+
+struct q_conn; // IWYU pragma: no_forward_declare q_conn
+
+
+/// In-flight packets newly ACKed by one ACK frame. Recovery collects them in
+/// on_pkt_acked() and hands them to the congestion controller in one go.
+struct acked {
+    uint64_t sent_t;       ///< TX time of the most recently sent packet.
+    uint64_t first_sent_t; ///< Its delivery rate state, see on_pkt_sent().
+    uint64_t delivered_t;
+    uint64_t delivered;
+    uint_t bytes;    ///< Bytes newly ACKed.
+    uint_t cc_bytes; ///< Of those, bytes sent outside of recovery.
+    bool is_app_limited;
+    uint8_t _unused[7];
+};
+
+
+/// HyStart++ slow start state, see hystart.c.
+struct hystart {
+    uint64_t window_end;  ///< Delivered count that ends the current round.
+    uint_t last_min_rtt;  ///< Min RTT of the previous round, in usec.
+    uint_t cur_min_rtt;   ///< Min RTT of the current round, in usec.
+    uint_t css_base_rtt;  ///< cur_min_rtt when CSS was entered.
+    uint16_t rtt_cnt;     ///< RTT samples in the current round.
+    uint8_t css_rounds;   ///< Rounds spent in CSS.
+    uint8_t in_css : 1;   ///< In Conservative Slow Start?
+    uint8_t : 7;
+#if HAVE_64BIT
+    uint8_t _unused[4];
+#endif
+};
+
+
+/// CUBIC state, see cubic.c.
+struct cubic {
+    uint64_t epoch_t;  ///< Start of the current congestion avoidance epoch.
+    uint64_t k;        ///< Time (in ms) after epoch_t to grow back to w_max.
+    uint64_t idle_t;   ///< When the sender went idle, or zero.
+    uint_t w_max;      ///< Window before the last reduction.
+    uint_t w_est;      ///< Reno-friendly window estimate.
+    uint_t cwnd_epoch; ///< Window at the start of the epoch.
+#if !HAVE_64BIT
+    uint8_t _unused[4];
+#endif
+};
+
+
+/// One sample of a windowed max filter.
+struct minmax_sample {
+    uint64_t t; ///< Time (or round) of the sample.
+    uint64_t v; ///< Value of the sample.
+};
+
+
+/// BBR state, see bbr.c.
+struct bbr {
+    struct minmax_sample max_bw[3]; ///< Max filter of delivery rate.
+    uint64_t min_rtt;               ///< Min RTT in usec, over BBR_MIN_RTT_WIN.
+    uint64_t min_rtt_t;             ///< When min_rtt was measured.
+    uint64_t probe_rtt_done_t;      ///< When to leave PROBE_RTT, or 0.
+    uint64_t next_round_delivered;  ///< Delivered count that ends the round.
+    uint64_t round_delivered;       ///< c->rec.delivered at round start.
+    uint64_t round_lost;            ///< c->rec.lost at round start.
+    uint64_t full_bw;               ///< Bandwidth seen at last startup growth.
+    uint64_t inflight_hi;           ///< Upper bound on in_flight after loss.
+    uint64_t round_count;           ///< Number of round trips so far.
+    uint64_t phase_round;           ///< round_count at start of this phase.
+    uint16_t pacing_gain;           ///< Pacing gain, in units of BBR_UNIT.
+    uint16_t cwnd_gain;             ///< Window gain, in units of BBR_UNIT.
+    uint8_t state;                  ///< BBR state, see bbr.c.
+    uint8_t full_bw_cnt;  ///< Rounds without significant bandwidth growth.
+    uint8_t probe_up_cnt; ///< Rounds spent in PROBE_UP.
+    uint8_t round_start : 1;     ///< An ACK started a new round.
+    uint8_t full_bw_reached : 1; ///< Left STARTUP.
+    uint8_t : 6;
+};
+
+
+/// Algorithm-specific congestion controller state.
+union cc_priv {
+    struct cubic cubic;
+    struct bbr bbr;
+};
+
+
+/// Congestion controller operations. The loss detection in recovery.c
+/// calls these, and they update c->rec.cur.cwnd and c->rec.cur.ssthresh.
+struct cc_ops {
+    const char * name;
+
+    /// Set the initial window, called on connection (re)start.
+    void (*init)(struct q_conn * const c);
+
+    /// The packets in @p a were ACKed, and have been removed from in_flight.
+    void (*on_ack)(struct q_conn * const c, const struct acked * const a);
+
+    /// A congestion event occurred that started a new recovery period.
+    void (*on_loss)(struct q_conn * const c, const uint64_t sent_t);
+
+    /// Persistent congestion was detected.
+    void (*on_persistent_congestion)(struct q_conn * const c);
+
+    /// Current pacing rate in bytes per second, zero if unknown.
+    uint64_t (*pacing_rate)(const struct q_conn * const c);
+
+    /// TX ran out of data before running out of window.
+    void (*app_limited)(struct q_conn * const c);
+
+    /// Optional, TX starts again with nothing in flight.
+    void (*tx_start)(struct q_conn * const c);
+
+    /// Optional, override the generic CC fields in @p i.
+    void (*info)(const struct q_conn * const c, struct q_conn_info * const i);
+};
+
+
+extern const struct cc_ops cc_newreno;
+extern const struct cc_ops cc_cubic;
+extern const struct cc_ops cc_bbr;
+
+
+extern const struct cc_ops * __attribute__((const))
+cc_lookup(const uint8_t algo);
+
+extern void __attribute__((nonnull)) hystart_init(struct q_conn * const c);
+
+extern uint_t __attribute__((nonnull))
+hystart_ss_incr(struct q_conn * const c, const struct acked * const a);
@@ -53,18 +53,26 @@
 #include <quant/quant.h>
 #include <timeout.h>
 
+#include "ackfreq.h"
+#include "cc.h"
 #include "conn.h"
 #include "diet.h"
+#include "ecn.h"
 #include "frame.h"
+#include "gso.h"
 #include "loop.h"
 #include "marshall.h"
+#include "pacer.h"
 #include "pkt.h"
 #include "pn.h"
 #include "qlog.h"
 #include "quic.h"
 #include "recovery.h"
+#include "shard.h"
 #include "stream.h"
 #include "tls.h"
+#include "uring.h"
+#include "xdp.h"
 
 #ifndef NO_SERVER
 #include "kvec.h"
@@ -80,19 +88,6 @@
 
 const char * const conn_state_str[] = {CONN_STATES};
 
-struct q_conn_sl c_ready = sl_head_initializer(c_ready);
-struct q_conn_sl c_zcid = sl_head_initializer(c_zcid);
-
-#ifndef NO_SERVER
-struct q_conn_sl c_embr = sl_head_initializer(c_embr);
-#endif
-
-
-#ifndef NO_SRT_MATCHING
-khash_t(conns_by_srt) conns_by_srt = {0};
-#endif
-
-
 static inline __attribute__((const)) bool is_vneg_vers(const uint32_t vers)
 {
     return (vers & 0x0f0f0f0f) == 0x0a0a0a0a;
@@ -106,8 +101,6 @@ static inline __attribute__((const)) bool is_draft_vers(const uint32_t vers)
 
 
 #ifndef NO_MIGRATION
-khash_t(conns_by_id) conns_by_id = {0};
-
 SPLAY_GENERATE(cids_by_seq, cid, node_seq, cids_by_seq_cmp)
 #endif
 
@@ -157,8 +150,6 @@ clnt_vneg(const uint8_t * const pos, const uint8_t * const end)
 
 
 #ifndef NO_OOO_0RTT
-struct ooo_0rtt_by_cid ooo_0rtt_by_cid = splay_initializer(&ooo_0rtt_by_cid);
-
 SPLAY_GENERATE(ooo_0rtt_by_cid, ooo_0rtt, node, ooo_0rtt_by_cid_cmp)
 #endif
 
@@ -173,8 +164,7 @@ epoch_in(const struct q_conn * const c)
 
 
 #ifndef NO_SERVER
-static struct w_sock * __attribute__((nonnull))
-get_local_sock_by_ipnp(struct per_engine_data * const ped,
+struct w_sock * get_local_sock_by_ipnp(struct per_engine_data * const ped,
                        const struct w_sockaddr * const local)
 {
     for (size_t i = 0; i < kv_size(ped->serv_socks); i++) {
@@ -188,24 +178,27 @@ get_local_sock_by_ipnp(struct per_engine_data * const ped,
 
 
 #ifndef NO_SRT_MATCHING
-struct q_conn * get_conn_by_srt(uint8_t * const srt)
+struct q_conn * get_conn_by_srt(struct w_engine * const w,
+                                uint8_t * const srt)
 {
-    const khiter_t k = kh_get(conns_by_srt, &conns_by_srt, srt);
-    if (unlikely(k == kh_end(&conns_by_srt)))
+    khash_t(conns_by_srt) * const cbs = &ped(w)->conns_by_srt;
+    const khiter_t k = kh_get(conns_by_srt, cbs, srt);
+    if (unlikely(k == kh_end(cbs)))
         return 0;
-    return kh_val(&conns_by_srt, k);
+    return kh_val(cbs, k);
 }
 #endif
 
 
 #ifndef NO_MIGRATION
 static struct q_conn * __attribute__((nonnull))
-get_conn_by_cid(struct cid * const scid)
+get_conn_by_cid(struct w_engine * const w, struct cid * const scid)
 {
-    const khiter_t k = kh_get(conns_by_id, &conns_by_id, scid);
-    if (unlikely(k == kh_end(&conns_by_id)))
+    khash_t(conns_by_id) * const cbi = &ped(w)->conns_by_id;
+    const khiter_t k = kh_get(conns_by_id, cbi, scid);
+    if (unlikely(k == kh_end(cbi)))
         return 0;
-    return kh_val(&conns_by_id, k);
+    return kh_val(cbi, k);
 }
 
 
@@ -267,8 +260,8 @@ static void __attribute__((nonnull)) log_sent_pkts(struct q_conn * const c)
 
         struct diet unacked = diet_initializer(unacked);
         struct pkt_meta * m;
-        kh_foreach_value(&pn->sent_pkts, m,
-                         diet_insert(&unacked, m->hdr.nr, 0));
+        pm_ring_foreach (m, &pn->sent_pkts, UINT_T_MAX)
+            diet_insert(&unacked, m->hdr.nr, 0);
 
         int pos = 0;
         unpoison_scratch(ped(c->w)->scratch, ped(c->w)->scratch_len);
@@ -285,11 +278,11 @@ static void __attribute__((nonnull)) log_sent_pkts(struct q_conn * const c)
             if (i->lo == i->hi)
                 pos += snprintf((char *)&tmp[pos], tmp_len - (size_t)pos,
                                 FMT_PNR_OUT "%s", i->lo,
-                                splay_next(diet, &unacked, i) ? ", " : "");
+                                diet_next(diet, &unacked, i) ? ", " : "");
             else
                 pos += snprintf((char *)&tmp[pos], tmp_len - (size_t)pos,
                                 FMT_PNR_OUT ".." FMT_PNR_OUT "%s", i->lo, i->hi,
-                                splay_next(diet, &unacked, i) ? ", " : "");
+                                diet_next(diet, &unacked, i) ? ", " : "");
         }
         diet_free(&unacked);
 
@@ -335,6 +328,24 @@ rtx_pkt(struct w_iov * const v, struct pkt_meta * const m)
 static void do_w_tx(struct w_sock * const ws, struct w_iov_sq * const q)
 {
 #ifndef FUZZING
+#ifdef WITH_AF_XDP
+    if (ped(ws->w)->xdp) {
+        xdp_tx(ws, q);
+        return;
+    }
+#endif
+#ifdef WITH_IO_URING
+    if (ped(ws->w)->uring) {
+        uring_tx(ws, q);
+        return;
+    }
+#endif
+#ifndef NO_GSO
+    if (ped(ws->w)->udp_gso && w_iov_sq_cnt(q) > 1) {
+        gso_tx(ws, q);
+        return;
+    }
+#endif
     w_tx(ws, q);
     do
         w_nic_tx(ws->w);
@@ -394,7 +405,14 @@ static void __attribute__((nonnull)) do_tx_txq(struct q_conn * const c,
         c->pmtud_pkt = coalesce(
             q, unlikely(do_pmtud) ? pmtu : c->rec.max_pkt_size, do_pmtud);
     }
-    do_w_tx(ws, q);
+
+#ifndef NO_GSO
+    if (ped(c->w)->txtime)
+        // let the qdisc pace the whole window
+        txtime_tx(c, ws, q);
+    else
+#endif
+        do_w_tx(ws, q);
 
     // txq was allocated from warpcore, no metadata to be freed
     w_free(q);
@@ -403,6 +421,9 @@ static void __attribute__((nonnull)) do_tx_txq(struct q_conn * const c,
 
 static void __attribute__((nonnull)) do_tx(struct q_conn * const c)
 {
+    // protect all pkts that enc_pkt() queued in one pass
+    enc_aead_flush(c->w);
+
     // do it here instead of in on_pkt_sent()
     set_ld_timer(c);
     log_cc(c);
@@ -488,7 +509,16 @@ static void __attribute__((nonnull)) do_conn_mgmt(struct q_conn * const c)
 }
 
 
-static bool __attribute__((nonnull)) tx_stream(struct q_stream * const s)
+static inline bool __attribute__((nonnull))
+tx_more(const struct q_conn * const c, const uint32_t encoded)
+{
+    return (c->tx_limit == 0 || encoded < c->tx_limit) && c->no_wnd == false &&
+           c->paced == false;
+}
+
+
+static uint32_t __attribute__((nonnull))
+tx_stream(struct q_stream * const s, const uint32_t max)
 {
     struct q_conn * const c = s->c;
 
@@ -512,7 +542,7 @@ static bool __attribute__((nonnull)) tx_stream(struct q_stream * const s)
 #ifdef DEBUG_STREAMS
         warn(ERR, "skip " FMT_SID, s->id);
 #endif
-        return true;
+        return 0;
     }
 
 #ifdef DEBUG_STREAMS
@@ -522,7 +552,7 @@ static bool __attribute__((nonnull)) tx_stream(struct q_stream * const s)
 #endif
 
     uint32_t encoded = 0;
-    struct w_iov * v = s->out_una;
+    struct w_iov * v = max && s->out_nxt ? s->out_nxt : s->out_una;
     sq_foreach_from (v, &s->out, next) {
         struct pkt_meta * const m = &meta(v);
         if (unlikely(has_wnd(c, v->len) == false && c->tx_limit == 0)) {
@@ -544,6 +574,11 @@ static bool __attribute__((nonnull)) tx_stream(struct q_stream * const s)
             continue;
         }
 
+        if (c->tx_limit == 0 && pacer_ok(c, c->rec.max_pkt_size) == false) {
+            c->paced = true;
+            break;
+        }
+
         if (likely(hshk_done(c) && s->id >= 0)) {
             do_stream_fc(s, v->len);
             do_conn_fc(c, v->len);
@@ -570,9 +605,65 @@ static bool __attribute__((nonnull)) tx_stream(struct q_stream * const s)
 
         if (unlikely(c->state > conn_estb))
             break;
+
+        if (max && encoded == max) {
+            s->out_nxt = sq_next(v, next);
+            break;
+        }
     }
 
-    return (c->tx_limit == 0 || encoded < c->tx_limit) && c->no_wnd == false;
+    if (encoded)
+        // we may have sent the last unsent or lost data
+        need_tx_update(s);
+    return encoded;
+}
+
+
+static bool __attribute__((nonnull)) tx_by_prio(struct q_conn * const c)
+{
+    struct q_stream * s;
+    if (unlikely(c->tx_limit)) {
+        // PTO probes also RTX data in flight, which doesn't queue a stream
+        kh_foreach_value(&c->strms_by_id, s, {
+            if (tx_more(c, tx_stream(s, 0)) == false)
+                return false;
+        });
+        return true;
+    }
+
+    for (uint8_t u = 0; u < STRM_URG_CNT; u++) {
+        struct strm_prio * const p = &c->strm_prio[u];
+
+        // non-incremental streams go one after the other, in stream ID order;
+        // tx_stream() may dequeue s
+        struct q_stream * tmp;
+        dl_foreach_safe (s, &p->seq, node_prio, tmp)
+            if (tx_more(c, tx_stream(s, 0)) == false)
+                return false;
+
+        // incremental streams take turns, one pkt each
+        dl_foreach (s, &p->inc, node_prio)
+            s->out_nxt = 0;
+        bool progress;
+        do {
+            progress = false;
+            dl_foreach_safe (s, &p->inc, node_prio, tmp) {
+                const uint32_t n = tx_stream(s, 1);
+                if (tx_more(c, n) == false) {
+                    // next time, start with whoever is due after s
+                    struct q_stream * const due = n ? tmp : s;
+                    while (due && dl_first(&p->inc) != due) {
+                        struct q_stream * const x = dl_first(&p->inc);
+                        dl_remove(&p->inc, x, node_prio);
+                        dl_insert_tail(&p->inc, x, node_prio);
+                    }
+                    return false;
+                }
+                progress |= n > 0;
+            }
+        } while (progress);
+    }
+    return true;
 }
 
 
@@ -620,6 +711,7 @@ void tx(struct q_conn * const c)
         // TODO: we should also reset tp_peer here
     }
 
+    c->paced = false;
     if (unlikely(c->blocked))
         goto done;
 
@@ -629,15 +721,12 @@ void tx(struct q_conn * const c)
         for (epoch_t e = ep_init; e <= ep_data; e++) {
             if (c->cstrms[e] == 0)
                 continue;
-            if (tx_stream(c->cstrms[e]) == false)
+            if (tx_more(c, tx_stream(c->cstrms[e], 0)) == false)
                 goto done;
         }
 
-        struct q_stream * s;
-        kh_foreach_value(&c->strms_by_id, s, {
-            if (tx_stream(s) == false)
-                break;
-        });
+        if (tx_by_prio(c) && c->blocked == false)
+            on_app_limited(c);
     }
 
 done:;
@@ -658,33 +747,37 @@ done:;
     }
     if (likely(sent))
         do_tx(c);
+    if (unlikely(c->paced))
+        pacer_arm(c);
 }
 
 
 #ifndef NO_SRT_MATCHING
 void conns_by_srt_ins(struct q_conn * const c, uint8_t * const srt)
 {
+    khash_t(conns_by_srt) * const cbs = &ped(c->w)->conns_by_srt;
     int ret;
-    const khiter_t k = kh_put(conns_by_srt, &conns_by_srt, srt, &ret);
+    const khiter_t k = kh_put(conns_by_srt, cbs, srt, &ret);
     if (unlikely(ret == 0)) {
-        if (kh_val(&conns_by_srt, k) != c)
+        if (kh_val(cbs, k) != c)
             die("srt already in use by different conn ");
         else {
             warn(WRN, "srt %s already used for conn", srt_str(srt));
             return;
         }
     }
-    kh_val(&conns_by_srt, k) = c;
+    kh_val(cbs, k) = c;
 }
 
 
 static inline void __attribute__((nonnull))
-conns_by_srt_del(uint8_t * const srt)
+conns_by_srt_del(struct q_conn * const c, uint8_t * const srt)
 {
-    const khiter_t k = kh_get(conns_by_srt, &conns_by_srt, srt);
-    if (likely(k != kh_end(&conns_by_srt)))
+    khash_t(conns_by_srt) * const cbs = &ped(c->w)->conns_by_srt;
+    const khiter_t k = kh_get(conns_by_srt, cbs, srt);
+    if (likely(k != kh_end(cbs)))
         // if peer is reusing SRTs w/different CIDs, it may already be deleted
-        kh_del(conns_by_srt, &conns_by_srt, k);
+        kh_del(conns_by_srt, cbs, k);
 }
 #endif
 
@@ -693,19 +786,21 @@ conns_by_srt_del(uint8_t * const srt)
 static inline void __attribute__((nonnull))
 conns_by_id_ins(struct q_conn * const c, struct cid * const id)
 {
+    khash_t(conns_by_id) * const cbi = &ped(c->w)->conns_by_id;
     int ret;
-    const khiter_t k = kh_put(conns_by_id, &conns_by_id, id, &ret);
+    const khiter_t k = kh_put(conns_by_id, cbi, id, &ret);
     ensure(ret >= 1, "inserted returned %d", ret);
-    kh_val(&conns_by_id, k) = c;
+    kh_val(cbi, k) = c;
 }
 
 
 static inline void __attribute__((nonnull))
-conns_by_id_del(struct cid * const id)
+conns_by_id_del(struct q_conn * const c, struct cid * const id)
 {
-    const khiter_t k = kh_get(conns_by_id, &conns_by_id, id);
-    ensure(k != kh_end(&conns_by_id), "found");
-    kh_del(conns_by_id, &conns_by_id, k);
+    khash_t(conns_by_id) * const cbi = &ped(c->w)->conns_by_id;
+    const khiter_t k = kh_get(conns_by_id, cbi, id);
+    ensure(k != kh_end(cbi), "found");
+    kh_del(conns_by_id, cbi, k);
 }
 #endif
 
@@ -716,13 +811,14 @@ static void __attribute__((nonnull)) update_act_scid(struct q_conn * const c)
     // server picks a new random cid
     struct cid nscid = {.seq = 0};
     mk_rand_cid(&nscid, ped(c->w)->conf.server_cid_len, true);
+    shard_tag_cid(c->w, &nscid);
     cid_cpy(&c->odcid, c->scid);
     mk_cid_str(NTE, &nscid, scid_str_new);
     mk_cid_str(NTE, c->scid, scid_str_prev);
     warn(NTE, "hshk switch to scid %s for %s %s conn (was %s)", scid_str_new,
          conn_state_str[c->state], conn_type(c), scid_str_prev);
 #ifndef NO_MIGRATION
-    conns_by_id_del(c->scid);
+    conns_by_id_del(c, c->scid);
     cids_by_id_del(&c->scids_by_id, c->scid);
 #endif
     cid_cpy(c->scid, &nscid);
@@ -778,7 +874,7 @@ void add_dcid(struct q_conn * const c, const struct cid * const id)
 #endif
 #ifndef NO_SRT_MATCHING
         if (dcid->has_srt)
-            conns_by_srt_del(dcid->srt);
+            conns_by_srt_del(c, dcid->srt);
 #endif
     }
     cid_cpy(dcid, id);
@@ -817,10 +913,10 @@ rx_crypto(struct q_conn * const c, const struct pkt_meta * const m_cur)
         if (c->state == conn_idle || c->state == conn_opng) {
             conn_to_state(c, conn_estb);
             if (is_clnt(c))
-                maybe_api_return(q_connect, c, 0);
+                maybe_api_return(c->w, q_connect, c, 0);
 #ifndef NO_SERVER
             else if (c->needs_accept == false) {
-                sl_insert_head(&accept_queue, c, node_aq);
+                sl_insert_head(&ped(c->w)->accept_queue, c, node_aq);
                 c->needs_accept = true;
             }
 
@@ -836,7 +932,7 @@ static void __attribute__((nonnull)) free_cids(struct q_conn * const c)
     if (is_clnt(c) == false && c->odcid.len) {
         // TODO: we should stop accepting pkts on the client odcid earlier
         cids_by_id_del(&c->scids_by_id, &c->odcid);
-        conns_by_id_del(&c->odcid);
+        conns_by_id_del(c, &c->odcid);
     }
 
     while (!splay_empty(&c->scids_by_seq)) {
@@ -888,7 +984,7 @@ new_initial_cids(struct q_conn * const c,
     else
 #endif
         if (c->in_c_zcid == false) {
-        sl_insert_head(&c_zcid, c, node_zcid_int);
+        sl_insert_head(&ped(c->w)->c_zcid, c, node_zcid_int);
         c->in_c_zcid = true;
     }
 }
@@ -1028,13 +1124,12 @@ static bool __attribute__((nonnull)) rx_pkt(const struct w_sock * const ws
 #ifndef NO_OOO_0RTT
         // check if any reordered 0-RTT packets are cached for this CID
         const struct ooo_0rtt which = {.cid = m->hdr.dcid};
-        struct ooo_0rtt * const zo =
-            splay_find(ooo_0rtt_by_cid, &ooo_0rtt_by_cid, &which);
+        struct ooo_0rtt_by_cid * const zos = &ped(c->w)->ooo_0rtt_by_cid;
+        struct ooo_0rtt * const zo = splay_find(ooo_0rtt_by_cid, zos, &which);
         if (zo) {
             warn(INF, "have reordered 0-RTT pkt for %s conn %s", conn_type(c),
                  cid_str(c->scid));
-            ensure(splay_remove(ooo_0rtt_by_cid, &ooo_0rtt_by_cid, zo),
-                   "removed");
+            ensure(splay_remove(ooo_0rtt_by_cid, zos, zo), "removed");
             sq_insert_head(x, zo->v, next);
             free(zo);
         }
@@ -1178,6 +1273,8 @@ done:
             break;
         }
         pn->pkts_rxed_since_last_ack_tx++;
+        if (is_ack_eliciting(&m->frms))
+            pn->ae_rxed_since_last_ack_tx++;
 
         // if (pn == &c->pns[pn_data] && pn->pkts_rxed_since_last_ack_tx >= 16)
         //     tx_ack(c, ep_data, false);
@@ -1212,17 +1309,15 @@ static void __attribute__((nonnull))
 #if !defined(NDEBUG) && !defined(FUZZING) && defined(FUZZER_CORPUS_COLLECTION)
         // when called from the fuzzer, xv->wv_af is zero
         if (xv->wv_af)
-            write_to_corpus(corpus_pkt_dir, xv->buf, xv->len);
+            write_to_corpus(ped(ws->w)->corpus_pkt_dir, xv->buf, xv->len);
 #endif
 
-        // allocate new w_iov for the (eventual) unencrypted data and meta-data
-        struct pkt_meta * m;
-        struct w_iov * const v = alloc_iov(ws->w, ws->ws_af, 0, 0, &m);
-        v->saddr = xv->saddr;
-        v->flags = xv->flags;
-        v->ttl = xv->ttl;
-        v->len = xv->len; // this is just so that log_pkt can show the rx len
-        m->t = loop_now();
+        // we decrypt in place, so the datagram buffer also holds the
+        // unencrypted data; its meta-data was cleared when last freed
+        struct w_iov * const v = xv;
+        struct pkt_meta * const m = &meta(v);
+        ASAN_UNPOISON_MEMORY_REGION(m, sizeof(*m));
+        m->t = loop_now(ws->w);
 
         bool pkt_valid = false;
         const bool is_clnt = w_connected(ws);
@@ -1257,7 +1352,15 @@ static void __attribute__((nonnull))
         }
 
 #ifndef NO_MIGRATION
-        c = get_conn_by_cid(&m->hdr.dcid);
+        c = get_conn_by_cid(ws->w, &m->hdr.dcid);
+#ifndef NO_SERVER
+        if (unlikely(c == 0 && ped(ws->w)->shards) && !is_clnt &&
+            shard_handoff(ws, xv, &m->hdr.dcid)) {
+            // another shard owns this cid, it will process the pkt
+            free_iov(v, m);
+            goto next;
+        }
+#endif
         if (c == 0 && m->hdr.dcid.len == 0)
 #endif
             c = (struct q_conn *)ws->data;
@@ -1341,11 +1444,14 @@ static void __attribute__((nonnull))
                 ensure(zo, "could not calloc");
                 cid_cpy(&zo->cid, &m->hdr.dcid);
                 zo->v = v;
-                ensure(splay_insert(ooo_0rtt_by_cid, &ooo_0rtt_by_cid, zo) == 0,
+                ensure(splay_insert(ooo_0rtt_by_cid,
+                                    &ped(ws->w)->ooo_0rtt_by_cid, zo) == 0,
                        "inserted");
                 log_pkt("RX", v, &v->saddr, tok, tok_len, rit);
                 warn(INF, "caching 0-RTT pkt for unknown conn %s",
                      cid_str(&m->hdr.dcid));
+                // the (still encrypted) pkt is parsed again from scratch
+                memset(m, 0, sizeof(*m));
                 goto next;
             }
 #endif
@@ -1354,6 +1460,7 @@ static void __attribute__((nonnull))
             if (is_srt(xv, m)) {
                 warn(INF, BLU BLD "STATELESS RESET" NRM " token=%s",
                      srt_str(&xv->buf[xv->len - SRT_LEN]));
+                free_iov(v, m);
                 goto next;
             }
 
@@ -1445,7 +1552,8 @@ static void __attribute__((nonnull))
 #endif
             ) {
 #if !defined(NO_MIGRATION) || !defined(NDEBUG)
-                const uint_t max_recv_all = diet_max(&c->pns[pn_data].recv_all);
+                const uint_t max_recv_all =
+                    rx_hist_max(&c->pns[pn_data].recv_all);
 #endif
 #ifndef NO_MIGRATION
                 if (m->hdr.nr <= max_recv_all) {
@@ -1496,7 +1604,7 @@ static void __attribute__((nonnull))
                     goto drop;
 #endif
                 diet_insert(&pn->recv, m->hdr.nr, m->t);
-                diet_insert(&pn->recv_all, m->hdr.nr, 0);
+                rx_hist_insert(&pn->recv_all, m->hdr.nr);
             }
             pkt_valid = true;
 
@@ -1538,7 +1646,6 @@ static void __attribute__((nonnull))
                 c->i.pkts_in_invalid++;
         }
 #endif
-        w_free_iov(xv);
     }
 }
 
@@ -1567,7 +1674,7 @@ void restart_idle_alarm(struct q_conn * const c)
 
 static void __attribute__((nonnull)) restart_ack_alarm(struct q_conn * const c)
 {
-    const timeout_t t = c->tp_mine.max_ack_del * NS_PER_MS;
+    const timeout_t t = ack_del_ns(c);
 
 #ifdef DEBUG_TIMERS
     warn(DBG, "next ACK alarm in %.3f sec", (double)t / NS_PER_S);
@@ -1577,12 +1684,46 @@ static void __attribute__((nonnull)) restart_ack_alarm(struct q_conn * const c)
 }
 
 
+void sock_opened(struct w_sock * const ws)
+{
+    // let the optional datapaths take over the new socket
+    gro_enable(ws);
+    txtime_enable(ws);
+    uring_add_sock(ws);
+    xdp_add_sock(ws);
+
+    // io_uring reports socket I/O on the ring fd instead
+    if (ped(ws->w)->uring == 0)
+        add_pfd(ws->w, w_fd(ws));
+}
+
+
+void sock_closing(struct w_sock * const ws)
+{
+    uring_del_sock(ws);
+    xdp_del_sock(ws);
+    if (ped(ws->w)->uring == 0)
+        del_pfd(ws->w, w_fd(ws));
+}
+
+
 void rx(struct w_sock * const ws)
 {
     struct w_iov_sq x = w_iov_sq_initializer(x);
+#ifndef NO_GSO
+    if (ped(ws->w)->udp_gro)
+        gro_rx(ws, &x);
+    else
+#endif
+        w_rx(ws, &x);
+    do_rx(ws, &x);
+}
+
+
+void do_rx(struct w_sock * const ws, struct w_iov_sq * const x)
+{
     struct q_conn_sl crx = sl_head_initializer(crx);
-    w_rx(ws, &x);
-    rx_pkts(&x, &crx, ws);
+    rx_pkts(x, &crx, ws);
 
     // for all connections that had RX events
     while (!sl_empty(&crx)) {
@@ -1631,9 +1772,9 @@ void rx(struct w_sock * const ws)
         else
 #endif
             if (c->have_new_data && !c->in_c_ready) {
-            sl_insert_head(&c_ready, c, node_rx_ext);
+            sl_insert_head(&ped(c->w)->c_ready, c, node_rx_ext);
             c->in_c_ready = true;
-            maybe_api_return(q_ready, 0, 0);
+            maybe_api_return(c->w, q_ready, 0, 0);
         }
     }
 }
@@ -1722,13 +1863,13 @@ static void __attribute__((nonnull)) enter_closed(struct q_conn * const c)
     stop_all_alarms(c);
 
     if (!c->in_c_ready) {
-        sl_insert_head(&c_ready, c, node_rx_ext);
+        sl_insert_head(&ped(c->w)->c_ready, c, node_rx_ext);
         c->in_c_ready = true;
     }
 
     // terminate whatever API call is currently active
-    maybe_api_return(c, 0);
-    maybe_api_return(q_ready, 0, 0);
+    maybe_api_return(c->w, c, 0);
+    maybe_api_return(c->w, q_ready, 0, 0);
 }
 
 
@@ -1802,6 +1943,20 @@ void update_conf(struct q_conn * const c, const struct q_conn_conf * const conf)
         true;
 #endif
     c->key_flips_enabled = get_conf_uncond(c->w, conf, enable_tls_key_updates);
+    c->pacer.burst = get_conf(c->w, conf, pacing_burst);
+
+    const struct cc_ops * const cc = cc_lookup(get_conf(c->w, conf, cc_algo));
+    if (cc != c->rec.cc) {
+        warn(INF, "%s conn %s uses %s CC", conn_type(c), cid_str(c->scid),
+             cc->name);
+        c->rec.cc = cc;
+        cc->init(c);
+    }
+
+    // ECN settings can only change before the first ECT-marked pkt is sent
+    if (c->rec.ecn.test_sent == 0)
+        init_ecn(c, get_conf_uncond(c->w, conf, disable_ecn) == false,
+                 get_conf_uncond(c->w, conf, enable_l4s));
 
     if (c->tp_peer.disable_active_migration == false || c->key_flips_enabled) {
         c->tls_key_update_frequency =
@@ -1869,6 +2024,7 @@ struct q_conn * new_conn(struct w_engine * const w,
         if (unlikely(c->sock == 0))
             goto fail;
         c->holds_sock = true;
+        sock_opened(c->sock);
 #ifndef NO_SERVER
         if (peer == 0)
             // remember server socket
@@ -1886,6 +2042,10 @@ struct q_conn * new_conn(struct w_engine * const w,
     c->next_sid_bidi = is_clnt(c) ? 0 : STRM_FL_SRV;
     c->next_sid_uni = is_clnt(c) ? STRM_FL_UNI : STRM_FL_UNI | STRM_FL_SRV;
     sq_init(&c->txq);
+    for (uint8_t u = 0; u < STRM_URG_CNT; u++) {
+        dl_init(&c->strm_prio[u].seq);
+        dl_init(&c->strm_prio[u].inc);
+    }
 #ifndef NO_MIGRATION
     sq_init(&c->migr_txq);
     splay_init(&c->dcids_by_seq);
@@ -1912,6 +2072,9 @@ struct q_conn * new_conn(struct w_engine * const w,
     timeout_setcb(&c->ack_alarm, ack_alarm, c);
 
     // initialize recovery state
+    c->rec.cc = cc_lookup(ped(w)->default_conn_conf.cc_algo);
+    init_ecn(c, ped(w)->default_conn_conf.disable_ecn == false,
+             ped(w)->default_conn_conf.enable_l4s);
     init_rec(c);
     if (is_clnt(c))
         c->path_val_win = UINT_T_MAX;
@@ -1921,6 +2084,7 @@ struct q_conn * new_conn(struct w_engine * const w,
     // start a TX watcher
     timeout_init(&c->tx_w, TIMEOUT_ABS);
     timeout_setcb(&c->tx_w, tx, c);
+    init_pacer(c, ped(c->w)->default_conn_conf.pacing_burst);
 
     if (likely(is_clnt(c) || c->holds_sock == false))
         update_conf(c, conf);
@@ -1929,6 +2093,9 @@ struct q_conn * new_conn(struct w_engine * const w,
     c->tp_mine.max_pkt = w_max_udp_payload(c->sock);
     c->tp_mine.ack_del_exp = c->tp_peer.ack_del_exp = DEF_ACK_DEL_EXP;
     c->tp_mine.max_ack_del = c->tp_peer.max_ack_del = DEF_MAX_ACK_DEL;
+    c->tp_mine.min_ack_del =
+        get_conf_uncond(w, conf, disable_ack_freq) ? 0 : DEF_MIN_ACK_DEL;
+    init_ack_freq(c);
     c->tp_mine.max_strm_data_uni = is_clnt(c) ? INIT_STRM_DATA_UNI : 0;
     c->tp_mine.max_strms_uni = is_clnt(c) ? INIT_MAX_UNI_STREAMS : 0;
     c->tp_mine.max_strms_bidi = INIT_MAX_BIDI_STREAMS;
@@ -1968,6 +2135,7 @@ struct q_conn * new_conn(struct w_engine * const w,
             c->max_cid_seq_out = c->tp_mine.pref_addr.cid.seq = 1;
             mk_rand_cid(&c->tp_mine.pref_addr.cid,
                         ped(c->w)->conf.server_cid_len, true);
+            shard_tag_cid(c->w, &c->tp_mine.pref_addr.cid);
             add_scid(c, &c->tp_mine.pref_addr.cid);
         }
     }
@@ -2009,7 +2177,7 @@ void free_scid(struct q_conn * const c
 #ifndef NO_MIGRATION
     ensure(splay_remove(cids_by_seq, &c->scids_by_seq, id), "removed");
     cids_by_id_del(&c->scids_by_id, id);
-    conns_by_id_del(id);
+    conns_by_id_del(c, id);
 #endif
     free(id);
 }
@@ -2024,7 +2192,7 @@ void free_dcid(struct q_conn * const c
 {
 #ifndef NO_SRT_MATCHING
     if (id->has_srt)
-        conns_by_srt_del(id->srt);
+        conns_by_srt_del(c, id->srt);
 #endif
 #ifndef NO_MIGRATION
     ensure(splay_remove(cids_by_seq, &c->dcids_by_seq, id), "removed");
@@ -2036,7 +2204,7 @@ void free_dcid(struct q_conn * const c
 void free_conn(struct q_conn * const c)
 {
     // exit any active API call on the connection
-    maybe_api_return(c, 0);
+    maybe_api_return(c->w, c, 0);
 
     stop_all_alarms(c);
 
@@ -2056,6 +2224,7 @@ void free_conn(struct q_conn * const c)
         free_pn(&c->pns[t]);
 
     timeout_del(&c->tx_w);
+    timeout_del(&c->pacer.alarm);
 
     diet_free(&c->clsd_strms);
 
@@ -2065,16 +2234,22 @@ void free_conn(struct q_conn * const c)
     kh_release(cids_by_id, &c->scids_by_id);
 #endif
 
-    if (c->holds_sock)
+    if (c->holds_sock) {
         // only close the socket for the final server connection
+        sock_closing(c->sock);
         w_close(c->sock);
+    }
 
     if (c->in_c_ready)
-        sl_remove(&c_ready, c, q_conn, node_rx_ext);
+        sl_remove(&ped(c->w)->c_ready, c, q_conn, node_rx_ext);
+
+    if (ped(c->w)->cb_conn == c)
+        // tell dispatch_events() that the app freed this conn in a callback
+        ped(c->w)->cb_conn = 0;
 
 #ifndef NO_SERVER
     if (c->needs_accept)
-        sl_remove(&accept_queue, c, q_conn, node_aq);
+        sl_remove(&ped(c->w)->accept_queue, c, q_conn, node_aq);
 #endif
 
     qlog_close(c);
@@ -2090,5 +2265,11 @@ void conn_info_populate(struct q_conn * const c)
     c->i.ssthresh = c->rec.cur.ssthresh;
     c->i.rtt = (float)c->rec.cur.srtt / US_PER_S;
     c->i.rttvar = (float)c->rec.cur.rttvar / US_PER_S;
+    c->i.cc_min_rtt = c->rec.cur.min_rtt == UINT_T_MAX
+                          ? 0
+                          : (float)c->rec.cur.min_rtt / US_PER_S;
+    c->i.cc_bw = (float)c->rec.rs.bw;
+    if (c->rec.cc->info)
+        c->rec.cc->info(c, &c->i);
 }
 #endif
@@ -42,7 +42,10 @@
 #include <quant/quant.h>
 #include <timeout.h>
 
+#include "ackfreq.h"
 #include "diet.h"
+#include "dlist.h"
+#include "pacer.h"
 #include "pn.h"
 #include "quic.h"
 #include "recovery.h"
@@ -52,54 +55,16 @@
 KHASH_MAP_INIT_INT64(strms_by_id, struct q_stream *)
 
 
-static inline int __attribute__((nonnull, no_instrument_function))
-cid_cmp(const struct cid * const a, const struct cid * const b)
-{
-    // if the lengths are different, memcmp will fail on the first byte
-    return memcmp(&a->len, &b->len, a->len + sizeof(a->len));
-}
-
-
-#ifndef NO_MIGRATION
-static inline khint_t __attribute__((nonnull, no_instrument_function))
-hash_cid(const struct cid * const id)
-{
-    return fnv1a_32(id->id, id->len);
-}
-
-
-static inline int __attribute__((nonnull, no_instrument_function))
-kh_cid_cmp(const struct cid * const a, const struct cid * const b)
-{
-    return cid_cmp(a, b) == 0;
-}
+#define STRM_URG_CNT 8 ///< Number of RFC9218 urgency levels; 0 is most urgent.
+#define STRM_URG_DEF 3 ///< Default RFC9218 urgency of a stream.
 
+dl_head(q_stream_dl, q_stream);
 
-KHASH_INIT(conns_by_id, struct cid *, struct q_conn *, 1, hash_cid, kh_cid_cmp)
-
-extern khash_t(conns_by_id) conns_by_id;
-#endif
-
-
-#ifndef NO_SRT_MATCHING
-static inline khint_t __attribute__((nonnull, no_instrument_function))
-hash_srt(const uint8_t * const srt)
-{
-    return fnv1a_32(srt, SRT_LEN);
-}
-
-
-static inline int __attribute__((nonnull, no_instrument_function))
-kh_srt_cmp(const uint8_t * const a, const uint8_t * const b)
-{
-    return memcmp(a, b, SRT_LEN) == 0;
-}
-
-
-KHASH_INIT(conns_by_srt, uint8_t *, struct q_conn *, 1, hash_srt, kh_srt_cmp)
-
-extern khash_t(conns_by_srt) conns_by_srt;
-#endif
+/// Regular streams of one RFC9218 urgency level.
+struct strm_prio {
+    struct q_stream_dl seq; ///< Non-incremental streams, by stream ID.
+    struct q_stream_dl inc; ///< Incremental streams, in round-robin order.
+};
 
 
 struct pref_addr {
@@ -119,6 +84,7 @@ struct transport_params {
     uint_t max_strms_bidi;
     uint_t max_idle_to;
     uint_t max_ack_del;
+    uint_t min_ack_del; ///< In usec; zero if ACK_FREQUENCY is not supported.
     uint_t max_pkt;
     uint_t act_cid_lim;
     uint_t ack_del_exp;
@@ -129,9 +95,6 @@ struct transport_params {
 };
 
 
-sl_head(q_conn_sl, q_conn);
-
-
 #define CONN_STATE(k, v) k = v
 #define CONN_STATES                                                            \
     CONN_STATE(conn_clsd, 0), CONN_STATE(conn_idle, 1),                        \
@@ -150,6 +113,7 @@ extern const char * const conn_state_str[];
 
 #define DEF_ACK_DEL_EXP 3
 #define DEF_MAX_ACK_DEL 25 // ms
+#define DEF_MIN_ACK_DEL 1000 // us
 
 #ifndef NO_MIGRATION
 splay_head(cids_by_seq, cid);
@@ -222,14 +186,16 @@ struct q_conn {
     uint32_t do_qr_test : 1;        ///< Perform quantum-readiness test.
     uint32_t tx_hshk_done : 1;      ///< Send HANDSHAKE_DONE.
     uint32_t in_c_zcid : 1;
-    uint32_t tx_new_tok : 1; ///< Send NEW_TOKEN.
-    uint32_t : 2;
+    uint32_t tx_new_tok : 1;  ///< Send NEW_TOKEN.
+    uint32_t paced : 1;       ///< TX is stalled by the pacer.
+    uint32_t tx_ack_freq : 1; ///< Send ACK_FREQUENCY.
 
     conn_state_t state; ///< State of the connection.
 
     struct w_engine * w; ///< Underlying warpcore engine.
 
     struct timeout tx_w; ///< TX watcher.
+    struct pacer pacer;  ///< Packet pacer.
 
     uint32_t vers;         ///< QUIC version in use for this connection.
     uint32_t vers_initial; ///< QUIC version first negotiated.
@@ -247,6 +213,7 @@ struct q_conn {
     khash_t(strms_by_id) strms_by_id;      ///< Regular streams.
     struct diet clsd_strms;
     sl_head(q_stream_head, q_stream) need_ctrl;
+    struct strm_prio strm_prio[STRM_URG_CNT]; ///< Streams with data to TX.
 
     struct w_sock * sock; ///< File descriptor (socket) for the connection.
 
@@ -257,6 +224,7 @@ struct q_conn {
 
     struct recovery rec; ///< Loss recovery state.
     struct tls tls;      ///< TLS state.
+    struct ack_freq afq; ///< ACK frequency state.
 
     dint_t next_sid_bidi; ///< Next unidir stream ID to use on q_rsv_stream().
     dint_t next_sid_uni;  ///< Next bidi stream ID to use on q_rsv_stream().
@@ -319,7 +287,6 @@ struct q_conn {
 
 #ifndef NO_SERVER
 #define is_clnt(c) (c)->is_clnt
-extern struct q_conn_sl c_embr;
 #else
 #define is_clnt(c) 1
 #endif
@@ -328,9 +295,6 @@ extern struct q_conn_sl c_embr;
 #define hshk_done(c) (c)->pns[pn_hshk].abandoned
 
 
-extern struct q_conn_sl c_ready;
-extern struct q_conn_sl c_zcid;
-
 #if !defined(NDEBUG) && defined(DEBUG_EXTRA) && !defined(FUZZING)
 #define conn_to_state(c, s)                                                    \
     do {                                                                       \
@@ -401,14 +365,27 @@ update_conf(struct q_conn * const c, const struct q_conn_conf * const conf);
 
 #ifndef NO_SRT_MATCHING
 extern struct q_conn * __attribute__((nonnull))
-get_conn_by_srt(uint8_t * const srt);
+get_conn_by_srt(struct w_engine * const w, uint8_t * const srt);
 
 extern void __attribute__((nonnull))
 conns_by_srt_ins(struct q_conn * const c, uint8_t * const srt);
 #endif
 
+extern void __attribute__((nonnull)) sock_opened(struct w_sock * const ws);
+
+extern void __attribute__((nonnull)) sock_closing(struct w_sock * const ws);
+
 extern void __attribute__((nonnull)) rx(struct w_sock * const ws);
 
+extern void __attribute__((nonnull))
+do_rx(struct w_sock * const ws, struct w_iov_sq * const x);
+
+#ifndef NO_SERVER
+extern struct w_sock * __attribute__((nonnull))
+get_local_sock_by_ipnp(struct per_engine_data * const ped,
+                       const struct w_sockaddr * const local);
+#endif
+
 extern void __attribute__((nonnull))
 conn_info_populate(struct q_conn * const c);
 
@@ -450,27 +427,6 @@ cids_by_seq_cmp(const struct cid * const a, const struct cid * const b)
 SPLAY_PROTOTYPE(cids_by_seq, cid, node_seq, cids_by_seq_cmp)
 #endif
 
-#ifndef NO_OOO_0RTT
-struct ooo_0rtt {
-    splay_entry(ooo_0rtt) node;
-    struct cid cid;   ///< CID of 0-RTT pkt
-    struct w_iov * v; ///< the buffer containing the 0-RTT pkt
-};
-
-
-extern splay_head(ooo_0rtt_by_cid, ooo_0rtt) ooo_0rtt_by_cid;
-
-
-static inline int __attribute__((nonnull, no_instrument_function))
-ooo_0rtt_by_cid_cmp(const struct ooo_0rtt * const a,
-                    const struct ooo_0rtt * const b)
-{
-    return cid_cmp(&a->cid, &b->cid);
-}
-
-
-SPLAY_PROTOTYPE(ooo_0rtt_by_cid, ooo_0rtt, node, ooo_0rtt_by_cid_cmp)
-#endif
 
 static inline __attribute__((nonnull, no_instrument_function)) const char *
 conn_type(const struct q_conn * const c
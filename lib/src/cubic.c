@@ -0,0 +1,216 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <stdint.h>
+#include <sys/param.h>
+
+#include <quant/quant.h>
+
+#include "cc.h"
+#include "conn.h"
+#include "loop.h"
+#include "pacer.h"
+#include "pkt.h"
+#include "quic.h"
+#include "recovery.h"
+
+// CUBIC, see RFC8312 and draft-ietf-tcpm-rfc8312bis
+
+/// CUBIC multiplicative decrease factor, as a fraction (7/10 = 0.7).
+#define CUBIC_BETA_NUM 7
+#define CUBIC_BETA_DEN 10
+
+/// CUBIC scaling constant, as a fraction (4/10 = 0.4).
+#define CUBIC_C_NUM 4
+#define CUBIC_C_DEN 10
+
+/// Reno-friendly additive increase 3 * (1 - beta) / (1 + beta) = 9/17.
+#define CUBIC_ALPHA_NUM 9
+#define CUBIC_ALPHA_DEN 17
+
+/// Limit for |t - K| in ms, so the cube fits in 64 bits.
+#define CUBIC_MAX_DT (100 * MS_PER_S)
+
+
+static uint64_t __attribute__((const)) icbrt(uint64_t x)
+{
+    // bitwise integer cube root, see Hacker's Delight
+    uint64_t y = 0;
+    for (int s = 63; s >= 0; s -= 3) {
+        y <<= 1;
+        const uint64_t b = 3 * y * (y + 1) + 1;
+        if ((x >> s) >= b) {
+            x -= b << s;
+            y++;
+        }
+    }
+    return y;
+}
+
+
+static uint_t __attribute__((nonnull))
+w_cubic(const struct q_conn * const c, const uint64_t t)
+{
+    // W_cubic(t) = C * (t - K)^3 + W_max, in bytes and with t in ms
+    const struct cubic * const cu = &c->rec.cc_priv.cubic;
+    const bool neg = t < cu->k;
+    const uint64_t dt = MIN(neg ? cu->k - t : t - cu->k, CUBIC_MAX_DT);
+    const uint64_t d = dt * dt * dt / MS_PER_S * CUBIC_C_NUM *
+                       c->rec.max_pkt_size /
+                       (CUBIC_C_DEN * MS_PER_S * MS_PER_S);
+    if (neg)
+        return d >= cu->w_max ? 0 : cu->w_max - (uint_t)d;
+    return (uint_t)MIN(cu->w_max + d, UINT_T_MAX);
+}
+
+
+static void __attribute__((nonnull)) start_epoch(struct q_conn * const c)
+{
+    struct cubic * const cu = &c->rec.cc_priv.cubic;
+    cu->epoch_t = loop_now(c->w);
+    cu->cwnd_epoch = cu->w_est = c->rec.cur.cwnd;
+    if (cu->w_max <= c->rec.cur.cwnd) {
+        cu->k = 0;
+        cu->w_max = c->rec.cur.cwnd;
+    } else
+        // K = cubic_root((W_max - cwnd_epoch) / C), in ms
+        cu->k = icbrt((uint64_t)(cu->w_max - cu->cwnd_epoch) * CUBIC_C_DEN *
+                      MS_PER_S / (CUBIC_C_NUM * c->rec.max_pkt_size) *
+                      MS_PER_S * MS_PER_S);
+}
+
+
+static void __attribute__((nonnull)) cubic_init(struct q_conn * const c)
+{
+    c->rec.cur.cwnd = kInitialWindow(c->rec.max_pkt_size);
+    c->rec.cur.ssthresh = UINT_T_MAX;
+    c->rec.cc_priv.cubic = (struct cubic){0};
+    hystart_init(c);
+}
+
+
+static void __attribute__((nonnull))
+cubic_on_ack(struct q_conn * const c, const struct acked * const a)
+{
+    if (a->cc_bytes == 0)
+        return;
+
+    if (c->rec.cur.cwnd < c->rec.cur.ssthresh) {
+        c->rec.cur.cwnd += hystart_ss_incr(c, a);
+        return;
+    }
+
+    struct cubic * const cu = &c->rec.cc_priv.cubic;
+    if (unlikely(cu->epoch_t == 0))
+        start_epoch(c);
+
+    const uint_t mss = c->rec.max_pkt_size;
+    const uint_t cwnd = c->rec.cur.cwnd;
+    const uint64_t t = NS_TO_MS(loop_now(c->w) - cu->epoch_t);
+
+    // TCP-friendly region: grow at least as fast as Reno would
+    cu->w_est += (uint_t)((uint64_t)CUBIC_ALPHA_NUM * mss * a->cc_bytes /
+                          ((uint64_t)CUBIC_ALPHA_DEN * cwnd));
+    if (w_cubic(c, t) < cu->w_est) {
+        c->rec.cur.cwnd = MAX(cwnd, cu->w_est);
+        return;
+    }
+
+    // concave or convex region: approach W_cubic(t + RTT)
+    const uint_t target =
+        MIN(MAX(w_cubic(c, t + c->rec.cur.srtt / US_PER_MS), cwnd),
+            cwnd + cwnd / 2);
+    c->rec.cur.cwnd +=
+        (uint_t)((uint64_t)(target - cwnd) * a->cc_bytes / cwnd);
+}
+
+
+static void __attribute__((nonnull))
+cubic_on_loss(struct q_conn * const c,
+              const uint64_t sent_t __attribute__((unused)))
+{
+    struct cubic * const cu = &c->rec.cc_priv.cubic;
+    const uint_t cwnd = c->rec.cur.cwnd;
+
+    // fast convergence: release bandwidth to newer flows
+    if (cwnd < cu->w_max)
+        cu->w_max = cwnd * (CUBIC_BETA_DEN + CUBIC_BETA_NUM) /
+                    (2 * CUBIC_BETA_DEN);
+    else
+        cu->w_max = cwnd;
+    cu->epoch_t = 0;
+
+    c->rec.cur.ssthresh = c->rec.cur.cwnd =
+        MAX(cwnd * CUBIC_BETA_NUM / CUBIC_BETA_DEN,
+            kMinimumWindow(c->rec.max_pkt_size));
+    c->rec.hystart.in_css = false;
+}
+
+
+static void __attribute__((nonnull))
+cubic_on_persistent_congestion(struct q_conn * const c)
+{
+    c->rec.cur.cwnd = kMinimumWindow(c->rec.max_pkt_size);
+    c->rec.cc_priv.cubic.epoch_t = 0;
+    c->rec.hystart.in_css = false;
+}
+
+
+static void __attribute__((nonnull))
+cubic_app_limited(struct q_conn * const c)
+{
+    // we only went idle if we ran out of data with nothing in flight
+    struct cubic * const cu = &c->rec.cc_priv.cubic;
+    if (c->rec.cur.in_flight == 0 && cu->idle_t == 0)
+        cu->idle_t = loop_now(c->w);
+}
+
+
+static void __attribute__((nonnull)) cubic_tx_start(struct q_conn * const c)
+{
+    // don't let W_cubic(t) run away while idle, see rfc8312bis 5.8
+    struct cubic * const cu = &c->rec.cc_priv.cubic;
+    if (cu->idle_t == 0)
+        return;
+    const uint64_t now = loop_now(c->w);
+    if (cu->epoch_t)
+        cu->epoch_t = MIN(cu->epoch_t + (now - cu->idle_t), now);
+    cu->idle_t = 0;
+}
+
+
+const struct cc_ops cc_cubic = {
+    .name = "cubic",
+    .init = cubic_init,
+    .on_ack = cubic_on_ack,
+    .on_loss = cubic_on_loss,
+    .on_persistent_congestion = cubic_on_persistent_congestion,
+    .pacing_rate = cwnd_pacing_rate,
+    .app_limited = cubic_app_limited,
+    .tx_start = cubic_tx_start,
+};
@@ -25,90 +25,127 @@
 // ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 // POSSIBILITY OF SUCH DAMAGE.
 
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <quant/quant.h>
 
 #include "diet.h"
 
 
-SPLAY_GENERATE(diet, ival, node, ival_cmp)
-
-
-/// Return maximum interval underneath @p i.
+/// Index of the first interval in diet @p d whose upper bound is at least
+/// @p n, or the number of intervals if there is none.
 ///
-/// @param      i     Interval inside diet tree.
+/// @param      d     Diet.
+/// @param[in]  n     Integer.
 ///
-/// @return     Largest interval underneath @p i.
+/// @return     Index into diet_ivals(d).
 ///
-static inline struct ival * find_max(struct ival * const i)
+static inline uint_t __attribute__((nonnull))
+lower_bound(struct diet * const d, const uint_t n)
 {
-    if (i == 0)
-        return 0;
-    struct ival * n = i;
-    while (splay_right(n, node))
-        n = splay_right(n, node);
-    return n;
+    const struct ival * const iv = diet_ivals(d);
+
+    // most lookups are at or near the largest interval
+    if (d->cnt == 0 || n > iv[d->cnt - 1].hi)
+        return d->cnt;
+
+    uint_t lo = 0;
+    uint_t hi = d->cnt - 1;
+    if (d->cnt <= DIET_INLINE)
+        while (iv[lo].hi < n)
+            lo++;
+    else
+        while (lo < hi) {
+            const uint_t mid = lo + (hi - lo) / 2;
+            if (iv[mid].hi < n)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+    return lo;
 }
 
 
-/// Return minimum interval underneath @p i.
+/// Make room for @p cnt new intervals at index @p idx of diet @p d.
 ///
-/// @param      i     Interval inside diet tree.
+/// @param      d     Diet.
+/// @param[in]  idx   Index to insert at.
+/// @param[in]  cnt   Number of intervals to make room for.
 ///
-/// @return     Smallest interval underneath @p i.
+/// @return     Pointer to the first new interval.
 ///
-static inline struct ival * find_min(struct ival * const i)
+static struct ival * __attribute__((nonnull))
+make_room(struct diet * const d, const uint_t idx, const uint_t cnt)
 {
-    if (i == 0)
-        return 0;
-    struct ival * n = i;
-    while (splay_left(n, node))
-        n = splay_left(n, node);
-    return n;
+    const uint_t cap = d->cap ? d->cap : DIET_INLINE;
+    if (d->cnt + cnt > cap) {
+        uint_t new_cap = cap * 2;
+        while (d->cnt + cnt > new_cap)
+            new_cap *= 2;
+        struct ival * heap;
+        if (d->cap)
+            heap = realloc(d->heap, new_cap * sizeof(*heap));
+        else {
+            heap = malloc(new_cap * sizeof(*heap));
+            if (heap)
+                memcpy(heap, d->inl, d->cnt * sizeof(*heap));
+        }
+        ensure(heap, "could not alloc");
+        d->heap = heap;
+        d->cap = new_cap;
+    }
+
+    struct ival * const iv = diet_ivals(d);
+    memmove(&iv[idx + cnt], &iv[idx], (d->cnt - idx) * sizeof(*iv));
+    d->cnt += cnt;
+    return &iv[idx];
 }
 
 
-/// Pointer to the interval containing @p n in diet tree @p d. Also has the side
-/// effect of splaying the closest interval to @p n to the root of @p d.
+/// Remove @p cnt intervals at index @p idx from diet @p d.
 ///
-/// @param      d     Diet tree.
-/// @param[in]  n     Integer.
-///
-/// @return     Pointer to the ival structure containing @p i; zero otherwise.
+/// @param      d     Diet.
+/// @param[in]  idx   Index of the first interval to remove.
+/// @param[in]  cnt   Number of intervals to remove.
 ///
-struct ival * diet_find(struct diet * const d, const uint_t n)
+static void __attribute__((nonnull))
+remove_at(struct diet * const d, const uint_t idx, const uint_t cnt)
 {
-    if (splay_empty(d))
-        return 0;
-    diet_splay(d, &(const struct ival){.lo = n, .hi = n});
-    if (n < splay_root(d)->lo || n > splay_root(d)->hi)
-        return 0;
-    return splay_root(d);
+    struct ival * const iv = diet_ivals(d);
+    memmove(&iv[idx], &iv[idx + cnt], (d->cnt - idx - cnt) * sizeof(*iv));
+    d->cnt -= cnt;
+
+    // move back inline once the set has mostly drained
+    if (d->cap && d->cnt <= DIET_INLINE / 2) {
+        memcpy(d->inl, iv, d->cnt * sizeof(*iv));
+        free(iv);
+        d->cap = 0;
+    }
 }
 
 
-/// Helper function to allocate an interval [n..n] containing only @p n.
+/// Pointer to the interval containing @p n in diet @p d.
 ///
+/// @param      d     Diet.
 /// @param[in]  n     Integer.
-/// @param[in]  t     Timestamp.
 ///
-/// @return     Newly allocated ival struct [n..n].
+/// @return     Pointer to the ival structure containing @p i; zero otherwise.
 ///
-static inline struct ival * make_ival(const uint_t n, const uint64_t t)
+struct ival * diet_find(struct diet * const d, const uint_t n)
 {
-    struct ival * const i = calloc(1, sizeof(*i));
-    ensure(i, "could not calloc");
-    i->lo = i->hi = n;
-    i->t = t;
-    return i;
+    const uint_t idx = lower_bound(d, n);
+    if (idx == d->cnt || n < diet_ivals(d)[idx].lo)
+        return 0;
+    return &diet_ivals(d)[idx];
 }
 
 
-/// Inserts integer @p n of type into the diet tree @p d.
+/// Inserts integer @p n of type into the diet @p d.
 ///
-/// @param      d     Diet tree.
+/// @param      d     Diet.
 /// @param[in]  n     Integer.
 /// @param[in]  t     Timestamp.
 ///
@@ -117,200 +154,108 @@ static inline struct ival * make_ival(const uint_t n, const uint64_t t)
 struct ival *
 diet_insert(struct diet * const d, const uint_t n, const uint64_t t)
 {
-    if (splay_empty(d))
-        goto new_ival;
+    const uint_t idx = lower_bound(d, n);
+    struct ival * const iv = diet_ivals(d);
+    struct ival * const next = idx < d->cnt ? &iv[idx] : 0;
+    struct ival * const prev = idx > 0 ? &iv[idx - 1] : 0;
+
+    if (next && n >= next->lo) {
+        next->t = t;
+        return next;
+    }
 
-    // rotate the interval that contains n or is closest to it to the top
-    diet_find(d, n);
+    const bool join_prev = prev && prev->hi + 1 == n;
+    const bool join_next = next && next->lo - 1 == n;
 
-    if (n >= splay_root(d)->lo && n <= splay_root(d)->hi) {
-        splay_root(d)->t = t;
-        return splay_root(d);
+    if (join_prev && join_next) {
+        // n fills the gap between prev and next
+        prev->hi = next->hi;
+        prev->t = t;
+        // remove_at() may move the intervals back inline
+        remove_at(d, idx, 1);
+        return &diet_ivals(d)[idx - 1];
     }
 
-    if (n < splay_root(d)->lo) {
-        struct ival * const max = find_max(splay_left(splay_root(d), node));
-
-        if (n + 1 == splay_root(d)->lo)
-            // we can expand the root to include n
-            splay_root(d)->lo--;
-        else if (max && max->hi + 1 == n)
-            // we can expand the max child to include n
-            max->hi++;
-        else
-            goto new_ival;
-
-        // check if we can merge the new root with its max left child
-        if (max && max->hi == splay_root(d)->lo - 1) {
-            splay_right(max, node) = splay_right(splay_root(d), node);
-            max->hi = splay_root(d)->hi;
-            struct ival * const old_root = splay_root(d);
-            splay_root(d) = splay_left(splay_root(d), node);
-            free(old_root);
-            splay_count(d)--;
-        }
-        splay_root(d)->t = t;
-        return splay_root(d);
+    if (join_prev) {
+        prev->hi++;
+        prev->t = t;
+        return prev;
     }
 
-    if (n > splay_root(d)->hi) {
-        struct ival * const min = find_min(splay_right(splay_root(d), node));
-
-        if (n == splay_root(d)->hi + 1)
-            // we can expand the root to include n
-            splay_root(d)->hi++;
-        else if (min && min->lo - 1 == n)
-            // we can expand the min child to include n
-            min->lo--;
-        else
-            goto new_ival;
-
-        // check if we can merge the new root with its min right child
-        if (min && min->lo == splay_root(d)->hi + 1) {
-            splay_left(min, node) = splay_left(splay_root(d), node);
-            min->lo = splay_root(d)->lo;
-            struct ival * const old_root = splay_root(d);
-            splay_root(d) = splay_right(splay_root(d), node);
-            free(old_root);
-            splay_count(d)--;
-        }
-        splay_root(d)->t = t;
-        return splay_root(d);
+    if (join_next) {
+        next->lo--;
+        next->t = t;
+        return next;
     }
 
-new_ival:;
-    struct ival * const i = make_ival(n, t);
-    splay_insert(diet, d, i);
+    struct ival * const i = make_room(d, idx, 1);
+    *i = (struct ival){.lo = n, .hi = n, .t = t};
     return i;
 }
 
 
-/// Splits the root of the diet tree @p d, removing the interval [lo..hi] from
-/// it.
+/// Remove integer @p n from the intervals stored in diet @p d.
 ///
-/// @param      d     Diet tree.
-/// @param[in]  lo    The lower value of the interval to be removed.
-/// @param[in]  hi    The upper value of the interface to be remove.
-///
-static void __attribute__((nonnull))
-split_root(struct diet * const d, const uint_t lo, const uint_t hi)
-{
-    struct ival * const i = make_ival(splay_root(d)->lo, splay_root(d)->t);
-    splay_count(d)++;
-    i->hi = lo - 1;
-    splay_root(d)->lo = hi + 1;
-    splay_left(i, node) = splay_left(splay_root(d), node);
-    splay_left(splay_root(d), node) = 0;
-    splay_right(i, node) = splay_root(d);
-    splay_root(d) = i;
-}
-
-
-/// Remove integer @p n from the intervals stored in diet tree @p d.
-///
-/// @param      d     Diet tree.
+/// @param      d     Diet.
 /// @param[in]  n     Integer.
 ///
 void diet_remove(struct diet * const d, const uint_t n)
 {
-    if (splay_empty(d))
-        return;
-
-    // rotate the interval that contains n or is closest to it to the top
-    diet_find(d, n);
-
-    if (n < splay_root(d)->lo || n > splay_root(d)->hi)
-        return;
-
-    if (n == splay_root(d)->lo) {
-        if (n == splay_root(d)->hi)
-            free(splay_remove(diet, d, splay_root(d)));
-        else
-            // adjust lo bound
-            splay_root(d)->lo++;
-    } else if (n == splay_root(d)->hi) {
-        // adjust hi bound
-        splay_root(d)->hi--;
-    } else
-        split_root(d, n, n);
+    diet_remove_ival(d, &(const struct ival){.lo = n, .hi = n});
 }
 
 
-/// Remove interval @p i from diet tree @p d.
+/// Remove interval @p i from diet @p d.
 ///
-/// @param      d     Diet tree.
+/// @param      d     Diet.
 /// @param[in]  i     Interval.
 ///
 void diet_remove_ival(struct diet * const d, const struct ival * const i)
 {
-    uint_t lo = i->lo;
-    uint_t hi = i->hi;
-
-again:
-    if (splay_empty(d))
+    const uint_t lo = i->lo;
+    const uint_t hi = i->hi;
+    uint_t idx = lower_bound(d, lo);
+    if (idx == d->cnt || hi < diet_ivals(d)[idx].lo)
         return;
 
-    // rotate the interval that contains n or is closest to it to the top
-    diet_splay(d, i);
-
-    if (hi < splay_root(d)->lo || lo > splay_root(d)->hi)
-        return;
-
-    if (lo > splay_root(d)->lo) {
-        if (hi < splay_root(d)->hi) {
-            split_root(d, lo, hi);
+    struct ival * iv = diet_ivals(d);
+    if (iv[idx].lo < lo) {
+        if (iv[idx].hi > hi) {
+            // [lo..hi] is inside this interval, split it
+            iv = make_room(d, idx, 1);
+            iv[0] = iv[1];
+            iv[0].hi = lo - 1;
+            iv[1].lo = hi + 1;
             return;
         }
-
-        if (hi > splay_root(d)->hi) {
-            const uint_t root_hi = splay_root(d)->hi;
-            splay_root(d)->hi = lo - 1;
-            lo = root_hi + 1;
-            goto again;
-        }
-
-        splay_root(d)->hi = lo - 1;
-        return;
+        // trim the interval overlapping lo
+        iv[idx].hi = lo - 1;
+        idx++;
     }
 
-    if (lo < splay_root(d)->lo) {
-        if (hi < splay_root(d)->hi) {
-            const uint_t root_lo = splay_root(d)->lo;
-            splay_root(d)->lo = hi + 1;
-            hi = root_lo - 1;
-            goto again;
-        }
-
-        if (hi <= splay_root(d)->hi)
-            hi = splay_root(d)->lo - 1;
-        goto free_root;
-    }
+    // remove all intervals fully inside [lo..hi]
+    uint_t end = idx;
+    while (end < d->cnt && iv[end].hi <= hi)
+        end++;
 
-    if (hi < splay_root(d)->hi) {
-        splay_root(d)->lo = hi + 1;
-        return;
-    }
-    hi = splay_root(d)->hi + 1;
+    // trim the interval overlapping hi
+    if (end < d->cnt && iv[end].lo <= hi)
+        iv[end].lo = hi + 1;
 
-free_root:;
-    struct ival * const old_root = splay_root(d);
-    splay_remove(diet, d, old_root);
-    free(old_root);
-    goto again;
+    if (end > idx)
+        remove_at(d, idx, end - idx);
 }
 
 
-/// Free the diet tree @p d and all its intervals.
+/// Free the diet @p d and all its intervals.
 ///
-/// @param      d     Diet tree.
+/// @param      d     Diet.
 ///
 void diet_free(struct diet * const d)
 {
-    while (!splay_empty(d)) {
-        struct ival * const i = splay_min(diet, d);
-        splay_remove(diet, d, i);
-        free(i);
-    }
+    if (d->cap)
+        free(d->heap);
+    diet_init(d);
 }
 
 
@@ -33,59 +33,68 @@
 
 #include <quant/quant.h>
 
-#include "tree.h"
 
-
-/// This is a C adaptation of the "discrete interval encoding tree" (DIET) data
-/// structure described in: Martin Erwig, "Diets for fat sets", Journal of
-/// Functional Programming, Vol. 8, No. 6, pp. 627–632, 1998.
+/// This is a set of integers, stored as a sorted array of disjoint intervals.
+/// It started out as a C adaptation of the "discrete interval encoding tree"
+/// (DIET) data structure described in: Martin Erwig, "Diets for fat sets",
+/// Journal of Functional Programming, Vol. 8, No. 6, pp. 627–632, 1998.
 /// https://web.engr.oregonstate.edu/~erwig/papers/abstracts.html#JFP98
 ///
+/// The sets quant keeps (received and ACKed packet numbers, closed streams)
+/// almost always consist of only a handful of intervals, and new values are
+/// mostly adjacent to the largest one. A flat array handles this without
+/// allocation or pointer chasing; DIET_INLINE intervals are kept inside the
+/// diet itself, and larger sets move to the heap and are binary-searched.
+///
 /// It also maintains a timestamp of the last insert operation into an @p ival,
 /// for the purposes of calculating the ACK delay.
+///
+/// Pointers to intervals are only valid until the next modification.
+
+
+/// Number of intervals stored without a heap allocation.
+#define DIET_INLINE 4
 
 
 /// An interval [hi..lo] to be used with diet structures, of a given type.
 ///
 struct ival {
-    splay_entry(ival) node; ///< Splay tree node data.
-    uint_t lo;              ///< Lower bound of the interval.
-    uint_t hi;              ///< Upper bound of the interval.
-    uint64_t t;             ///< Time stamp of last insert into this interval.
+    uint_t lo;  ///< Lower bound of the interval.
+    uint_t hi;  ///< Upper bound of the interval.
+    uint64_t t; ///< Time stamp of last insert into this interval.
 };
 
 
-/// Compare two ival intervals.
-///
-/// @param[in]  a     Interval one.
-/// @param[in]  b     Interval two.
-///
-/// @return     Zero if a is in b or b is in a. Negative if a's lower bound is
-///             less than b's lower bound, positive otherwise.
-///
-static inline int __attribute__((nonnull, no_instrument_function))
-ival_cmp(const struct ival * const a, const struct ival * const b)
-{
-    if ((a->lo >= b->lo && a->lo <= b->hi) ||
-        (b->lo >= a->lo && b->lo <= a->hi))
-        return 0;
-    return (a->lo > b->lo) - (a->lo < b->lo);
-}
+struct diet {
+    union {
+        struct ival inl[DIET_INLINE]; ///< Intervals, if cap is zero.
+        struct ival * heap;           ///< Intervals, otherwise.
+    };
+    uint_t cnt; ///< Number of intervals.
+    uint_t cap; ///< Capacity of @p heap, or zero when using @p inl.
+};
 
 
-splay_head(diet, ival);
+#define diet_initializer(d)                                                    \
+    {                                                                          \
+        .cnt = 0, .cap = 0                                                     \
+    }
 
+#define diet_init(d)                                                           \
+    do {                                                                       \
+        (d)->cnt = (d)->cap = 0;                                               \
+    } while (0)
 
-#define diet_initializer splay_initializer
-#define diet_init splay_init
-#define diet_cnt splay_count
-#define diet_foreach splay_foreach
-#define diet_foreach_rev splay_foreach_rev
-#define diet_next splay_next
-#define diet_prev splay_prev
+#define diet_cnt(d) (d)->cnt
 
+#define diet_foreach(x, name, d)                                               \
+    for ((x) = diet_min_ival(d); (x) != 0; (x) = diet_next(name, d, x))
 
-SPLAY_PROTOTYPE(diet, ival, node, ival_cmp)
+#define diet_foreach_rev(x, name, d)                                           \
+    for ((x) = diet_max_ival(d); (x) != 0; (x) = diet_prev(name, d, x))
+
+#define diet_next(name, d, x) diet_next_ival((d), (x))
+#define diet_prev(name, d, x) diet_prev_ival((d), (x))
 
 
 extern struct ival * diet_find(struct diet * const d, const uint_t n);
@@ -105,38 +114,59 @@ extern size_t __attribute__((nonnull))
 diet_to_str(char * const str, const size_t len, struct diet * const d);
 
 
+static inline struct ival * __attribute__((nonnull, no_instrument_function))
+diet_ivals(struct diet * const d)
+{
+    return d->cap ? d->heap : d->inl;
+}
+
+
+static inline struct ival * __attribute__((nonnull, no_instrument_function))
+diet_next_ival(struct diet * const d, const struct ival * const i)
+{
+    return i + 1 < diet_ivals(d) + d->cnt ? (struct ival *)i + 1 : 0;
+}
+
+
+static inline struct ival * __attribute__((nonnull, no_instrument_function))
+diet_prev_ival(struct diet * const d, const struct ival * const i)
+{
+    return i > diet_ivals(d) ? (struct ival *)i - 1 : 0;
+}
+
+
 static inline struct ival * __attribute__((nonnull, no_instrument_function))
 diet_max_ival(struct diet * const d)
 {
-    return splay_empty(d) ? 0 : splay_max(diet, d);
+    return d->cnt ? &diet_ivals(d)[d->cnt - 1] : 0;
 }
 
 
 static inline struct ival * __attribute__((nonnull, no_instrument_function))
 diet_min_ival(struct diet * const d)
 {
-    return splay_empty(d) ? 0 : splay_min(diet, d);
+    return d->cnt ? diet_ivals(d) : 0;
 }
 
 
 static inline uint_t __attribute__((nonnull, no_instrument_function))
 diet_max(struct diet * const d)
 {
-    return splay_empty(d) ? 0 : splay_max(diet, d)->hi;
+    return d->cnt ? diet_ivals(d)[d->cnt - 1].hi : 0;
 }
 
 
 static inline uint_t __attribute__((nonnull, no_instrument_function))
 diet_min(struct diet * const d)
 {
-    return splay_empty(d) ? 0 : splay_min(diet, d)->lo;
+    return d->cnt ? diet_ivals(d)->lo : 0;
 }
 
 
 static inline bool __attribute__((nonnull, no_instrument_function))
 diet_empty(const struct diet * const d)
 {
-    return splay_empty(d);
+    return d->cnt == 0;
 }
 
 
@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <stddef.h>
+
+// Doubly-linked lists, in the style of the sl_* and sq_* lists, for when
+// elements must leave from the middle of the list in O(1).
+
+#define dl_head(name, type)                                                    \
+    struct name {                                                              \
+        struct type * dlh_first; /* first element */                           \
+        struct type * dlh_last;  /* last element */                            \
+    }
+
+#define dl_head_initializer(head)                                              \
+    {                                                                          \
+        NULL, NULL                                                             \
+    }
+
+#define dl_entry(type)                                                         \
+    struct {                                                                   \
+        struct type * dle_next; /* next element */                             \
+        struct type * dle_prev; /* previous element */                         \
+    }
+
+#define dl_first(head) ((head)->dlh_first)
+#define dl_last(head) ((head)->dlh_last)
+#define dl_empty(head) ((head)->dlh_first == NULL)
+#define dl_next(elm, field) ((elm)->field.dle_next)
+#define dl_prev(elm, field) ((elm)->field.dle_prev)
+
+#define dl_init(head)                                                          \
+    do {                                                                       \
+        dl_first(head) = dl_last(head) = NULL;                                 \
+    } while (0)
+
+#define dl_foreach(var, head, field)                                           \
+    for ((var) = dl_first(head); (var); (var) = dl_next((var), field))
+
+#define dl_foreach_safe(var, head, field, tvar)                                \
+    for ((var) = dl_first(head);                                               \
+         (var) && ((tvar) = dl_next((var), field), 1); (var) = (tvar))
+
+#define dl_foreach_rev(var, head, field)                                       \
+    for ((var) = dl_last(head); (var); (var) = dl_prev((var), field))
+
+#define dl_insert_head(head, elm, field)                                       \
+    do {                                                                       \
+        dl_prev((elm), field) = NULL;                                          \
+        if ((dl_next((elm), field) = dl_first(head)) != NULL)                  \
+            dl_prev(dl_first(head), field) = (elm);                            \
+        else                                                                   \
+            dl_last(head) = (elm);                                             \
+        dl_first(head) = (elm);                                                \
+    } while (0)
+
+#define dl_insert_tail(head, elm, field)                                       \
+    do {                                                                       \
+        dl_next((elm), field) = NULL;                                          \
+        if ((dl_prev((elm), field) = dl_last(head)) != NULL)                   \
+            dl_next(dl_last(head), field) = (elm);                             \
+        else                                                                   \
+            dl_first(head) = (elm);                                            \
+        dl_last(head) = (elm);                                                 \
+    } while (0)
+
+#define dl_insert_after(head, listelm, elm, field)                             \
+    do {                                                                       \
+        dl_prev((elm), field) = (listelm);                                     \
+        if ((dl_next((elm), field) = dl_next((listelm), field)) != NULL)       \
+            dl_prev(dl_next((elm), field), field) = (elm);                     \
+        else                                                                   \
+            dl_last(head) = (elm);                                             \
+        dl_next((listelm), field) = (elm);                                     \
+    } while (0)
+
+#define dl_remove(head, elm, field)                                            \
+    do {                                                                       \
+        if (dl_next((elm), field) != NULL)                                     \
+            dl_prev(dl_next((elm), field), field) = dl_prev((elm), field);     \
+        else                                                                   \
+            dl_last(head) = dl_prev((elm), field);                             \
+        if (dl_prev((elm), field) != NULL)                                     \
+            dl_next(dl_prev((elm), field), field) = dl_next((elm), field);     \
+        else                                                                   \
+            dl_first(head) = dl_next((elm), field);                            \
+    } while (0)
@@ -0,0 +1,172 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/param.h>
+
+#include <quant/quant.h>
+
+#include "conn.h"
+#include "ecn.h"
+#include "pn.h"
+#include "quic.h"
+#include "recovery.h"
+
+
+static void __attribute__((nonnull))
+ecn_fail(struct q_conn * const c, const char * const why)
+{
+    warn(NTE, "ECN validation failed for %s conn %s: %s", conn_type(c),
+         cid_str(c->scid), why);
+    c->rec.ecn.state = ecn_failed;
+}
+
+
+void init_ecn(struct q_conn * const c, const bool enable, const bool l4s)
+{
+    c->rec.ecn = (struct ecn){.state = enable ? ecn_testing : ecn_failed,
+                              .l4s = l4s,
+                              .enabled = enable};
+}
+
+
+uint8_t ecn_mark(struct q_conn * const c)
+{
+    struct ecn * const e = &c->rec.ecn;
+    switch (e->state) {
+    case ecn_testing:
+        // stop marking after a few pkts until we know the path is OK
+        if (++e->test_sent >= ECN_TEST_PKTS)
+            e->state = ecn_unknown;
+        // fall through
+    case ecn_capable:
+        return e->l4s ? IPTOS_ECN_ECT1 : IPTOS_ECN_ECT0;
+    default:
+        return 0;
+    }
+}
+
+
+void ecn_on_lost(struct q_conn * const c, const uint8_t flags)
+{
+    struct ecn * const e = &c->rec.ecn;
+    if ((e->state == ecn_testing || e->state == ecn_unknown) &&
+        (flags & IPTOS_ECN_MASK) &&
+        unlikely(++e->test_lost >= ECN_TEST_PKTS))
+        ecn_fail(c, "all ECT-marked pkts lost");
+}
+
+
+static void __attribute__((nonnull))
+l4s_on_ack(struct q_conn * const c, const uint_t new_ect, const uint_t new_ce)
+{
+    // DCTCP/Prague-style: track the fraction of CE-marked pkts per round and
+    // reduce cwnd in proportion to it, at most once per round
+    struct ecn * const e = &c->rec.ecn;
+    e->round_ect += new_ect;
+    e->round_ce += new_ce;
+    if (c->rec.delivered < e->round_end)
+        return;
+
+    const uint_t frac =
+        MIN(e->round_ce, e->round_ect) * ECN_ALPHA_UNIT / MAX(e->round_ect, 1);
+    e->alpha = e->alpha - (e->alpha >> ECN_ALPHA_SHIFT) +
+               (frac >> ECN_ALPHA_SHIFT);
+
+    if (e->round_ce) {
+        const uint_t min_wnd = kMinimumWindow(c->rec.max_pkt_size);
+        const uint_t cwnd =
+            c->rec.cur.cwnd -
+            (uint_t)((uint64_t)c->rec.cur.cwnd * e->alpha / ECN_ALPHA_UNIT / 2);
+        c->rec.cur.cwnd = c->rec.cur.ssthresh = MAX(cwnd, min_wnd);
+    }
+
+    e->round_ect = e->round_ce = 0;
+    e->round_end = c->rec.delivered + c->rec.cur.in_flight;
+}
+
+
+void ecn_on_ack(struct pn_space * const pn,
+                const bool has_cnts,
+                const uint_t new_ect,
+                const uint_t ect0_cnt,
+                const uint_t ect1_cnt,
+                const uint_t ce_cnt,
+                const uint64_t lg_ack_t)
+{
+    struct q_conn * const c = pn->c;
+    struct ecn * const e = &c->rec.ecn;
+    if (e->state == ecn_failed)
+        return;
+
+    // see RFC9000 section 13.4.2.1
+    if (has_cnts == false) {
+        if (unlikely(new_ect))
+            ecn_fail(c, "ECT-marked pkts ACKed w/o ECN counts");
+        return;
+    }
+
+    if (unlikely(ect0_cnt < pn->ect0_peer || ect1_cnt < pn->ect1_peer ||
+                 ce_cnt < pn->ce_peer)) {
+        ecn_fail(c, "ECN counts decreased");
+        return;
+    }
+
+    const uint_t d_ect0 = ect0_cnt - pn->ect0_peer;
+    const uint_t d_ect1 = ect1_cnt - pn->ect1_peer;
+    const uint_t d_ce = ce_cnt - pn->ce_peer;
+    pn->ect0_peer = ect0_cnt;
+    pn->ect1_peer = ect1_cnt;
+    pn->ce_peer = ce_cnt;
+
+    if (unlikely(d_ect0 + d_ect1 + d_ce < new_ect)) {
+        ecn_fail(c, "ECN marks were cleared on path");
+        return;
+    }
+
+    // we only ever send one of the ECT codepoints
+    if (unlikely(e->l4s ? d_ect0 : d_ect1)) {
+        ecn_fail(c, "ECN marks were changed on path");
+        return;
+    }
+
+    if (unlikely(e->state != ecn_capable) && new_ect) {
+        warn(INF, "ECN validated for %s conn %s", conn_type(c),
+             cid_str(c->scid));
+        e->state = ecn_capable;
+    }
+
+    if (e->l4s)
+        l4s_on_ack(c, new_ect, d_ce);
+    else if (d_ce)
+        // ProcessECN
+        congestion_event(c, lg_ack_t);
+}
@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <quant/quant.h>
+
+struct pn_space; // IWYU pragma: no_forward_declare pn_space
+struct q_conn;   // IWYU pragma: no_forward_declare q_conn
+
+
+/// Number of ECT-marked packets sent before waiting for validation, and
+/// number of them that may be lost before ECN is considered broken.
+#define ECN_TEST_PKTS 10
+
+/// Fixed-point unit of the L4S CE fraction (alpha).
+#define ECN_ALPHA_UNIT 1024
+
+/// EWMA gain of the L4S CE fraction, as a shift (1/16).
+#define ECN_ALPHA_SHIFT 4
+
+
+/// ECN validation states, see RFC9000 appendix A.4.
+typedef enum {
+    ecn_testing = 0, ///< Marking, waiting for the first ECN counts.
+    ecn_unknown = 1, ///< Done testing, not marking until validated.
+    ecn_capable = 2, ///< Validated, marking all packets.
+    ecn_failed = 3,  ///< Validation failed or ECN disabled, not marking.
+} ecn_state_t;
+
+
+struct ecn {
+    uint64_t round_end; ///< Delivered bytes that end the current L4S round.
+    uint_t alpha;       ///< EWMA of the CE fraction, in ECN_ALPHA_UNIT.
+    uint_t round_ect;   ///< ECT-marked packets ACKed this round.
+    uint_t round_ce;    ///< CE marks reported this round.
+    uint16_t test_sent; ///< ECT-marked packets sent while testing.
+    uint16_t test_lost; ///< ECT-marked packets lost before validation.
+    ecn_state_t state;
+    uint8_t l4s : 1;     ///< Mark ECT(1) and use a scalable CE response.
+    uint8_t enabled : 1; ///< ECN is enabled by the conn configuration.
+    uint8_t : 6;
+#if HAVE_64BIT
+    uint8_t _unused[7];
+#else
+    uint8_t _unused[3];
+#endif
+};
+
+
+extern void __attribute__((nonnull))
+init_ecn(struct q_conn * const c, const bool enable, const bool l4s);
+
+extern uint8_t __attribute__((nonnull)) ecn_mark(struct q_conn * const c);
+
+extern void __attribute__((nonnull))
+ecn_on_lost(struct q_conn * const c, const uint8_t flags);
+
+extern void __attribute__((nonnull))
+ecn_on_ack(struct pn_space * const pn,
+           const bool has_cnts,
+           const uint_t new_ect,
+           const uint_t ect0_cnt,
+           const uint_t ect1_cnt,
+           const uint_t ce_cnt,
+           const uint64_t lg_ack_t);
@@ -44,9 +44,11 @@
 #include <quant/quant.h>
 #include <timeout.h>
 
+#include "ackfreq.h"
 #include "bitset.h"
 #include "conn.h"
 #include "diet.h"
+#include "ecn.h"
 #include "frame.h"
 #include "loop.h"
 #include "marshall.h"
@@ -54,6 +56,7 @@
 #include "pn.h"
 #include "quic.h"
 #include "recovery.h"
+#include "shard.h"
 #include "stream.h"
 #include "tls.h"
 
@@ -402,8 +405,8 @@ dec_stream_or_crypto_frame(const uint8_t type,
             do_stream_fc(m->strm, 0);
             do_conn_fc(c, 0);
             c->have_new_data = true;
-            maybe_api_return(q_read, c, 0);
-            maybe_api_return(q_read_stream, c, m->strm);
+            maybe_api_return(c->w, q_read, c, 0);
+            maybe_api_return(c->w, q_read_stream, c, m->strm);
         }
         goto done;
     }
@@ -543,11 +546,9 @@ static bool __attribute__((nonnull)) dec_ack_frame(const uint8_t type,
     uint_t ack_rng_cnt = 0;
     decv_chk(&ack_rng_cnt, pos, end, c, type);
 
-    const struct ival * const cum_ack_ival = diet_min_ival(&pn->acked_or_lost);
-    const uint_t cum_ack = cum_ack_ival ? cum_ack_ival->hi : UINT_T_MAX;
-
     uint_t lg_ack = lg_ack_in_frm;
     uint64_t lg_ack_in_frm_t = 0;
+    uint_t new_ect = 0;
     bool got_new_ack = false;
     for (uint_t n = ack_rng_cnt + 1; n > 0; n--) {
         uint_t gap = 0;
@@ -597,54 +598,34 @@ static bool __attribute__((nonnull)) dec_ack_frame(const uint8_t type,
         }
 #endif
 
-        uint_t ack = lg_ack;
-        while (ack_rng >= lg_ack - ack) {
-            if (likely(cum_ack != UINT_T_MAX) && ack <= cum_ack)
-                // we can skip the remainder of this range entirely
-                goto next_rng;
-
-            if (diet_find(&pn->acked_or_lost, ack))
-                goto next_ack;
-
-            struct pkt_meta * m_acked;
-            struct w_iov * const acked = find_sent_pkt(pn, ack, &m_acked);
-            if (unlikely(acked == 0))
 #ifndef FUZZING
-                // this is just way too noisy when fuzzing
-                err_close_return(c, ERR_PROTOCOL_VIOLATION, type,
-                                 "got ACK for %s pkt %" PRIu " never sent",
-                                 pn_type_str(pn->type), ack);
-#else
-                goto next_ack;
+        // this is just way too noisy when fuzzing
+        if (unlikely(pn->lg_sent == UINT_T_MAX || lg_ack > pn->lg_sent))
+            err_close_return(c, ERR_PROTOCOL_VIOLATION, type,
+                             "got ACK for %s pkt %" PRIu " never sent",
+                             pn_type_str(pn->type), lg_ack);
 #endif
 
+        // sent_pkts only holds pkts not yet ACKed or lost, so retire whatever
+        // it has in this range in one sweep
+        struct pkt_meta * m_acked;
+        pm_ring_foreach_rev (m_acked, &pn->sent_pkts, lg_ack - ack_rng,
+                             lg_ack) {
+            struct w_iov * const acked = w_iov(c->w, pm_idx(c->w, m_acked));
             got_new_ack = true;
-            if (unlikely(ack == lg_ack_in_frm)) {
+            if (unlikely(m_acked->hdr.nr == lg_ack_in_frm)) {
                 // call this only for the largest ACK in the frame
                 on_ack_received_1(m_acked, ack_delay);
                 lg_ack_in_frm_t = m_acked->t;
             }
 
-            on_pkt_acked(acked, m_acked);
-
-            // if the ACK'ed pkt was sent with ECT, verify peer and path support
-            if (likely(c->sockopt.enable_ecn &&
-                       is_set(IPTOS_ECN_ECT0, acked->flags)) &&
-                unlikely(type != FRM_ACE)) {
-                warn(NTE, "ECN verification failed for %s conn %s",
-                     conn_type(c), cid_str(c->scid));
-                c->sockopt.enable_ecn = false;
-                w_set_sockopt(c->sock, &c->sockopt);
-            }
+            // count ECT-marked pkts for validation against the ECN counts
+            if (acked->flags & IPTOS_ECN_MASK)
+                new_ect++;
 
-        next_ack:
-            if (likely(ack > 0))
-                ack--;
-            else
-                break;
+            on_pkt_acked(acked, m_acked);
         }
 
-    next_rng:
         if (n > 1) {
             decv_chk(&gap, pos, end, c, type);
             if (unlikely((lg_ack - ack_rng) < gap + 2)) {
@@ -657,11 +638,11 @@ static bool __attribute__((nonnull)) dec_ack_frame(const uint8_t type,
         }
     }
 
+    uint_t ect0_cnt = 0;
+    uint_t ect1_cnt = 0;
+    uint_t ce_cnt = 0;
     if (type == FRM_ACE) {
         // decode ECN
-        uint_t ect0_cnt = 0;
-        uint_t ect1_cnt = 0;
-        uint_t ce_cnt = 0;
         decv_chk(&ect0_cnt, pos, end, c, type);
         decv_chk(&ect1_cnt, pos, end, c, type);
         decv_chk(&ce_cnt, pos, end, c, type);
@@ -670,18 +651,16 @@ static bool __attribute__((nonnull)) dec_ack_frame(const uint8_t type,
                      " ce=%s%" PRIu NRM,
              ect0_cnt ? GRN : NRM, ect0_cnt, ect1_cnt ? GRN : NRM, ect1_cnt,
              ce_cnt ? GRN : NRM, ce_cnt);
-        // TODO: add sanity check whether markings make sense
-
-        // ProcessECN
-        if (ce_cnt > pn->ce_cnt) {
-            pn->ce_cnt = ce_cnt;
-            congestion_event(c, lg_ack_in_frm_t);
-        }
     }
 
     if (got_new_ack)
         on_ack_received_2(pn);
 
+    // only validate ECN counts of ACKs that newly ACK the largest pkt in them
+    if (lg_ack_in_frm_t)
+        ecn_on_ack(pn, type == FRM_ACE, new_ect, ect0_cnt, ect1_cnt, ce_cnt,
+                   lg_ack_in_frm_t);
+
     bit_zero(FRM_MAX, &pn->tx_frames);
     return true;
 }
@@ -799,7 +778,7 @@ dec_max_strms_frame(const uint8_t type,
 
     if (max > *max_streams) {
         *max_streams = max;
-        maybe_api_return(q_rsv_stream, c, 0);
+        maybe_api_return(c->w, q_rsv_stream, c, 0);
     } else if (max < *max_streams)
         warn(NTE, "RX'ed max_%s_streams %" PRIu " < current value %" PRIu,
              type == FRM_MSU ? "uni" : "bidi", max, *max_streams);
@@ -1164,6 +1143,47 @@ dec_new_token_frame(const uint8_t ** pos,
 }
 
 
+static bool __attribute__((nonnull))
+dec_ack_freq_frame(const uint8_t ** pos,
+                   const uint8_t * const end,
+                   const struct pkt_meta * const m)
+{
+    struct q_conn * const c = m->pn->c;
+    uint_t seq = 0;
+    decv_chk(&seq, pos, end, c, FRM_AFQ_TYPE);
+
+    uint_t thresh = 0;
+    decv_chk(&thresh, pos, end, c, FRM_AFQ_TYPE);
+
+    uint_t del = 0;
+    decv_chk(&del, pos, end, c, FRM_AFQ_TYPE);
+
+    uint_t reor = 0;
+    decv_chk(&reor, pos, end, c, FRM_AFQ_TYPE);
+
+    warn(INF,
+         FRAM_IN "ACK_FREQUENCY" NRM " seq=%" PRIu " thresh=%" PRIu
+                 " del=%" PRIu " [us] reor=%" PRIu,
+         seq, thresh, del, reor);
+
+    if (unlikely(del < c->tp_mine.min_ack_del))
+        err_close_return(c, ERR_PROTOCOL_VIOLATION, FRM_AFQ_TYPE,
+                         "ack delay %" PRIu " < min_ack_delay %" PRIu, del,
+                         c->tp_mine.min_ack_del);
+
+    if (seq < c->afq.seq_in) {
+        warn(INF, "ignoring stale ACK_FREQUENCY seq %" PRIu, seq);
+        return true;
+    }
+
+    c->afq.seq_in = seq + 1;
+    c->afq.thresh_in = thresh;
+    c->afq.del_in = del;
+    c->afq.reor_in = reor;
+    return true;
+}
+
+
 #ifndef NDEBUG
 static void log_pad(const uint16_t len)
 {
@@ -1195,12 +1215,24 @@ bool dec_frames(struct q_conn * const c,
 #if !defined(NDEBUG) && !defined(FUZZING) && defined(FUZZER_CORPUS_COLLECTION)
     // when called from the fuzzer, v->wv_af is zero
     if (v->wv_af)
-        write_to_corpus(corpus_frm_dir, pos, (size_t)(end - pos));
+        write_to_corpus(ped(v->w)->corpus_frm_dir, pos, (size_t)(end - pos));
 #endif
 
     while (likely(pos < end)) {
         uint8_t type = *(pos++); // dec1_chk not needed here, pos is < len
 
+        // FRM_AFQ is internal, the same byte on the wire is unknown
+        if (unlikely(type == FRM_AFQ))
+            err_close_return(c, ERR_FRAME_ENC, type,
+                             "unknown 0x%02x frame at pos %u", type,
+                             (uint16_t)(pos - v->buf));
+
+        // ACK_FREQUENCY is the only frame type we know that takes two bytes
+        if (unlikely(type == 0x40) && pos < end && *pos == FRM_AFQ_TYPE) {
+            pos++;
+            type = FRM_AFQ;
+        }
+
         // special-case for optimized parsing of padding ranges
         if (type == FRM_PAD) {
             if (unlikely(pad_start == 0))
@@ -1240,10 +1272,17 @@ bool dec_frames(struct q_conn * const c,
                 1 << FRM_CDB | 1 << FRM_SDB | 1 << FRM_SBB | 1 << FRM_SBU |
                 1 << FRM_CID | 1 << FRM_RTR | 1 << FRM_PCL | 1 << FRM_PRP |
                 1 << FRM_HSD)};
-        if (likely(type < FRM_MAX) &&
-            unlikely(bit_isset(FRM_MAX, type,
-                               &frame_ok[epoch_for_pkt_type(m->hdr.type)]) ==
-                     false))
+        const epoch_t epoch = epoch_for_pkt_type(m->hdr.type);
+        if (likely(type <= FRM_HSD) &&
+            unlikely(bit_isset(FRM_MAX, type, &frame_ok[epoch]) == false))
+            err_close_return(c, ERR_PROTOCOL_VIOLATION, type,
+                             "0x%02x frame not OK in %s pkt", type,
+                             pkt_type_str(m->hdr.flags, &m->hdr.vers));
+
+        // ACK frequency frames need to have been negotiated
+        if (unlikely(type > FRM_HSD && type < FRM_MAX) &&
+            (c->tp_mine.min_ack_del == 0 ||
+             (epoch != ep_0rtt && epoch != ep_data)))
             err_close_return(c, ERR_PROTOCOL_VIOLATION, type,
                              "0x%02x frame not OK in %s pkt", type,
                              pkt_type_str(m->hdr.flags, &m->hdr.vers));
@@ -1363,6 +1402,16 @@ bool dec_frames(struct q_conn * const c,
             ok = dec_retire_cid_frame(&pos, end, m);
             break;
 
+        case FRM_IAK:
+            warn(INF, FRAM_IN "IMMEDIATE_ACK" NRM);
+            m->pn->imm_ack = true;
+            ok = true;
+            break;
+
+        case FRM_AFQ:
+            ok = dec_ack_freq_frame(&pos, end, m);
+            break;
+
         default:
             err_close_return(c, ERR_FRAME_ENC, type,
                              "unknown 0x%02x frame at pos %u", type,
@@ -1407,6 +1456,7 @@ uint16_t max_frame_len(const uint8_t type)
     switch (type) {
     case FRM_PAD:
     case FRM_PNG:
+    case FRM_IAK:
         break;
 
         // these are always first, so assume there is enough space
@@ -1454,6 +1504,11 @@ uint16_t max_frame_len(const uint8_t type)
         len += sizeof(uint_t) + sizeof(uint8_t) + CID_LEN_MAX + SRT_LEN;
         break;
 
+    case FRM_AFQ:
+        // the type is the two-byte varint FRM_AFQ_TYPE, not FRM_AFQ
+        len = sizeof(uint16_t) + 4 * sizeof(uint_t);
+        break;
+
     default:
         die("unhandled 0x%02x frame", type);
     }
@@ -1513,55 +1568,102 @@ bool enc_ack_frame(struct q_conn_info * const ci,
                            ? DEF_ACK_DEL_EXP
                            : c->tp_mine.ack_del_exp;
     const uint64_t ack_delay =
-        NS_TO_US(loop_now() - diet_timestamp(first_rng)) >> ade;
+        NS_TO_US(loop_now(c->w) - diet_timestamp(first_rng)) >> ade;
     encv_chk(pos, end, ack_delay);
 
-    const uint_t ack_rng_cnt = diet_cnt(&pn->recv) - 1;
+    const uint_t ack_rng_cnt = MIN(diet_cnt(&pn->recv), ACK_MAX_RNGS) - 1;
     encv_chk(pos, end, ack_rng_cnt);
 
-    uint_t prev_lo = 0;
-    struct ival * b;
-    diet_foreach_rev (b, diet, &pn->recv) {
-        uint_t gap = 0;
-        if (prev_lo) {
-            gap = prev_lo - b->hi - 2;
-            encv_chk(pos, end, gap);
+    const uint_t first_ack_rng = first_rng->hi - first_rng->lo;
+#ifndef NDEBUG
+    if (first_ack_rng)
+        warn(INF,
+             FRAM_OUT "ACK" NRM " 0x%02x=%s lg=" FMT_PNR_IN " delay=%" PRIu
+                      " (%" PRIu " usec) cnt=%" PRIu " rng=%" PRIu
+                      " [" FMT_PNR_IN ".." FMT_PNR_IN "]",
+             type, type == FRM_ACE ? "ECN" : "", first_rng->hi,
+             (uint_t)ack_delay, (uint_t)ack_delay << ade, ack_rng_cnt,
+             first_ack_rng, first_rng->lo,
+             shorten_ack_nr(first_rng->hi, first_ack_rng));
+    else
+        warn(INF,
+             FRAM_OUT "ACK" NRM " 0x%02x=%s lg=" FMT_PNR_IN " delay=%" PRIu
+                      " (%" PRIu " usec) cnt=%" PRIu " rng=%" PRIu
+                      " [" FMT_PNR_IN "]",
+             type, type == FRM_ACE ? "ECN" : "", first_rng->hi,
+             (uint_t)ack_delay, (uint_t)ack_delay << ade, ack_rng_cnt,
+             first_ack_rng, first_rng->hi);
+#endif
+    encv_chk(pos, end, first_ack_rng);
+
+    // encode the gap and ACK range pairs, copying runs of pairs that are
+    // unchanged since the last ACK frame from the cache
+    struct ack_cache * const ac = &pn->ack_cache;
+    const struct ival * const iv = diet_ivals(&pn->recv);
+    uint_t lo[ACK_MAX_RNGS - 1];
+    uint_t hi[ACK_MAX_RNGS - 1];
+    uint16_t rng_end[ACK_MAX_RNGS - 1];
+    uint8_t * const rng_pos = *pos;
+    uint_t bi = diet_cnt(&pn->recv) - 1;
+    uint_t n = 0;
+    uint8_t j = 0;
+    bool dirty = false;
+    while (n < ack_rng_cnt) {
+        const struct ival * const b = &iv[--bi];
+        const uint_t upper_lo = n ? lo[n - 1] : first_rng->lo;
+
+        // a cached pair is good if its gap and range are still the same
+        while (j < ac->cnt && ac->hi[j] > b->hi)
+            j++;
+        if (j < ac->cnt && ac->hi[j] == b->hi && ac->lo[j] == b->lo &&
+            (j ? ac->lo[j - 1] : ac->top_lo) == upper_lo) {
+            dirty |= j != n;
+            const uint16_t start = j ? ac->end[j - 1] : 0;
+            const uint16_t off = (uint16_t)(*pos - rng_pos) - start;
+            for (;;) {
+                lo[n] = ac->lo[j];
+                hi[n] = ac->hi[j];
+                rng_end[n] = off + ac->end[j];
+                j++;
+                n++;
+                if (j == ac->cnt || n == ack_rng_cnt ||
+                    iv[bi - 1].hi != ac->hi[j] || iv[bi - 1].lo != ac->lo[j])
+                    break;
+                bi--;
+            }
+            const uint16_t len = ac->end[j - 1] - start;
+            if (unlikely(*pos + len > end))
+                goto no_ack;
+            memcpy(*pos, &ac->buf[start], len);
+            *pos += len;
+#ifndef NDEBUG
+            warn(INF, FRAM_OUT "ACK" NRM " %u bytes of cached gap/rng pairs",
+                 len);
+#endif
+            continue;
         }
+
+        const uint_t gap = upper_lo - b->hi - 2;
         const uint_t ack_rng = b->hi - b->lo;
 #ifndef NDEBUG
-        if (ack_rng) {
-            if (prev_lo)
-                warn(INF,
-                     FRAM_OUT "ACK" NRM " gap=%" PRIu " rng=%" PRIu
-                              " [" FMT_PNR_IN ".." FMT_PNR_IN "]",
-                     gap, ack_rng, b->lo, shorten_ack_nr(b->hi, ack_rng));
-            else
-                warn(INF,
-                     FRAM_OUT "ACK" NRM " 0x%02x=%s lg=" FMT_PNR_IN
-                              " delay=%" PRIu " (%" PRIu " usec) cnt=%" PRIu
-                              " rng=%" PRIu " [" FMT_PNR_IN ".." FMT_PNR_IN "]",
-                     type, type == FRM_ACE ? "ECN" : "", first_rng->hi,
-                     (uint_t)ack_delay, (uint_t)ack_delay << ade, ack_rng_cnt,
-                     ack_rng, b->lo, shorten_ack_nr(b->hi, ack_rng));
-
-        } else {
-            if (prev_lo)
-                warn(INF,
-                     FRAM_OUT "ACK" NRM " gap=%" PRIu " rng=%" PRIu
-                              " [" FMT_PNR_IN "]",
-                     gap, ack_rng, b->hi);
-            else
-                warn(INF,
-                     FRAM_OUT "ACK" NRM " 0x%02x=%s lg=" FMT_PNR_IN
-                              " delay=%" PRIu " (%" PRIu " usec) cnt=%" PRIu
-                              " rng=%" PRIu " [" FMT_PNR_IN "]",
-                     type, type == FRM_ACE ? "ECN" : "", first_rng->hi,
-                     (uint_t)ack_delay, (uint_t)ack_delay << ade, ack_rng_cnt,
-                     ack_rng, first_rng->hi);
-        }
+        if (ack_rng)
+            warn(INF,
+                 FRAM_OUT "ACK" NRM " gap=%" PRIu " rng=%" PRIu
+                          " [" FMT_PNR_IN ".." FMT_PNR_IN "]",
+                 gap, ack_rng, b->lo, shorten_ack_nr(b->hi, ack_rng));
+        else
+            warn(INF,
+                 FRAM_OUT "ACK" NRM " gap=%" PRIu " rng=%" PRIu
+                          " [" FMT_PNR_IN "]",
+                 gap, ack_rng, b->hi);
 #endif
+        encv_chk(pos, end, gap);
         encv_chk(pos, end, ack_rng);
-        prev_lo = b->lo;
+        lo[n] = b->lo;
+        hi[n] = b->hi;
+        rng_end[n] = (uint16_t)(*pos - rng_pos);
+        dirty = true;
+        n++;
     }
 
     if (type == FRM_ACE) {
@@ -1576,9 +1678,25 @@ bool enc_ack_frame(struct q_conn_info * const ci,
              pn->ect1_cnt, pn->ce_cnt ? BLU : NRM, pn->ce_cnt);
     }
 
+    if (dirty || ac->top_lo != first_rng->lo) {
+        // update the cache, unless we just copied (a prefix of) it unchanged
+        memcpy(ac->buf, rng_pos, n ? rng_end[n - 1] : 0);
+        memcpy(ac->lo, lo, n * sizeof(lo[0]));
+        memcpy(ac->hi, hi, n * sizeof(hi[0]));
+        memcpy(ac->end, rng_end, n * sizeof(rng_end[0]));
+        ac->top_lo = first_rng->lo;
+        ac->cnt = (uint8_t)n;
+    }
+
+    // forget what doesn't fit
+    while (unlikely(diet_cnt(&pn->recv) > ACK_MAX_RNGS)) {
+        const struct ival lost = *diet_min_ival(&pn->recv);
+        diet_remove_ival(&pn->recv, &lost);
+    }
+
     timeouts_del(ped(c->w)->wheel, &c->ack_alarm);
     bit_zero(FRM_MAX, &pn->rx_frames);
-    pn->pkts_rxed_since_last_ack_tx = 0;
+    pn->pkts_rxed_since_last_ack_tx = pn->ae_rxed_since_last_ack_tx = 0;
     pn->imm_ack = false;
     track_frame(m, ci, FRM_ACK, 1);
     m->ack_frm_pos = (uint16_t)(init_pos - start) + 1; // +1 for type byte
@@ -1895,6 +2013,8 @@ void enc_new_cid_frame(struct q_conn_info * const ci,
                     is_clnt(c) ? ped(c->w)->conf.client_cid_len
                                : ped(c->w)->conf.server_cid_len,
                     true);
+        if (!is_clnt(c))
+            shard_tag_cid(c->w, &ncid);
         add_scid(c, &ncid);
 #ifndef NO_SRT_MATCHING
         srt = ncid.srt;
@@ -1982,3 +2102,41 @@ void enc_hshk_done_frame(struct q_conn_info * const ci,
     track_frame(m, ci, FRM_HSD, 1);
     m->pn->c->tx_hshk_done = false;
 }
+
+
+void enc_imm_ack_frame(struct q_conn_info * const ci,
+                       uint8_t ** pos,
+                       const uint8_t * const end,
+                       struct pkt_meta * const m)
+{
+    enc1(pos, end, FRM_IAK);
+
+    warn(INF, FRAM_OUT "IMMEDIATE_ACK" NRM);
+
+    track_frame(m, ci, FRM_IAK, 1);
+}
+
+
+void enc_ack_freq_frame(struct q_conn_info * const ci,
+                        uint8_t ** pos,
+                        const uint8_t * const end,
+                        struct pkt_meta * const m)
+{
+    struct q_conn * const c = m->pn->c;
+    struct ack_freq * const afq = &c->afq;
+    encv(pos, end, FRM_AFQ_TYPE);
+    encv(pos, end, afq->seq_out);
+    encv(pos, end, afq->thresh_out);
+    encv(pos, end, afq->del_out);
+    encv(pos, end, kPacketThreshold - 1);
+
+    warn(INF,
+         FRAM_OUT "ACK_FREQUENCY" NRM " seq=%" PRIu " thresh=%" PRIu
+                  " del=%" PRIu " [us] reor=%u",
+         afq->seq_out, afq->thresh_out, afq->del_out, kPacketThreshold - 1);
+
+    afq->seq_out++;
+    afq->tx_t = loop_now(c->w);
+    c->tx_ack_freq = false;
+    track_frame(m, ci, FRM_AFQ, 1);
+}
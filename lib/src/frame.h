@@ -66,8 +66,12 @@
 #define FRM_CLQ 0x1c ///< CONNECTION_CLOSE (QUIC layer)
 #define FRM_CLA 0x1d ///< CONNECTION_CLOSE (application)
 #define FRM_HSD 0x1e ///< HANDSHAKE_DONE
+#define FRM_IAK 0x1f ///< IMMEDIATE_ACK
+#define FRM_AFQ 0x20 ///< ACK_FREQUENCY (internal, see FRM_AFQ_TYPE)
 
-#define FRM_MAX (FRM_HSD + 1)
+#define FRM_MAX (FRM_AFQ + 1)
+
+#define FRM_AFQ_TYPE 0xaf ///< ACK_FREQUENCY frame type on the wire
 
 bitset_define(frames, FRM_MAX);
 
@@ -287,6 +291,26 @@ enc_hshk_done_frame(struct q_conn_info * const ci,
                     const uint8_t * const end,
                     struct pkt_meta * const m);
 
+extern void __attribute__((nonnull
+#ifdef NO_QINFO
+                           (2, 3, 4)
+#endif
+                               ))
+enc_imm_ack_frame(struct q_conn_info * const ci,
+                  uint8_t ** pos,
+                  const uint8_t * const end,
+                  struct pkt_meta * const m);
+
+extern void __attribute__((nonnull
+#ifdef NO_QINFO
+                           (2, 3, 4)
+#endif
+                               ))
+enc_ack_freq_frame(struct q_conn_info * const ci,
+                   uint8_t ** pos,
+                   const uint8_t * const end,
+                   struct pkt_meta * const m);
+
 
 static inline bool __attribute__((nonnull))
 is_ack_eliciting(const struct frames * const f)
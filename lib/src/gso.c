@@ -0,0 +1,473 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "gso.h"
+
+#ifndef NO_GSO
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+
+#include <linux/net_tstamp.h>
+
+#include <quant/quant.h>
+
+#include "conn.h"
+#include "loop.h"
+#include "pacer.h"
+#include "pkt.h"
+#include "quic.h"
+
+#ifndef SOL_UDP
+#define SOL_UDP IPPROTO_UDP
+#endif
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+#ifndef SO_TXTIME
+#define SO_TXTIME 61
+#define SCM_TXTIME SO_TXTIME
+#endif
+
+
+void gso_init(struct w_engine * const w)
+{
+    // segmentation offload only makes sense with the kernel socket backend
+    if (strcmp(w->backend_name, "socket") != 0)
+        return;
+
+    const int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd < 0)
+        return;
+
+    struct per_engine_data * const ped = ped(w);
+    int val = MIN_INI_LEN;
+    ped->udp_gso =
+        setsockopt(fd, SOL_UDP, UDP_SEGMENT, &val, sizeof(val)) == 0;
+
+    if (ped->conf.enable_txtime) {
+        const struct sock_txtime st = {.clockid = CLOCK_MONOTONIC};
+        ped->txtime =
+            setsockopt(fd, SOL_SOCKET, SO_TXTIME, &st, sizeof(st)) == 0;
+    }
+
+    if (ped->conf.enable_udp_gro) {
+        val = 1;
+        ped->udp_gro = setsockopt(fd, SOL_UDP, UDP_GRO, &val, sizeof(val)) == 0;
+        if (ped->udp_gro) {
+            ped->gro_buf = malloc(GRO_BATCH * GRO_BUF_LEN);
+            ensure(ped->gro_buf, "could not malloc");
+        }
+    }
+    close(fd);
+
+    warn(INF, "UDP GSO %s, GRO %s, TXTIME %s", ped->udp_gso ? "on" : "off",
+         ped->udp_gro ? "on" : "off", ped->txtime ? "on" : "off");
+}
+
+
+void gso_cleanup(struct w_engine * const w)
+{
+    free(ped(w)->gro_buf);
+}
+
+
+void gro_enable(struct w_sock * const ws)
+{
+    if (ped(ws->w)->udp_gro == false)
+        return;
+
+    // gro_rx() bypasses warpcore, so also ask for the ECN bits and TTL
+    const int fd = w_fd(ws);
+    const int on = 1;
+    const int lvl = ws->ws_af == AF_INET ? IPPROTO_IP : IPPROTO_IPV6;
+    if (setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) != 0 ||
+        setsockopt(fd, lvl, ws->ws_af == AF_INET ? IP_RECVTOS : IPV6_RECVTCLASS,
+                   &on, sizeof(on)) != 0 ||
+        setsockopt(fd, lvl,
+                   ws->ws_af == AF_INET ? IP_RECVTTL : IPV6_RECVHOPLIMIT, &on,
+                   sizeof(on)) != 0)
+        warn(WRN, "could not enable UDP GRO on sock: %s", strerror(errno));
+}
+
+
+void txtime_enable(struct w_sock * const ws)
+{
+    if (ped(ws->w)->txtime == false)
+        return;
+
+    const struct sock_txtime st = {.clockid = CLOCK_MONOTONIC};
+    if (setsockopt(w_fd(ws), SOL_SOCKET, SO_TXTIME, &st, sizeof(st)) != 0) {
+        warn(WRN, "could not enable SO_TXTIME on sock: %s", strerror(errno));
+        ped(ws->w)->txtime = false;
+    }
+}
+
+
+static inline uint16_t __attribute__((nonnull))
+sa_port(const struct sockaddr_storage * const ss)
+{
+    return ss->ss_family == AF_INET
+               ? ((const struct sockaddr_in *)(const void *)ss)->sin_port
+               : ((const struct sockaddr_in6 *)(const void *)ss)->sin6_port;
+}
+
+
+static void __attribute__((nonnull))
+plain_tx(struct w_sock * const ws, struct w_iov_sq * const q)
+{
+    w_tx(ws, q);
+    do
+        w_nic_tx(ws->w);
+    while (w_tx_pending(q));
+}
+
+
+static uint16_t __attribute__((nonnull))
+train_len(const struct w_sock * const ws, const struct w_iov * const v)
+{
+    // link-local destinations would need the scope, leave those to warpcore
+    if (w_connected(ws) == false && v->wv_af == AF_INET6 &&
+        w_is_linklocal(&v->wv_addr))
+        return 1;
+
+    // all segments must be of the same size, except for a shorter last one
+    uint16_t n = 1;
+    uint32_t len = v->len;
+    for (const struct w_iov * nv = sq_next(v, next);
+         nv && n < GSO_MAX_SEGS && len + nv->len <= GSO_MAX_LEN &&
+         nv->len <= v->len && nv->flags == v->flags &&
+         w_sockaddr_cmp(&nv->saddr, &v->saddr);
+         nv = sq_next(nv, next)) {
+        n++;
+        len += nv->len;
+        if (nv->len < v->len)
+            break;
+    }
+    return n;
+}
+
+
+static socklen_t __attribute__((nonnull))
+to_sockaddr(const struct w_iov * const v, struct sockaddr_storage * const ss)
+{
+    memset(ss, 0, sizeof(*ss));
+    ss->ss_family = v->wv_af;
+    if (v->wv_af == AF_INET) {
+        struct sockaddr_in * const sin4 = (struct sockaddr_in *)ss;
+        sin4->sin_port = v->wv_port;
+        memcpy(&sin4->sin_addr, &v->wv_addr.ip4, sizeof(sin4->sin_addr));
+        return sizeof(*sin4);
+    }
+    struct sockaddr_in6 * const sin6 = (struct sockaddr_in6 *)ss;
+    sin6->sin6_port = v->wv_port;
+    memcpy(&sin6->sin6_addr, &v->wv_addr.ip6, sizeof(sin6->sin6_addr));
+    return sizeof(*sin6);
+}
+
+
+static void __attribute__((nonnull))
+add_tos(struct msghdr * const msg,
+        struct cmsghdr * const prev,
+        const struct w_iov * const v)
+{
+    // the caller must have reserved CMSG_SPACE(sizeof(int)) after prev
+    if (v->flags == 0)
+        return;
+
+    msg->msg_controllen += CMSG_SPACE(sizeof(int));
+    struct cmsghdr * const cm = CMSG_NXTHDR(msg, prev);
+    cm->cmsg_level = v->wv_af == AF_INET ? IPPROTO_IP : IPPROTO_IPV6;
+    cm->cmsg_type = v->wv_af == AF_INET ? IP_TOS : IPV6_TCLASS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    const int tos = v->flags;
+    memcpy(CMSG_DATA(cm), &tos, sizeof(tos));
+}
+
+
+static bool __attribute__((nonnull))
+sendmsg_gso(const struct w_sock * const ws,
+            const struct w_iov_sq * const train,
+            const uint16_t n)
+{
+    const struct w_iov * v = sq_first(train);
+    struct iovec iov[GSO_MAX_SEGS];
+    for (uint16_t i = 0; i < n; i++, v = sq_next(v, next))
+        iov[i] = (struct iovec){.iov_base = v->buf, .iov_len = v->len};
+    v = sq_first(train);
+
+    union {
+        uint8_t buf[CMSG_SPACE(sizeof(uint16_t)) + CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+    memset(&ctrl, 0, sizeof(ctrl));
+
+    struct sockaddr_storage ss;
+    struct msghdr msg = {.msg_iov = iov,
+                         .msg_iovlen = n,
+                         .msg_control = ctrl.buf,
+                         .msg_controllen = CMSG_SPACE(sizeof(uint16_t))};
+
+    if (w_connected(ws) == false) {
+        msg.msg_namelen = to_sockaddr(v, &ss);
+        msg.msg_name = &ss;
+    }
+
+    struct cmsghdr * const cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    const uint16_t seg = v->len;
+    memcpy(CMSG_DATA(cm), &seg, sizeof(seg));
+    add_tos(&msg, cm, v);
+
+    return sendmsg(w_fd(ws), &msg, 0) >= 0;
+}
+
+
+void gso_tx(struct w_sock * const ws, struct w_iov_sq * const q)
+{
+    struct w_iov_sq done = w_iov_sq_initializer(done);
+    struct w_iov_sq single = w_iov_sq_initializer(single);
+
+    while (!sq_empty(q)) {
+        const uint16_t n = train_len(ws, sq_first(q));
+        if (n == 1) {
+            struct w_iov * const v = sq_first(q);
+            sq_remove_head(q, next);
+            sq_insert_tail(&single, v, next);
+            continue;
+        }
+
+        // keep the TX order: send anything we skipped over first
+        if (!sq_empty(&single)) {
+            plain_tx(ws, &single);
+            sq_concat(&done, &single);
+        }
+
+        struct w_iov_sq train = w_iov_sq_initializer(train);
+        for (uint16_t i = 0; i < n; i++) {
+            struct w_iov * const v = sq_first(q);
+            sq_remove_head(q, next);
+            sq_insert_tail(&train, v, next);
+        }
+
+        if (unlikely(sendmsg_gso(ws, &train, n) == false)) {
+            // EIO means the egress device cannot checksum, so stop trying
+            if (errno == EIO)
+                ped(ws->w)->udp_gso = false;
+            warn(WRN, "GSO send of %u pkts failed: %s", n, strerror(errno));
+            plain_tx(ws, &train);
+        }
+        sq_concat(&done, &train);
+    }
+
+    if (!sq_empty(&single)) {
+        plain_tx(ws, &single);
+        sq_concat(&done, &single);
+    }
+    sq_concat(q, &done);
+}
+
+
+void txtime_tx(struct q_conn * const c,
+               struct w_sock * const ws,
+               struct w_iov_sq * const q)
+{
+    struct mmsghdr msgs[TXTIME_BATCH];
+    struct iovec iov[TXTIME_BATCH];
+    struct sockaddr_storage ss[TXTIME_BATCH];
+    union {
+        uint8_t buf[CMSG_SPACE(sizeof(uint64_t)) + CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl[TXTIME_BATCH];
+
+    // the pacer runs on the loop clock, fq wants CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    const int64_t ns_per_s = NS_PER_S;
+    const uint64_t mono = (uint64_t)(ts.tv_sec * ns_per_s + ts.tv_nsec);
+    const uint64_t now = loop_now(c->w);
+
+    struct w_iov_sq done = w_iov_sq_initializer(done);
+    while (!sq_empty(q)) {
+        struct w_iov_sq batch = w_iov_sq_initializer(batch);
+        unsigned int n = 0;
+        while (!sq_empty(q) && n < TXTIME_BATCH) {
+            struct w_iov * const v = sq_first(q);
+            sq_remove_head(q, next);
+            sq_insert_tail(&batch, v, next);
+
+            iov[n] = (struct iovec){.iov_base = v->buf, .iov_len = v->len};
+            memset(&ctrl[n], 0, sizeof(ctrl[n]));
+            struct msghdr * const msg = &msgs[n].msg_hdr;
+            *msg = (struct msghdr){
+                .msg_iov = &iov[n],
+                .msg_iovlen = 1,
+                .msg_control = ctrl[n].buf,
+                .msg_controllen = CMSG_SPACE(sizeof(uint64_t))};
+            if (w_connected(ws) == false) {
+                msg->msg_namelen = to_sockaddr(v, &ss[n]);
+                msg->msg_name = &ss[n];
+            }
+
+            struct cmsghdr * const cm = CMSG_FIRSTHDR(msg);
+            cm->cmsg_level = SOL_SOCKET;
+            cm->cmsg_type = SCM_TXTIME;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+            const uint64_t t = mono + (pacer_edt(c, v->len) - now);
+            memcpy(CMSG_DATA(cm), &t, sizeof(t));
+            add_tos(msg, cm, v);
+            n++;
+        }
+
+        // a short count means msgs[sent] failed; retry the tail, which
+        // returns that error if it persists
+        unsigned int sent = 0;
+        while (sent < n) {
+            const int r = sendmmsg(w_fd(ws), &msgs[sent], n - sent, 0);
+            if (r <= 0)
+                break;
+            sent += (unsigned int)r;
+        }
+        if (unlikely(sent < n)) {
+            // send the remainder right away, and stop stamping if refused
+            warn(WRN, "SO_TXTIME send failed: %s", strerror(errno));
+            if (errno == EINVAL || errno == EOPNOTSUPP)
+                ped(ws->w)->txtime = false;
+            for (unsigned int i = 0; i < sent; i++) {
+                struct w_iov * const v = sq_first(&batch);
+                sq_remove_head(&batch, next);
+                sq_insert_tail(&done, v, next);
+            }
+            plain_tx(ws, &batch);
+        }
+        sq_concat(&done, &batch);
+    }
+    sq_concat(q, &done);
+}
+
+
+void gro_rx(struct w_sock * const ws, struct w_iov_sq * const x)
+{
+    struct per_engine_data * const ped = ped(ws->w);
+    struct mmsghdr msgs[GRO_BATCH];
+    struct iovec iov[GRO_BATCH];
+    struct sockaddr_storage sa[GRO_BATCH];
+    union {
+        uint8_t buf[CMSG_SPACE(sizeof(int)) * 3];
+        struct cmsghdr align;
+    } ctrl[GRO_BATCH];
+
+    int n;
+    do {
+        for (int i = 0; i < GRO_BATCH; i++) {
+            iov[i] = (struct iovec){.iov_base = &ped->gro_buf[i * GRO_BUF_LEN],
+                                    .iov_len = GRO_BUF_LEN};
+            msgs[i] = (struct mmsghdr){
+                .msg_hdr = {.msg_name = &sa[i],
+                            .msg_namelen = sizeof(sa[i]),
+                            .msg_iov = &iov[i],
+                            .msg_iovlen = 1,
+                            .msg_control = ctrl[i].buf,
+                            .msg_controllen = sizeof(ctrl[i].buf)}};
+        }
+
+        n = recvmmsg(w_fd(ws), msgs, GRO_BATCH, MSG_DONTWAIT, 0);
+        for (int i = 0; i < n; i++) {
+            const struct msghdr * const msg = &msgs[i].msg_hdr;
+            const uint16_t len = (uint16_t)msgs[i].msg_len;
+            uint16_t seg = len;
+            uint8_t tos = 0;
+            uint8_t ttl = 0;
+
+            for (struct cmsghdr * cm = CMSG_FIRSTHDR(msg); cm;
+                 cm = CMSG_NXTHDR((struct msghdr *)msg, cm)) {
+                int val = 0;
+                memcpy(&val, CMSG_DATA(cm),
+                       MIN(sizeof(val), cm->cmsg_len - CMSG_LEN(0)));
+                if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO &&
+                    val > 0)
+                    seg = (uint16_t)val;
+                else if ((cm->cmsg_level == IPPROTO_IP &&
+                          cm->cmsg_type == IP_TOS) ||
+                         (cm->cmsg_level == IPPROTO_IPV6 &&
+                          cm->cmsg_type == IPV6_TCLASS))
+                    tos = (uint8_t)val;
+                else if ((cm->cmsg_level == IPPROTO_IP &&
+                          cm->cmsg_type == IP_TTL) ||
+                         (cm->cmsg_level == IPPROTO_IPV6 &&
+                          cm->cmsg_type == IPV6_HOPLIMIT))
+                    ttl = (uint8_t)val;
+            }
+
+            struct w_sockaddr saddr = {.port = sa_port(&sa[i])};
+            w_to_waddr(&saddr.addr, (struct sockaddr *)&sa[i]);
+
+            // split the super-datagram into one w_iov per segment
+            const uint8_t * const buf = iov[i].iov_base;
+            for (uint32_t off = 0; off < len; off += seg) {
+                struct w_iov * const xv =
+                    w_alloc_iov(ws->w, ws->ws_af, 0, 0);
+                const uint16_t l = (uint16_t)MIN(seg, len - off);
+                if (unlikely(xv == 0 || l > xv->len)) {
+                    warn(WRN, "cannot buffer %u-byte GRO segment", l);
+                    if (xv)
+                        w_free_iov(xv);
+                    break;
+                }
+                memcpy(xv->buf, &buf[off], l);
+                xv->len = l;
+                xv->saddr = saddr;
+                xv->flags = tos;
+                xv->ttl = ttl;
+                sq_insert_tail(x, xv, next);
+            }
+        }
+    } while (n == GRO_BATCH);
+}
+
+#endif
@@ -0,0 +1,91 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <stdbool.h>
+
+#include <warpcore/warpcore.h>
+
+// UDP segmentation offload needs the Linux socket API
+#ifndef __linux__
+#define NO_GSO
+#endif
+
+#ifndef NO_GSO
+
+struct per_engine_data;
+struct q_conn;
+
+
+/// Maximum number of segments the kernel accepts in one GSO send.
+#define GSO_MAX_SEGS 64
+
+/// Maximum payload of one GSO send, below the 64KB IP datagram limit.
+#define GSO_MAX_LEN 65000
+
+/// Number of GRO super-datagrams received per system call.
+#define GRO_BATCH 8
+
+/// Size of each GRO receive buffer.
+#define GRO_BUF_LEN UINT16_MAX
+
+/// Number of datagrams stamped with a departure time per system call.
+#define TXTIME_BATCH 64
+
+
+extern void __attribute__((nonnull)) gso_init(struct w_engine * const w);
+
+extern void __attribute__((nonnull)) gso_cleanup(struct w_engine * const w);
+
+extern void __attribute__((nonnull)) gro_enable(struct w_sock * const ws);
+
+extern void __attribute__((nonnull))
+gso_tx(struct w_sock * const ws, struct w_iov_sq * const q);
+
+extern void __attribute__((nonnull))
+gro_rx(struct w_sock * const ws, struct w_iov_sq * const x);
+
+extern void __attribute__((nonnull)) txtime_enable(struct w_sock * const ws);
+
+extern void __attribute__((nonnull))
+txtime_tx(struct q_conn * const c,
+          struct w_sock * const ws,
+          struct w_iov_sq * const q);
+
+#else
+
+#define gro_enable(ws)                                                         \
+    do {                                                                       \
+    } while (0)
+
+#define txtime_enable(ws)                                                      \
+    do {                                                                       \
+    } while (0)
+
+#endif
@@ -0,0 +1,116 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <stdint.h>
+#include <sys/param.h>
+
+#include <quant/quant.h>
+
+#include "cc.h"
+#include "conn.h"
+#include "loop.h"
+#include "quic.h"
+#include "recovery.h"
+
+// HyStart++, see RFC9406. Rounds are delimited by the delivery rate state
+// recorded in each pkt_meta. Since quant paces, there is no burst limit L.
+
+#define HS_MIN_RTT_THRESH (4 * US_PER_MS)
+#define HS_MAX_RTT_THRESH (16 * US_PER_MS)
+#define HS_MIN_RTT_DIVISOR 8
+#define HS_N_RTT_SAMPLE 8
+#define HS_CSS_GROWTH_DIVISOR 4
+#define HS_CSS_ROUNDS 5
+
+
+void hystart_init(struct q_conn * const c)
+{
+    c->rec.hystart = (struct hystart){.window_end = c->rec.delivered,
+                                      .last_min_rtt = UINT_T_MAX,
+                                      .cur_min_rtt = UINT_T_MAX};
+}
+
+
+static void __attribute__((nonnull)) end_round(struct q_conn * const c)
+{
+    struct hystart * const hs = &c->rec.hystart;
+
+    if (hs->in_css) {
+        if (hs->rtt_cnt >= HS_N_RTT_SAMPLE &&
+            hs->cur_min_rtt < hs->css_base_rtt)
+            // the RTT increase was spurious, resume slow start
+            hs->in_css = false;
+        else if (++hs->css_rounds >= HS_CSS_ROUNDS) {
+            // enter congestion avoidance
+            hs->in_css = false;
+            c->rec.cur.ssthresh = c->rec.cur.cwnd;
+        }
+    }
+
+    hs->window_end = c->rec.delivered;
+    hs->last_min_rtt = hs->cur_min_rtt;
+    hs->cur_min_rtt = UINT_T_MAX;
+    hs->rtt_cnt = 0;
+}
+
+
+uint_t hystart_ss_incr(struct q_conn * const c, const struct acked * const a)
+{
+    struct hystart * const hs = &c->rec.hystart;
+
+    if (a->delivered >= hs->window_end) {
+        end_round(c);
+        if (c->rec.cur.cwnd >= c->rec.cur.ssthresh)
+            return 0;
+    }
+
+    // we are called once per ACK frame, so take one RTT sample from the most
+    // recently sent pkt it covers
+    if (a->sent_t) {
+        const uint64_t rtt = NS_TO_US(loop_now(c->w) - a->sent_t);
+        hs->cur_min_rtt = (uint_t)MIN(hs->cur_min_rtt, rtt);
+        hs->rtt_cnt++;
+    }
+
+    if (hs->in_css == false && hs->rtt_cnt >= HS_N_RTT_SAMPLE &&
+        hs->cur_min_rtt != UINT_T_MAX && hs->last_min_rtt != UINT_T_MAX) {
+        const uint_t thresh = MAX(HS_MIN_RTT_THRESH,
+                                  MIN(hs->last_min_rtt / HS_MIN_RTT_DIVISOR,
+                                      HS_MAX_RTT_THRESH));
+        if (hs->cur_min_rtt >= hs->last_min_rtt + thresh) {
+            warn(DBG, "%s conn %s RTT %" PRIu " > %" PRIu ", entering CSS",
+                 conn_type(c), cid_str(c->scid), hs->cur_min_rtt,
+                 hs->last_min_rtt);
+            hs->in_css = true;
+            hs->css_base_rtt = hs->cur_min_rtt;
+            hs->css_rounds = 0;
+        }
+    }
+
+    return hs->in_css ? a->cc_bytes / HS_CSS_GROWTH_DIVISOR : a->cc_bytes;
+}
@@ -33,6 +33,9 @@
 #include "conn.h"
 #include "loop.h"
 #include "quic.h"
+#include "shard.h"
+#include "uring.h"
+#include "xdp.h"
 
 
 #if !HAVE_64BIT
@@ -43,75 +46,142 @@
 #include <timeout.c>
 
 
-func_ptr api_func = 0;
-void * api_conn = 0;
-void * api_strm = 0;
+void loop_break(struct w_engine * const w)
+{
+    ped(w)->break_loop = true;
+    ped(w)->api_func = 0;
+    ped(w)->api_conn = ped(w)->api_strm = 0;
+}
+
 
-static uint64_t now;
-static bool break_loop;
+void loop_init(struct w_engine * const w)
+{
+    ped(w)->now = w_now();
+    ped(w)->break_loop = false;
+}
 
 
-void loop_break(void)
+uint64_t loop_now(const struct w_engine * const w)
 {
-    break_loop = true;
-    api_func = 0;
-    api_conn = api_strm = 0;
+    return ped(w)->now;
 }
 
 
-void loop_init(void)
+void loop_timers(struct w_engine * const w)
 {
-    now = w_now();
-    break_loop = false;
+    struct per_engine_data * const ped = ped(w);
+    ped->now = w_now();
+    timeouts_update(ped->wheel, ped->now);
+
+    struct timeout * t;
+    while ((t = timeouts_get(ped->wheel)) != 0)
+        (*t->callback.fn)(t->callback.arg);
+
+    if (ped->have_cb && !ped->in_cb)
+        dispatch_events(w);
 }
 
 
-uint64_t loop_now(void)
+uint64_t loop_next(struct w_engine * const w)
 {
-    return now;
+    return timeouts_timeout(ped(w)->wheel);
 }
 
 
-void __attribute__((nonnull(1))) loop_run(struct w_engine * const w,
-                                          const func_ptr f,
-                                          struct q_conn * const c,
-                                          struct q_stream * const s)
+static bool __attribute__((nonnull))
+rx_socks(struct w_engine * const w, const int64_t nsec)
 {
-    ensure(api_func == 0, "other API call active");
-    api_func = f;
-    api_conn = c;
-    api_strm = s;
-    break_loop = false;
+    if (w_nic_rx(w, nsec) == false)
+        return false;
 
-    while (likely(break_loop == false)) {
-        now = w_now();
-        timeouts_update(ped(w)->wheel, now);
+    struct w_sock_slist sl = w_sock_slist_initializer(sl);
+    if (w_rx_ready(w, &sl) == 0)
+        return false;
 
-        struct timeout * t;
-        while ((t = timeouts_get(ped(w)->wheel)) != 0)
-            (*t->callback.fn)(t->callback.arg);
+    struct per_engine_data * const ped = ped(w);
+    ped->now = w_now();
+    timeouts_update(ped->wheel, ped->now);
 
-        if (unlikely(break_loop))
-            break;
+    struct w_sock * ws;
+    sl_foreach (ws, &sl, next)
+        rx(ws);
+    return true;
+}
 
-        const uint64_t next = timeouts_timeout(ped(w)->wheel);
-        ensure(next, "next is null"); // FIXME: remove eventually
 
-        if (w_nic_rx(w, (int64_t)next) == false)
-            continue;
+static bool __attribute__((nonnull))
+rx_any(struct w_engine * const w, int64_t nsec)
+{
+#ifndef NO_SERVER
+    if (ped(w)->shards && nsec) {
+        // the backends below cannot also wait for other shards' handoffs
+        wait_pfds(w, nsec);
+        nsec = 0;
+    }
+#endif
+#ifdef WITH_IO_URING
+    if (ped(w)->uring)
+        // completions are both the readiness signal and the data
+        return uring_rx(w, nsec);
+#endif
+#ifdef WITH_AF_XDP
+    if (ped(w)->xdp) {
+        // xdp_rx() also waits for the kernel sockets, which get all
+        // traffic the XDP program does not steer to us
+        const bool did_rx = xdp_rx(w, nsec);
+        return rx_socks(w, 0) || did_rx;
+    }
+#endif
+    return rx_socks(w, nsec);
+}
 
-        struct w_sock_slist sl = w_sock_slist_initializer(sl);
-        if (w_rx_ready(w, &sl) == 0)
-            continue;
 
-        now = w_now();
-        timeouts_update(ped(w)->wheel, now);
+bool loop_rx(struct w_engine * const w, const int64_t nsec)
+{
+    if (rx_any(w, nsec) == false)
+        return false;
+
+    struct per_engine_data * const ped = ped(w);
+    if (ped->have_cb && !ped->in_cb)
+        dispatch_events(w);
+    return true;
+}
+
 
-        struct w_sock * ws;
-        sl_foreach (ws, &sl, next)
-            rx(ws);
+void __attribute__((nonnull(1))) loop_run(struct w_engine * const w,
+                                          const func_ptr f,
+                                          struct q_conn * const c,
+                                          struct q_stream * const s)
+{
+    struct per_engine_data * const ped = ped(w);
+    // blocking API calls may only nest inside application callbacks
+    ensure(ped->api_func == 0 || ped->in_cb, "other API call active");
+    const func_ptr prev_func = ped->api_func;
+    void * const prev_conn = ped->api_conn;
+    void * const prev_strm = ped->api_strm;
+    ped->api_func = f;
+    ped->api_conn = c;
+    ped->api_strm = s;
+    ped->break_loop = false;
+
+    while (likely(ped->break_loop == false)) {
+        loop_timers(w);
+        if (unlikely(ped->break_loop))
+            break;
+
+#ifndef NO_SERVER
+        if (ped->shards && shard_rx(w))
+            // we processed datagrams handed over by other shards
+            continue;
+#endif
+
+        const uint64_t next = loop_next(w);
+        ensure(next, "next is null"); // FIXME: remove eventually
+        loop_rx(w, (int64_t)next);
     }
 
-    api_func = 0;
-    api_conn = api_strm = 0;
+    ped->api_func = prev_func;
+    ped->api_conn = prev_conn;
+    ped->api_strm = prev_strm;
+    ped->break_loop = false;
 }
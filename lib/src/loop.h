@@ -27,6 +27,7 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include <quant/quant.h>
@@ -39,18 +40,19 @@ struct q_stream; // IWYU pragma: no_forward_declare q_stream
 #include "quic.h" // IWYU pragma: keep
 
 
-typedef void (*func_ptr)(void);
+extern void __attribute__((nonnull)) loop_init(struct w_engine * const w);
 
-extern func_ptr api_func;
-extern void * api_conn;
-extern void * api_strm;
+extern uint64_t __attribute__((nonnull))
+loop_now(const struct w_engine * const w);
 
+extern void __attribute__((nonnull)) loop_break(struct w_engine * const w);
 
-extern void loop_init(void);
+extern void __attribute__((nonnull)) loop_timers(struct w_engine * const w);
 
-extern uint64_t loop_now(void);
+extern uint64_t __attribute__((nonnull)) loop_next(struct w_engine * const w);
 
-extern void loop_break(void);
+extern bool __attribute__((nonnull))
+loop_rx(struct w_engine * const w, const int64_t nsec);
 
 extern void __attribute__((nonnull(1))) loop_run(struct w_engine * const w,
                                                  const func_ptr f,
@@ -79,41 +81,46 @@ extern void __attribute__((nonnull(1))) loop_run(struct w_engine * const w,
 
 
 /// If current API function and argument match @p func and @p arg - and @p strm
-/// if it is non-zero - exit the event loop.
+/// if it is non-zero - exit the event loop of engine @p w.
 ///
+/// @param      w     The engine whose event loop to potentially exit.
 /// @param      func  The API function to potentially return to.
 /// @param      conn  The connection to check API activity on.
 /// @param      strm  The stream to check API activity on.
 ///
 /// @return     True if the event loop was exited.
 ///
-#define maybe_api_return3(func, conn, strm)                                    \
+#define maybe_api_return4(w, func, conn, strm)                                 \
     __extension__({                                                            \
-        if (unlikely(api_func == (func_ptr)(&(func)) && api_conn == (conn) &&  \
-                     ((strm) == 0 || api_strm == (strm)))) {                   \
-            loop_break();                                                      \
+        struct per_engine_data * const _ped = ped(w);                          \
+        if (unlikely(_ped->api_func == (func_ptr)(&(func)) &&                  \
+                     _ped->api_conn == (conn) &&                               \
+                     ((strm) == 0 || _ped->api_strm == (strm)))) {             \
+            loop_break(w);                                                     \
             DEBUG_EXTRA_warn(DBG, #func "(" #conn ", " #strm                   \
                                         ") done, exiting event loop");         \
         }                                                                      \
-        api_func == 0;                                                         \
+        _ped->api_func == 0;                                                   \
     })
 
 
 /// If current API argument matches @p arg - and @p strm if it is non-zero -
-/// exit the event loop (for any active API function).
+/// exit the event loop of engine @p w (for any active API function).
 ///
+/// @param      w     The engine whose event loop to potentially exit.
 /// @param      conn  The connection to check API activity on.
 /// @param      strm  The stream to check API activity on.
 ///
 /// @return     True if the event loop was exited.
 ///
-#define maybe_api_return2(conn, strm)                                          \
+#define maybe_api_return3(w, conn, strm)                                       \
     __extension__({                                                            \
-        if (unlikely(api_conn == (conn) &&                                     \
-                     ((strm) == 0 || api_strm == (strm)))) {                   \
-            loop_break();                                                      \
+        struct per_engine_data * const _ped = ped(w);                          \
+        if (unlikely(_ped->api_conn == (conn) &&                               \
+                     ((strm) == 0 || _ped->api_strm == (strm)))) {             \
+            loop_break(w);                                                     \
             DEBUG_EXTRA_warn(DBG, "<any>(" #conn ", " #strm                    \
                                   ") done, exiting event loop");               \
         }                                                                      \
-        api_func == 0;                                                         \
+        _ped->api_func == 0;                                                   \
     })
@@ -0,0 +1,101 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <stdint.h>
+#include <sys/param.h>
+
+#include <quant/quant.h>
+
+#include "cc.h"
+#include "conn.h"
+#include "pacer.h"
+#include "pkt.h"
+#include "quic.h"
+#include "recovery.h"
+
+
+static void __attribute__((nonnull)) newreno_init(struct q_conn * const c)
+{
+    c->rec.cur.cwnd = kInitialWindow(c->rec.max_pkt_size);
+    c->rec.cur.ssthresh = UINT_T_MAX;
+    hystart_init(c);
+}
+
+
+static void __attribute__((nonnull))
+newreno_on_ack(struct q_conn * const c, const struct acked * const a)
+{
+    // OnPacketAckedCC, for pkts not sent during the recovery period
+    if (a->cc_bytes == 0)
+        return;
+
+    // TODO: IsAppLimited check
+
+    if (c->rec.cur.cwnd < c->rec.cur.ssthresh)
+        c->rec.cur.cwnd += hystart_ss_incr(c, a);
+    else
+        c->rec.cur.cwnd +=
+            (c->rec.max_pkt_size * a->cc_bytes) / c->rec.cur.cwnd;
+}
+
+
+static void __attribute__((nonnull))
+newreno_on_loss(struct q_conn * const c,
+                const uint64_t sent_t __attribute__((unused)))
+{
+    // see CongestionEvent() pseudo code
+    c->rec.cur.cwnd /= kLossReductionDivisor;
+    c->rec.cur.ssthresh = c->rec.cur.cwnd =
+        MAX(c->rec.cur.cwnd, kMinimumWindow(c->rec.max_pkt_size));
+    c->rec.hystart.in_css = false;
+}
+
+
+static void __attribute__((nonnull))
+newreno_on_persistent_congestion(struct q_conn * const c)
+{
+    c->rec.cur.cwnd = kMinimumWindow(c->rec.max_pkt_size);
+    c->rec.hystart.in_css = false;
+}
+
+
+static void __attribute__((nonnull))
+newreno_app_limited(struct q_conn * const c __attribute__((unused)))
+{
+}
+
+
+const struct cc_ops cc_newreno = {
+    .name = "newreno",
+    .init = newreno_init,
+    .on_ack = newreno_on_ack,
+    .on_loss = newreno_on_loss,
+    .on_persistent_congestion = newreno_on_persistent_congestion,
+    .pacing_rate = cwnd_pacing_rate,
+    .app_limited = newreno_app_limited,
+};
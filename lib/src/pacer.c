@@ -0,0 +1,160 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/param.h>
+
+#include <quant/quant.h>
+#include <timeout.h>
+
+#include "cc.h"
+#include "conn.h"
+#include "loop.h"
+#include "pacer.h"
+#include "quic.h"
+#include "recovery.h"
+
+
+static inline uint_t __attribute__((nonnull))
+max_tokens(const struct q_conn * const c)
+{
+    return c->pacer.burst * c->rec.max_pkt_size;
+}
+
+
+static inline uint64_t __attribute__((nonnull))
+rate(const struct q_conn * const c)
+{
+    return c->rec.cc->pacing_rate(c);
+}
+
+
+static inline uint64_t __attribute__((nonnull))
+tx_time(const uint64_t bytes, const uint64_t bps)
+{
+    return bytes * NS_PER_S / bps;
+}
+
+
+static void __attribute__((nonnull)) refill(struct q_conn * const c)
+{
+    struct pacer * const p = &c->pacer;
+    const uint64_t now = loop_now(c->w);
+    const uint64_t bps = rate(c);
+
+    // without a rate estimate there is nothing to pace at
+    if (unlikely(bps == 0)) {
+        p->tokens = max_tokens(c);
+        p->t = now;
+        return;
+    }
+
+    // the bucket is full again after this long at the latest
+    const uint64_t dt = MIN(now - p->t, tx_time(max_tokens(c), bps));
+    const uint64_t add = dt * bps / NS_PER_S;
+    if (add == 0 && p->tokens < max_tokens(c))
+        // keep accumulating time until it buys at least one byte
+        return;
+
+    p->tokens = (uint_t)MIN(p->tokens + add, max_tokens(c));
+    p->t = now;
+}
+
+
+uint64_t cwnd_pacing_rate(const struct q_conn * const c)
+{
+    if (unlikely(c->rec.cur.srtt == 0))
+        return 0;
+    return (uint64_t)c->rec.cur.cwnd * PACING_GAIN_NUM * US_PER_S /
+           ((uint64_t)c->rec.cur.srtt * PACING_GAIN_DEN);
+}
+
+
+void init_pacer(struct q_conn * const c, const uint8_t burst_pkts)
+{
+    struct pacer * const p = &c->pacer;
+    timeout_del(&p->alarm);
+    p->burst = burst_pkts;
+    p->tokens = max_tokens(c);
+    p->t = p->edt = loop_now(c->w);
+    timeout_setcb(&p->alarm, tx, c);
+}
+
+
+bool pacer_ok(struct q_conn * const c, const uint16_t len)
+{
+    if (ped(c->w)->txtime)
+        // the kernel paces, based on the departure times from pacer_edt()
+        return true;
+
+    refill(c);
+    return c->pacer.tokens >= MIN(len, max_tokens(c));
+}
+
+
+void pacer_sent(struct q_conn * const c, const uint16_t len)
+{
+    c->pacer.tokens -= MIN(c->pacer.tokens, len);
+}
+
+
+void pacer_arm(struct q_conn * const c)
+{
+    const uint_t need = c->rec.max_pkt_size;
+    const uint64_t bps = rate(c);
+    if (unlikely(bps == 0 || c->pacer.tokens >= need))
+        return;
+
+    const timeout_t t = tx_time(need - c->pacer.tokens, bps);
+
+#ifdef DEBUG_TIMERS
+    warn(DBG, "next pacing alarm in %.3f sec", (double)t / NS_PER_S);
+#endif
+
+    timeouts_add(ped(c->w)->wheel, &c->pacer.alarm, MAX(t, 1));
+}
+
+
+uint64_t pacer_edt(struct q_conn * const c, const uint16_t len)
+{
+    struct pacer * const p = &c->pacer;
+    const uint64_t now = loop_now(c->w);
+    const uint64_t bps = rate(c);
+    if (unlikely(bps == 0))
+        return p->edt = now;
+
+    // an idle sender may send up to a burst allowance back-to-back
+    const uint64_t credit = tx_time(max_tokens(c), bps);
+    if (now > credit)
+        p->edt = MAX(p->edt, now - credit);
+
+    const uint64_t t = MAX(p->edt, now);
+    p->edt += tx_time(len, bps);
+    return t;
+}
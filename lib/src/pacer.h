@@ -0,0 +1,72 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <quant/quant.h>
+#include <timeout.h>
+
+struct q_conn; // IWYU pragma: no_forward_declare q_conn
+
+
+/// Pacing gain of cwnd_pacing_rate(), as a fraction (5/4 = 1.25).
+#define PACING_GAIN_NUM 5
+#define PACING_GAIN_DEN 4
+
+/// Default burst allowance, in packets.
+#define DEF_PACING_BURST 10
+
+
+struct pacer {
+    struct timeout alarm; ///< Fires tx() when the next packet may go out.
+    uint64_t t;           ///< Time of the last token refill.
+    uint64_t edt;         ///< Earliest departure time of the next packet.
+    uint_t tokens;        ///< Bytes that may be sent without waiting.
+    uint_t burst;         ///< Maximum number of tokens (burst allowance).
+};
+
+
+extern uint64_t __attribute__((nonnull))
+cwnd_pacing_rate(const struct q_conn * const c);
+
+extern void __attribute__((nonnull))
+init_pacer(struct q_conn * const c, const uint8_t burst_pkts);
+
+extern bool __attribute__((nonnull))
+pacer_ok(struct q_conn * const c, const uint16_t len);
+
+extern void __attribute__((nonnull))
+pacer_sent(struct q_conn * const c, const uint16_t len);
+
+extern void __attribute__((nonnull)) pacer_arm(struct q_conn * const c);
+
+extern uint64_t __attribute__((nonnull))
+pacer_edt(struct q_conn * const c, const uint16_t len);
@@ -43,9 +43,11 @@
 #include <timeout.h>
 #include <warpcore/warpcore.h>
 
+#include "ackfreq.h"
 #include "bitset.h"
 #include "conn.h"
 #include "diet.h"
+#include "ecn.h"
 #include "frame.h"
 #include "marshall.h"
 #include "pkt.h"
@@ -396,6 +398,9 @@ enc_other_frames(
     if (c->tx_max_data && can_enc(pos, end, m, FRM_MCD, true))
         enc_max_data_frame(ci, pos, end, m);
 
+    if (c->tx_ack_freq && can_enc(pos, end, m, FRM_AFQ, true))
+        enc_ack_freq_frame(ci, pos, end, m);
+
     if (c->sid_blocked_bidi && can_enc(pos, end, m, FRM_SBB, true))
         enc_streams_blocked_frame(ci, pos, end, m, true);
 
@@ -635,7 +640,9 @@ bool enc_pkt(struct q_stream * const s,
     m->ack_eliciting = is_ack_eliciting(&m->frms);
     if (unlikely(tx_ack_eliciting) && m->ack_eliciting == false &&
         m->hdr.type == SH) {
-        enc_ping_frame(ci, &pos, end, m);
+        // if the peer may be delaying ACKs, ask it not to for this probe
+        (c->tp_peer.min_ack_del ? enc_imm_ack_frame : enc_ping_frame)(
+            ci, &pos, end, m);
         m->ack_eliciting = true;
     }
 
@@ -668,8 +675,10 @@ tx:;
         memcpy(xv->buf, v->buf, v->len); // copy data
         xv->len = v->len;
     } else {
+        // defer protecting 1-RTT pkts to the batch in enc_aead_flush()
         const uint16_t ret =
-            enc_aead(v, m, xv, (uint16_t)(pkt_nr_pos - v->buf));
+            (likely(m->hdr.type == SH) ? enc_aead_queue : enc_aead)(
+                v, m, xv, (uint16_t)(pkt_nr_pos - v->buf));
         if (unlikely(ret == 0)) {
             adj_iov_to_start(v, m);
             return false;
@@ -681,7 +690,8 @@ tx:;
 
     // track the flags manually, since warpcore sets them on the xv and it'd
     // require another loop to copy them over
-    xv->flags = v->flags |= likely(c->sockopt.enable_ecn) ? IPTOS_ECN_ECT0 : 0;
+    v->flags = (v->flags & ~IPTOS_ECN_MASK) | ecn_mark(c);
+    xv->flags = v->flags;
 
     // encode the pn space id and pkt nr to identify PMTUD pkts;
     // this only works for packets numbered below 0x3fff, but that is plenty
@@ -813,8 +823,10 @@ bool dec_pkt_hdr_beginning(struct w_iov * const xv,
 
         if (m->hdr.vers == 0) {
             // version negotiation packet - copy raw
-            memcpy(v->buf, xv->buf, xv->len);
-            v->len = xv->len;
+            if (v != xv) {
+                memcpy(v->buf, xv->buf, xv->len);
+                v->len = xv->len;
+            }
             goto done;
         }
 
@@ -872,22 +884,23 @@ done:
 }
 
 
-bool xor_hp(struct w_iov * const xv,
-            const struct pkt_meta * const m,
-            const struct cipher_ctx * const ctx,
-            const uint16_t pkt_nr_pos,
-            const bool is_enc)
+uint16_t hp_sample_off(const struct w_iov * const xv,
+                       const struct pkt_meta * const m,
+                       const uint16_t pkt_nr_pos)
 {
     const uint16_t off = pkt_nr_pos + MAX_PKT_NR_LEN;
     const uint16_t len =
         is_lh(m->hdr.flags) ? pkt_nr_pos + m->hdr.len : xv->len;
-    if (unlikely(off + AEAD_LEN > len))
-        return false;
+    return unlikely(off + AEAD_LEN > len) ? 0 : off;
+}
 
-    ptls_cipher_init(ctx->header_protection, &xv->buf[off]);
-    uint8_t mask[MAX_PKT_NR_LEN + 1] = {0};
-    ptls_cipher_encrypt(ctx->header_protection, mask, mask, sizeof(mask));
 
+void apply_hp_mask(struct w_iov * const xv,
+                   const struct pkt_meta * const m,
+                   const uint16_t pkt_nr_pos,
+                   const uint8_t * const mask,
+                   const bool is_enc)
+{
     const uint8_t orig_flags = xv->buf[0];
     xv->buf[0] ^= mask[0] & (unlikely(is_lh(m->hdr.flags)) ? 0x0f : 0x1f);
     const uint8_t pnl = pkt_nr_len(is_enc ? orig_flags : xv->buf[0]);
@@ -896,9 +909,25 @@ bool xor_hp(struct w_iov * const xv,
 
 #ifdef DEBUG_PROT
     warn(DBG, "%s HP over [0, %u..%u] w/sample off %u",
-         is_enc ? "apply" : "undo", pkt_nr_pos, pkt_nr_pos + pnl - 1, off);
+         is_enc ? "apply" : "undo", pkt_nr_pos, pkt_nr_pos + pnl - 1,
+         pkt_nr_pos + MAX_PKT_NR_LEN);
 #endif
+}
+
+
+bool xor_hp(struct w_iov * const xv,
+            const struct pkt_meta * const m,
+            const struct cipher_ctx * const ctx,
+            const uint16_t pkt_nr_pos,
+            const bool is_enc)
+{
+    const uint16_t off = hp_sample_off(xv, m, pkt_nr_pos);
+    if (unlikely(off == 0))
+        return false;
 
+    uint8_t mask[HP_SAMPLE_LEN];
+    hp_masks(ctx, &xv->buf[off], mask, 1);
+    apply_hp_mask(xv, m, pkt_nr_pos, mask, is_enc);
     return true;
 }
 
@@ -995,7 +1024,7 @@ struct q_conn * is_srt(const struct w_iov * const xv
         return 0;
 
     uint8_t * const srt = &xv->buf[xv->len - SRT_LEN];
-    struct q_conn * const c = get_conn_by_srt(srt);
+    struct q_conn * const c = get_conn_by_srt(xv->w, srt);
 
     if (c && c->state != conn_drng) {
         m->is_reset = true;
@@ -1094,7 +1123,7 @@ bool dec_pkt_hdr_remainder(struct w_iov * const xv,
         if (unlikely(v_kyph != pnd->in_kyph))
             pnd->in_kyph = v_kyph;
 
-        if (c->spin_enabled && m->hdr.nr > diet_max(&pn->recv_all))
+        if (c->spin_enabled && m->hdr.nr > rx_hist_max(&pn->recv_all))
             // short header, spin the bit
             c->spin = (is_set(SH_SPIN, m->hdr.flags) == !is_clnt(c));
     }
@@ -1110,13 +1139,12 @@ bool dec_pkt_hdr_remainder(struct w_iov * const xv,
     }
 
     // packet protection verified OK
-    if (diet_find(&pn_for_pkt_type(c, m->hdr.type)->recv_all, m->hdr.nr))
+    if (rx_hist_find(&pn_for_pkt_type(c, m->hdr.type)->recv_all, m->hdr.nr))
         goto check_srt;
 
     // check if we need to send an immediate ACK
-    if ((unlikely(diet_empty(&m->pn->recv_all) == false &&
-                  m->hdr.nr < diet_max(&m->pn->recv_all)) ||
-         (xv->flags & IPTOS_ECN_MASK) == IPTOS_ECN_CE))
+    if (unlikely(ack_freq_reordered(m->pn, m->hdr.nr)) ||
+        (xv->flags & IPTOS_ECN_MASK) == IPTOS_ECN_CE)
         // XXX: this also sends an imm_ack if the reor is "fixed" within a burst
         m->pn->imm_ack = true;
 
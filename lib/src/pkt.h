@@ -159,6 +159,18 @@ has_pkt_nr(const uint8_t flags, const uint32_t vers)
 }
 
 
+extern uint16_t __attribute__((nonnull))
+hp_sample_off(const struct w_iov * const xv,
+              const struct pkt_meta * const m,
+              const uint16_t pkt_nr_pos);
+
+extern void __attribute__((nonnull))
+apply_hp_mask(struct w_iov * const xv,
+              const struct pkt_meta * const m,
+              const uint16_t pkt_nr_pos,
+              const uint8_t * const mask,
+              const bool is_enc);
+
 extern bool __attribute__((nonnull)) xor_hp(struct w_iov * const xv,
                                             const struct pkt_meta * const m,
                                             const struct cipher_ctx * const ctx,
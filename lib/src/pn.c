@@ -26,8 +26,10 @@
 // POSSIBILITY OF SUCH DAMAGE.
 
 #include <stdbool.h>
-#include <string.h>
+#include <stdlib.h>
+#include <sys/param.h>
 
+#include "ackfreq.h"
 #include "bitset.h"
 #include "conn.h"
 #include "frame.h"
@@ -37,21 +39,60 @@
 #include "stream.h"
 
 
-void pm_by_nr_del(khash_t(pm_by_nr) * const pbn,
-                  const struct pkt_meta * const p)
+#define PM_RING_MIN_CAP 64
+
+
+static void __attribute__((nonnull))
+pm_ring_grow(struct pm_ring * const r, const uint_t lo, const uint_t hi)
 {
-    const khiter_t k = kh_get(pm_by_nr, pbn, p->hdr.nr);
-    ensure(k != kh_end(pbn), "found");
-    kh_del(pm_by_nr, pbn, k);
+    uint_t cap = MAX(r->cap, PM_RING_MIN_CAP);
+    while (hi - lo > cap)
+        cap <<= 1;
+
+    struct pkt_meta ** const slot = calloc(cap, sizeof(*slot));
+    ensure(slot, "could not calloc");
+    // slots are indexed by absolute pkt nr, so re-place the tracked ones
+    for (uint_t nr = r->base; nr < r->end; nr++)
+        slot[nr & (cap - 1)] = r->slot[nr & (r->cap - 1)];
+    free(r->slot);
+    r->slot = slot;
+    r->cap = cap;
+}
+
+
+void pm_by_nr_del(struct pm_ring * const r, const struct pkt_meta * const p)
+{
+    const uint_t nr = p->hdr.nr;
+    ensure(pm_ring_get(r, nr) == p, "found");
+    r->slot[nr & (r->cap - 1)] = 0;
+
+    if (--r->cnt == 0) {
+        r->base = r->end = nr + 1;
+        return;
+    }
+
+    // keep base and end tight, so iteration skips the ACK'ed prefix
+    while (r->slot[r->base & (r->cap - 1)] == 0)
+        r->base++;
+    while (r->slot[(r->end - 1) & (r->cap - 1)] == 0)
+        r->end--;
 }
 
 
-void pm_by_nr_ins(khash_t(pm_by_nr) * const pbn, struct pkt_meta * const p)
+void pm_by_nr_ins(struct pm_ring * const r, struct pkt_meta * const p)
 {
-    int ret;
-    const khiter_t k = kh_put(pm_by_nr, pbn, p->hdr.nr, &ret);
-    ensure(ret >= 1, "inserted");
-    kh_val(pbn, k) = p;
+    const uint_t nr = p->hdr.nr;
+    const uint_t lo = r->cnt ? MIN(r->base, nr) : nr;
+    const uint_t hi = r->cnt ? MAX(r->end, nr + 1) : nr + 1;
+    if (unlikely(hi - lo > r->cap))
+        pm_ring_grow(r, lo, hi);
+
+    struct pkt_meta ** const s = &r->slot[nr & (r->cap - 1)];
+    ensure(*s == 0, "inserted");
+    *s = p;
+    r->base = lo;
+    r->end = hi;
+    r->cnt++;
 }
 
 
@@ -59,10 +100,9 @@ struct w_iov * find_sent_pkt(const struct pn_space * const pn,
                              const uint_t nr,
                              struct pkt_meta ** const m)
 {
-    const khiter_t k = kh_get(pm_by_nr, &pn->sent_pkts, nr);
-    if (unlikely(k == kh_end(&pn->sent_pkts)))
+    *m = pm_ring_get(&pn->sent_pkts, nr);
+    if (unlikely(*m == 0))
         return 0;
-    *m = kh_val(&pn->sent_pkts, k);
     return w_iov(pn->c->w, pm_idx(pn->c->w, *m));
 }
 
@@ -72,8 +112,7 @@ void init_pn(struct pn_space * const pn,
              const pn_t type)
 {
     diet_init(&pn->recv);
-    diet_init(&pn->recv_all);
-    diet_init(&pn->acked_or_lost);
+    rx_hist_init(&pn->recv_all);
     pn->lg_sent = pn->lg_acked = UINT_T_MAX;
     pn->c = c;
     pn->type = type;
@@ -85,28 +124,26 @@ void free_pn(struct pn_space * const pn)
 {
     if (pn->abandoned == false) {
         struct pkt_meta * m;
-        kh_foreach_value(&pn->sent_pkts, m, {
+        pm_ring_foreach (m, &pn->sent_pkts, UINT_T_MAX)
             // TX'ed but non-RTX'ed pkts are freed when their stream is freed
             if (m->has_rtx || !has_strm_data(m))
                 free_iov(w_iov(pn->c->w, pm_idx(pn->c->w, m)), m);
-        });
-        kh_release(pm_by_nr, &pn->sent_pkts);
+        free(pn->sent_pkts.slot);
+        pn->sent_pkts = (struct pm_ring){0};
         pn->abandoned = true;
     }
 
     diet_free(&pn->recv);
-    diet_free(&pn->recv_all);
-    diet_free(&pn->acked_or_lost);
 }
 
 
 void reset_pn(struct pn_space * const pn)
 {
     free_pn(pn);
-    memset(&pn->sent_pkts, 0, sizeof(pn->sent_pkts));
     pn->lg_sent = pn->lg_acked = UINT_T_MAX;
     pn->ect0_cnt = pn->ect1_cnt = pn->ce_cnt = 0;
-    pn->pkts_rxed_since_last_ack_tx = 0;
+    pn->ect0_peer = pn->ect1_peer = pn->ce_peer = 0;
+    pn->pkts_rxed_since_last_ack_tx = pn->ae_rxed_since_last_ack_tx = 0;
     pn->abandoned = false;
     bit_zero(FRM_MAX, &pn->rx_frames);
     bit_zero(FRM_MAX, &pn->tx_frames);
@@ -172,10 +209,13 @@ ack_t needs_ack(const struct pn_space * const pn)
         return imm_ack;
     }
 
-    const bool rxed_two_or_more = pn->pkts_rxed_since_last_ack_tx >= 2;
-    if (rxed_two_or_more) {
+    // the peer may have raised the threshold via ACK_FREQUENCY
+    const uint_t thresh =
+        pn->type == pn_data ? pn->c->afq.thresh_in : AFQ_DEF_THRESH;
+    const bool rxed_over_thresh = pn->ae_rxed_since_last_ack_tx > thresh;
+    if (rxed_over_thresh) {
 #ifdef DEBUG_EXTRA
-        warn(DBG, "%s conn %s: %s imm_ack: rxed_two_or_more", conn_type(pn->c),
+        warn(DBG, "%s conn %s: %s imm_ack: rxed_over_thresh", conn_type(pn->c),
              cid_str(pn->c->scid), pn_type_str(pn->type));
 #endif
         return imm_ack;
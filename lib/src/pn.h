@@ -28,11 +28,13 @@
 #pragma once
 
 #include <stdint.h>
+#include <sys/param.h>
 
 #include <quant/quant.h>
 
 #include "diet.h"
 #include "frame.h"
+#include "rxhist.h"
 #include "tls.h"
 
 struct pkt_meta; // IWYU pragma: no_forward_declare pkt_meta
@@ -40,7 +42,91 @@ struct q_conn;   // IWYU pragma: no_forward_declare q_conn
 // IWYU pragma: no_include "quic.h"
 
 
-KHASH_MAP_INIT_INT64(pm_by_nr, struct pkt_meta *)
+/// Sent packets, indexed by packet number. Slots are addressed by the packet
+/// number modulo the (power-of-two) capacity, and the ring covers the packet
+/// numbers from base up to (but not including) end.
+struct pm_ring {
+    struct pkt_meta ** slot;
+    uint_t base; ///< Smallest tracked packet number.
+    uint_t end;  ///< Largest tracked packet number plus one.
+    uint_t cnt;  ///< Number of tracked packets.
+    uint_t cap;  ///< Number of slots.
+};
+
+
+/// Largest number of ACK ranges (including the first one) in an ACK frame.
+/// Received packet numbers below the last encodable range are forgotten.
+#define ACK_MAX_RNGS 32
+
+
+/// The gap and ACK range pairs that followed the first ACK range in the last
+/// ACK frame, as encoded bytes. A pair can be copied into the next ACK frame
+/// verbatim if its interval and the start of the interval above it in the
+/// receive history have not changed since.
+struct ack_cache {
+    uint_t lo[ACK_MAX_RNGS - 1];    ///< Smallest packet number of each pair.
+    uint_t hi[ACK_MAX_RNGS - 1];    ///< Largest packet number of each pair.
+    uint_t top_lo;                  ///< Smallest packet number of first range.
+    uint16_t end[ACK_MAX_RNGS - 1]; ///< End offset of each pair in buf.
+    uint8_t cnt;                    ///< Number of pairs in buf.
+    uint8_t _unused;
+    uint8_t buf[(ACK_MAX_RNGS - 1) * 2 * sizeof(uint64_t)];
+};
+
+
+static inline struct pkt_meta * __attribute__((nonnull))
+pm_ring_get(const struct pm_ring * const r, const uint_t nr)
+{
+    return nr >= r->base && nr < r->end ? r->slot[nr & (r->cap - 1)] : 0;
+}
+
+
+static inline struct pkt_meta * __attribute__((nonnull))
+pm_ring_next(const struct pm_ring * const r,
+             uint_t * const nr,
+             const uint_t max_nr)
+{
+    for (*nr = MAX(*nr, r->base); *nr < r->end && *nr <= max_nr; (*nr)++) {
+        struct pkt_meta * const m = r->slot[*nr & (r->cap - 1)];
+        if (m)
+            return m;
+    }
+    return 0;
+}
+
+
+static inline struct pkt_meta * __attribute__((nonnull))
+pm_ring_prev(const struct pm_ring * const r,
+             uint_t * const nr,
+             const uint_t min_nr)
+{
+    if (r->cnt == 0)
+        return 0;
+    const uint_t lo = MAX(min_nr, r->base);
+    for (*nr = MIN(*nr, r->end - 1); *nr >= lo; (*nr)--) {
+        struct pkt_meta * const m = r->slot[*nr & (r->cap - 1)];
+        if (m)
+            return m;
+        if (*nr == 0)
+            break;
+    }
+    return 0;
+}
+
+
+/// Iterate over the packets in @p r in packet number order, up to @p max_nr.
+/// It is safe to remove the current packet from @p r during iteration.
+#define pm_ring_foreach(m, r, max_nr)                                          \
+    for (uint_t _nr = (r)->base;                                               \
+         ((m) = pm_ring_next((r), &_nr, (max_nr))) != 0; _nr++)
+
+
+/// Iterate over the packets in @p r numbered from @p hi down to @p lo. It is
+/// safe to remove the current packet, or (re-)insert one numbered above it.
+#define pm_ring_foreach_rev(m, r, lo, hi)                                      \
+    for (uint_t _nr = (hi);                                                    \
+         _nr != UINT_T_MAX && ((m) = pm_ring_prev((r), &_nr, (lo))) != 0;     \
+         _nr--)
 
 
 struct pn_hshk {
@@ -86,24 +172,26 @@ struct pn_space {
     struct frames tx_frames; ///< Frame types TX'ed since last ACK RX.
 
     struct diet recv; ///< Received packet numbers still needing to be ACKed.
-    struct diet recv_all;      ///< All received packet numbers.
-    struct diet acked_or_lost; ///< Sent packet numbers already ACKed (or lost).
+    struct rx_hist recv_all; ///< All received packet numbers.
+
+    struct ack_cache ack_cache; ///< Encoded ACK ranges of the last ACK TX.
 
-    khash_t(pm_by_nr) sent_pkts; // sent_packets
+    struct pm_ring sent_pkts; // sent_packets
 
     uint_t lg_sent;            // largest_sent_packet
     uint_t lg_acked;           // largest_acked_packet
     uint_t lg_sent_before_rto; // largest_sent_before_rto
 
     uint_t pkts_rxed_since_last_ack_tx;
+    uint_t ae_rxed_since_last_ack_tx; ///< Ack-eliciting subset of the above.
 
-    uint_t ect0_cnt;
-    uint_t ect1_cnt;
-    uint_t ce_cnt;
+    uint_t ect0_cnt; ///< ECT(0)-marked packets received.
+    uint_t ect1_cnt; ///< ECT(1)-marked packets received.
+    uint_t ce_cnt;   ///< CE-marked packets received.
 
-#if !HAVE_64BIT
-    uint8_t _unused[4];
-#endif
+    uint_t ect0_peer; ///< Largest ECT(0) count reported by the peer.
+    uint_t ect1_peer; ///< Largest ECT(1) count reported by the peer.
+    uint_t ce_peer;   ///< Largest CE count reported by the peer.
 
     uint64_t loss_t;       // loss_time
     uint64_t last_ae_tx_t; // time_of_last_sent_ack_eliciting_packet
@@ -124,10 +212,10 @@ struct pn_space {
 
 
 extern void __attribute__((nonnull))
-pm_by_nr_del(khash_t(pm_by_nr) * const pbn, const struct pkt_meta * const p);
+pm_by_nr_del(struct pm_ring * const r, const struct pkt_meta * const p);
 
 extern void __attribute__((nonnull))
-pm_by_nr_ins(khash_t(pm_by_nr) * const pbn, struct pkt_meta * const p);
+pm_by_nr_ins(struct pm_ring * const r, struct pkt_meta * const p);
 
 extern struct w_iov * __attribute__((nonnull))
 find_sent_pkt(const struct pn_space * const pn,
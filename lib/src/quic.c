@@ -32,6 +32,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
+#include <time.h>
 
 #include <picotls.h>
 #include <quant/quant.h>
@@ -50,20 +51,25 @@
 #endif
 
 #include "conn.h"
+#include "gso.h"
 #include "loop.h"
+#include "pacer.h"
 #include "pkt.h"
 #include "pn.h"
 #include "quic.h"
 #include "recovery.h"
+#include "shard.h"
 #include "stream.h"
 #include "tls.h"
 #include "tree.h"
+#include "uring.h"
+#include "xdp.h"
 
 
-char __cid_str[CID_STR_LEN];
-char __srt_str[hex_str_len(SRT_LEN)];
-char __tok_str[hex_str_len(MAX_TOK_LEN)];
-char __rit_str[hex_str_len(RIT_LEN)];
+_Thread_local char __cid_str[CID_STR_LEN];
+_Thread_local char __srt_str[hex_str_len(SRT_LEN)];
+_Thread_local char __tok_str[hex_str_len(MAX_TOK_LEN)];
+_Thread_local char __rit_str[hex_str_len(RIT_LEN)];
 
 
 /// QUIC version supported by this implementation in order of preference.
@@ -78,15 +84,6 @@ const uint32_t ok_vers[] = {
 /// Length of the @p ok_vers array.
 const uint8_t ok_vers_len = sizeof(ok_vers) / sizeof(ok_vers[0]);
 
-#ifndef NO_SERVER
-struct q_conn_sl accept_queue = sl_head_initializer(accept_queue);
-#endif
-
-#if !defined(NDEBUG) && !defined(FUZZING) && defined(FUZZER_CORPUS_COLLECTION)
-int corpus_pkt_dir, corpus_frm_dir;
-#endif
-
-
 void alloc_off(struct w_engine * const w,
                struct w_iov_sq * const q,
                const struct q_conn * const c,
@@ -443,7 +440,7 @@ struct q_conn * q_bind(struct w_engine * const w
              c->sock->ws_laddr.af == AF_INET6 ? "[" : "",
              w_ntop(&c->sock->ws_laddr, ip_tmp),
              c->sock->ws_laddr.af == AF_INET6 ? "]" : "", port);
-        sl_insert_head(&c_embr, c, node_embr);
+        sl_insert_head(&ped(w)->c_embr, c, node_embr);
     }
     return c;
 #else
@@ -452,16 +449,17 @@ struct q_conn * q_bind(struct w_engine * const w
 }
 
 
-static void cancel_api_call(struct timeout * const api_alarm)
+static void cancel_api_call(struct w_engine * const w)
 {
 #ifdef DEBUG_EXTRA
     warn(DBG, "canceling API call");
 #endif
-    timeout_del(api_alarm);
+    timeout_del(&ped(w)->api_alarm);
 #ifndef NO_SERVER
-    maybe_api_return(q_accept, 0, 0);
+    maybe_api_return(w, q_accept, 0, 0);
 #endif
-    maybe_api_return(q_ready, 0, 0);
+    maybe_api_return(w, q_ready, 0, 0);
+    maybe_api_return(w, q_poll, 0, 0);
 }
 
 
@@ -488,7 +486,7 @@ struct q_conn * q_accept(struct w_engine * const w
 )
 {
 #ifndef NO_SERVER
-    if (sl_first(&accept_queue))
+    if (sl_first(&ped(w)->accept_queue))
         goto accept;
 
     const uint_t idle_to = get_conf(w, conf, idle_timeout);
@@ -499,14 +497,14 @@ struct q_conn * q_accept(struct w_engine * const w
 
     loop_run(w, (func_ptr)q_accept, 0, 0);
 
-    if (sl_empty(&accept_queue)) {
+    if (sl_empty(&ped(w)->accept_queue)) {
         warn(ERR, "no conn ready for accept");
         return 0;
     }
 
 accept:;
-    struct q_conn * const c = sl_first(&accept_queue);
-    sl_remove_head(&accept_queue, node_aq);
+    struct q_conn * const c = sl_first(&ped(w)->accept_queue);
+    sl_remove_head(&ped(w)->accept_queue, node_aq);
     restart_idle_alarm(c);
     c->needs_accept = false;
 
@@ -568,9 +566,16 @@ mk_or_open_dir(const char * const path, mode_t mode)
 #endif
 
 
-struct w_engine * q_init(const char * const ifname,
-                         const struct q_conf * const conf)
+struct w_engine * q_init(const char * ifname, const struct q_conf * const conf)
 {
+#ifdef WITH_AF_XDP
+    // an interface name prefix selects the AF_XDP datapath
+    const bool use_xdp = strncmp(ifname, XDP_IFNAME_PREFIX,
+                                 strlen(XDP_IFNAME_PREFIX)) == 0;
+    if (use_xdp)
+        ifname += strlen(XDP_IFNAME_PREFIX);
+#endif
+
     // initialize warpcore on the given interface
     const uint32_t num_bufs = conf && conf->num_bufs ? conf->num_bufs : 10000;
     struct w_engine * const w = w_init(ifname, 0, num_bufs);
@@ -605,6 +610,8 @@ struct w_engine * q_init(const char * const ifname,
         (struct q_conn_conf){.idle_timeout = 10,
                              .enable_udp_zero_checksums = true,
                              .tls_key_update_frequency = 3,
+                             .pacing_burst = DEF_PACING_BURST,
+                             .cc_algo = q_cc_newreno,
                              .version = ok_vers[0],
                              .enable_quantum_readiness_test = false,
                              .enable_spinbit =
@@ -623,6 +630,10 @@ struct w_engine * q_init(const char * const ifname,
             get_conf_uncond(w, conf->conn_conf, idle_timeout);
         ped(w)->default_conn_conf.tls_key_update_frequency =
             get_conf(w, conf->conn_conf, tls_key_update_frequency);
+        ped(w)->default_conn_conf.pacing_burst =
+            get_conf(w, conf->conn_conf, pacing_burst);
+        ped(w)->default_conn_conf.cc_algo =
+            get_conf(w, conf->conn_conf, cc_algo);
         ped(w)->default_conn_conf.enable_spinbit =
             get_conf_uncond(w, conf->conn_conf, enable_spinbit);
         ped(w)->default_conn_conf.enable_udp_zero_checksums =
@@ -633,23 +644,21 @@ struct w_engine * q_init(const char * const ifname,
             get_conf_uncond(w, conf->conn_conf, disable_active_migration);
         ped(w)->default_conn_conf.enable_quantum_readiness_test =
             get_conf_uncond(w, conf->conn_conf, enable_quantum_readiness_test);
+        ped(w)->default_conn_conf.disable_ecn =
+            get_conf_uncond(w, conf->conn_conf, disable_ecn);
+        ped(w)->default_conn_conf.enable_l4s =
+            get_conf_uncond(w, conf->conn_conf, enable_l4s);
+        ped(w)->default_conn_conf.disable_ack_freq =
+            get_conf_uncond(w, conf->conn_conf, disable_ack_freq);
     }
 
-    // initialize some globals
-#ifndef NO_MIGRATION
-    memset(&conns_by_id, 0, sizeof(conns_by_id));
-#endif
-#ifndef NO_SRT_MATCHING
-    memset(&conns_by_srt, 0, sizeof(conns_by_srt));
-#endif
-
     // initialize the event loop
     timeout_init(&ped(w)->api_alarm, 0);
-    loop_init();
+    loop_init(w);
     int err;
     ped(w)->wheel = timeouts_open(TIMEOUT_nHZ, &err);
-    timeouts_update(ped(w)->wheel, loop_now());
-    timeout_setcb(&ped(w)->api_alarm, cancel_api_call, &ped(w)->api_alarm);
+    timeouts_update(ped(w)->wheel, loop_now(w));
+    timeout_setcb(&ped(w)->api_alarm, cancel_api_call, w);
 
     warn(INF, "%s/%s (%s) %s/%s ready", quant_name, w->backend_name,
          w->backend_variant, quant_version, QUANT_COMMIT_HASH_ABBREV_STR);
@@ -658,14 +667,26 @@ struct w_engine * q_init(const char * const ifname,
     // initialize TLS context
     init_tls_ctx(conf, ped(w));
 
+#ifndef NO_GSO
+    gso_init(w);
+#endif
+#ifdef WITH_AF_XDP
+    if (use_xdp)
+        xdp_init(w, ifname);
+#endif
+#ifdef WITH_IO_URING
+    if (ped(w)->conf.enable_io_uring && ped(w)->xdp == 0)
+        uring_init(w);
+#endif
+
 #if !defined(NDEBUG) && defined(FUZZER_CORPUS_COLLECTION)
 #ifdef FUZZING
     warn(CRT, "%s compiled for fuzzing - will not communicate", quant_name);
 #else
     // create the directories for exporting fuzzer corpus data
     warn(NTE, "debug build, storing fuzzer corpus data");
-    corpus_pkt_dir = mk_or_open_dir("../corpus_pkt", 0755);
-    corpus_frm_dir = mk_or_open_dir("../corpus_frm", 0755);
+    ped(w)->corpus_pkt_dir = mk_or_open_dir("../corpus_pkt", 0755);
+    ped(w)->corpus_frm_dir = mk_or_open_dir("../corpus_frm", 0755);
 #endif
 #endif
 
@@ -777,6 +798,8 @@ done:
             [0x1c] = "CONNECTION_CLOSE_QUIC",
             [0x1d] = "CONNECTION_CLOSE_APP",
             [0x1e] = "HANDSHAKE_DONE",
+            [0x1f] = "IMMEDIATE_ACK",
+            [0x20] = "ACK_FREQUENCY",
         };
 
         conn_info_populate(c);
@@ -807,6 +830,8 @@ done:
         qinfo_log("ssthresh = %" PRIu,
                   c->i.ssthresh == UINT_T_MAX ? 0 : c->i.ssthresh);
         qinfo_log("pto_cnt = %" PRIu, c->i.pto_cnt);
+        qinfo_log("cc min_rtt = %.3f, bw = %.0f", (double)c->i.cc_min_rtt,
+                  (double)c->i.cc_bw);
         qinfo_log("%-22s %s %10s %10s", "frame", "code", "out", "in");
         for (size_t i = 0;
              i < sizeof(c->i.frm_cnt[0]) / sizeof(c->i.frm_cnt[0][0]); i++) {
@@ -823,11 +848,11 @@ done:
 #endif
 
     if (c->scid == 0)
-        sl_remove(&c_zcid, c, q_conn, node_zcid_int);
+        sl_remove(&ped(c->w)->c_zcid, c, q_conn, node_zcid_int);
 
 #ifndef NO_SERVER
     if (c->holds_sock && w_connected(c->sock) == false)
-        sl_remove(&c_embr, c, q_conn, node_embr);
+        sl_remove(&ped(c->w)->c_embr, c, q_conn, node_embr);
 #endif
     free_conn(c);
 }
@@ -838,20 +863,20 @@ void q_cleanup(struct w_engine * const w)
     // close all connections
     struct q_conn * c;
 #ifndef NO_MIGRATION
-    kh_foreach_value(&conns_by_id, c, { q_close(c, 0, 0); });
+    kh_foreach_value(&ped(w)->conns_by_id, c, { q_close(c, 0, 0); });
 #else
 #endif
 
 #ifndef NO_SRT_MATCHING
-    kh_foreach_value(&conns_by_srt, c, { q_close(c, 0, 0); });
+    kh_foreach_value(&ped(w)->conns_by_srt, c, { q_close(c, 0, 0); });
 #endif
 
     struct q_conn * tmp;
-    sl_foreach_safe (c, &c_zcid, node_zcid_int, tmp)
+    sl_foreach_safe (c, &ped(w)->c_zcid, node_zcid_int, tmp)
         q_close(c, 0, 0);
 
 #ifndef NO_SERVER
-    sl_foreach_safe (c, &c_embr, node_embr, tmp)
+    sl_foreach_safe (c, &ped(w)->c_embr, node_embr, tmp)
         q_close(c, 0, 0);
 #endif
 
@@ -860,10 +885,10 @@ void q_cleanup(struct w_engine * const w)
 
 #ifndef NO_OOO_0RTT
     // free 0-RTT reordering cache
-    while (!splay_empty(&ooo_0rtt_by_cid)) {
-        struct ooo_0rtt * const zo =
-            splay_min(ooo_0rtt_by_cid, &ooo_0rtt_by_cid);
-        ensure(splay_remove(ooo_0rtt_by_cid, &ooo_0rtt_by_cid, zo), "removed");
+    struct ooo_0rtt_by_cid * const zos = &ped(w)->ooo_0rtt_by_cid;
+    while (!splay_empty(zos)) {
+        struct ooo_0rtt * const zo = splay_min(ooo_0rtt_by_cid, zos);
+        ensure(splay_remove(ooo_0rtt_by_cid, zos, zo), "removed");
         free(zo);
     }
 #endif
@@ -881,25 +906,38 @@ void q_cleanup(struct w_engine * const w)
 #endif
 
 #ifndef NO_MIGRATION
-    kh_release(conns_by_id, &conns_by_id);
+    kh_release(conns_by_id, &ped(w)->conns_by_id);
 #endif
 #ifndef NO_SRT_MATCHING
-    kh_release(conns_by_srt, &conns_by_srt);
+    kh_release(conns_by_srt, &ped(w)->conns_by_srt);
 #endif
 
 #ifndef NO_SERVER
     kv_destroy(ped(w)->serv_socks);
 #endif
+    kv_destroy(ped(w)->aead_jobs);
+    kv_destroy(ped(w)->cb_sids);
+    kv_destroy(ped(w)->pfds);
+
+#if !defined(NDEBUG) && !defined(FUZZING) && defined(FUZZER_CORPUS_COLLECTION)
+    close(ped(w)->corpus_pkt_dir);
+    close(ped(w)->corpus_frm_dir);
+#endif
+
+#ifndef NO_GSO
+    gso_cleanup(w);
+#endif
+#ifdef WITH_IO_URING
+    uring_cleanup(w);
+#endif
+#ifdef WITH_AF_XDP
+    xdp_cleanup(w);
+#endif
 
     free_tls_ctx(ped(w));
     free(ped(w)->pkt_meta);
     free(w->data);
     w_cleanup(w);
-
-#if !defined(NDEBUG) && !defined(FUZZING) && defined(FUZZER_CORPUS_COLLECTION)
-    close(corpus_pkt_dir);
-    close(corpus_frm_dir);
-#endif
 }
 
 
@@ -980,7 +1018,7 @@ bool q_ready(struct w_engine * const w,
              const uint64_t nsec,
              struct q_conn ** const ready)
 {
-    if (sl_empty(&c_ready)) {
+    if (sl_empty(&ped(w)->c_ready)) {
         if (nsec)
             restart_api_alarm(w, nsec);
 #ifdef DEBUG_EXTRA
@@ -992,7 +1030,7 @@ bool q_ready(struct w_engine * const w,
     if (ready == 0)
         goto done;
 
-    struct q_conn * const c = sl_first(&c_ready);
+    struct q_conn * const c = sl_first(&ped(w)->c_ready);
     if (c) {
         bool remove = true;
         char * op = "rx";
@@ -1006,7 +1044,7 @@ bool q_ready(struct w_engine * const w,
             op = "close";
         warn(WRN, "%s conn %s ready to %s", conn_type(c), cid_str(c->scid), op);
         if (remove) {
-            sl_remove_head(&c_ready, node_rx_ext);
+            sl_remove_head(&ped(w)->c_ready, node_rx_ext);
             c->in_c_ready = false;
         }
     } else
@@ -1014,13 +1052,204 @@ bool q_ready(struct w_engine * const w,
     *ready = c;
 done:
 #ifndef NO_MIGRATION
-    return kh_size(&conns_by_id);
+    return kh_size(&ped(w)->conns_by_id);
 #else
     return sl_empty(&ped(w)->conns);
 #endif
 }
 
 
+void q_set_callbacks(struct w_engine * const w,
+                     const struct q_callbacks * const cb,
+                     void * const arg)
+{
+    ped(w)->cb = *cb;
+    ped(w)->cb_arg = arg;
+    ped(w)->have_cb = true;
+}
+
+
+void q_run(struct w_engine * const w)
+{
+    warn(WRN, "running event loop");
+    loop_run(w, (func_ptr)q_run, 0, 0);
+}
+
+
+void q_poll(struct w_engine * const w, const uint64_t nsec)
+{
+    if (nsec)
+        restart_api_alarm(w, nsec);
+    loop_run(w, (func_ptr)q_poll, 0, 0);
+    timeout_del(&ped(w)->api_alarm);
+}
+
+
+void q_stop(struct w_engine * const w)
+{
+    loop_break(w);
+}
+
+
+void add_pfd(struct w_engine * const w, const int fd)
+{
+    kv_push(struct pollfd, ped(w)->pfds,
+            ((struct pollfd){.fd = fd, .events = POLLIN}));
+}
+
+
+void del_pfd(struct w_engine * const w, const int fd)
+{
+    struct per_engine_data * const ped = ped(w);
+    for (size_t i = 0; i < kv_size(ped->pfds); i++)
+        if (kv_A(ped->pfds, i).fd == fd) {
+            kv_A(ped->pfds, i) = kv_pop(ped->pfds);
+            return;
+        }
+}
+
+
+void wait_pfds(struct w_engine * const w, const int64_t nsec)
+{
+    struct per_engine_data * const ped = ped(w);
+    const int64_t ns_per_s = NS_PER_S;
+    const struct timespec ts = {.tv_sec = nsec / ns_per_s,
+                                .tv_nsec = nsec % ns_per_s};
+    ppoll(ped->pfds.a, kv_size(ped->pfds), nsec < 0 ? 0 : &ts, 0);
+}
+
+
+size_t q_fds(struct w_engine * const w, int * const fds, const size_t num)
+{
+    // the set is kept current by sock_opened() and sock_closing(), plus the
+    // shard wake pipe and the io_uring or AF_XDP fd
+    const struct per_engine_data * const ped = ped(w);
+    for (size_t i = 0; i < MIN(num, kv_size(ped->pfds)); i++)
+        fds[i] = kv_A(ped->pfds, i).fd;
+    return kv_size(ped->pfds);
+}
+
+
+uint64_t q_next_timeout(struct w_engine * const w)
+{
+    timeouts_update(ped(w)->wheel, w_now());
+    return loop_next(w);
+}
+
+
+bool q_process_io(struct w_engine * const w)
+{
+    bool did_rx = false;
+#ifndef NO_SERVER
+    if (ped(w)->shards)
+        did_rx = shard_rx(w);
+#endif
+    did_rx |= loop_rx(w, 0);
+    // TX happens from timers, so run any that the RX made due
+    loop_timers(w);
+    return did_rx;
+}
+
+
+void q_process_timers(struct w_engine * const w)
+{
+    loop_timers(w);
+}
+
+
+static bool __attribute__((nonnull))
+dispatch_conn(struct per_engine_data * const ped, struct q_conn * const c)
+{
+    const struct q_callbacks * const cb = &ped->cb;
+    bool evt = false;
+    ped->cb_conn = c;
+    c->have_new_data = false;
+
+    // callbacks may open, close or free streams, so don't call them while
+    // walking the hash; look each stream up again before its callbacks
+    struct q_stream * s;
+    kv_size(ped->cb_sids) = 0;
+    kh_foreach_value(&c->strms_by_id, s, {
+        if (s->tx_acked || !sq_empty(&s->in))
+            kv_push(dint_t, ped->cb_sids, s->id);
+    });
+
+    for (size_t i = 0; i < kv_size(ped->cb_sids); i++) {
+        s = get_stream(c, kv_A(ped->cb_sids, i));
+        if (s == 0)
+            continue;
+
+        if (s->tx_acked) {
+            s->tx_acked = false;
+            if (cb->strm_acked) {
+                cb->strm_acked(s, ped->cb_arg);
+                evt = true;
+                if (ped->cb_conn == 0)
+                    // app closed the conn
+                    return evt;
+                if ((s = get_stream(c, kv_A(ped->cb_sids, i))) == 0)
+                    // app freed the stream
+                    continue;
+            }
+        }
+
+        if (!sq_empty(&s->in) && cb->strm_readable) {
+            cb->strm_readable(s, ped->cb_arg);
+            evt = true;
+            if (ped->cb_conn == 0)
+                return evt;
+        }
+    }
+
+    if (c->state == conn_clsd && cb->conn_closed) {
+        cb->conn_closed(c, ped->cb_arg);
+        evt = true;
+    }
+    ped->cb_conn = 0;
+    return evt;
+}
+
+
+bool dispatch_events(struct w_engine * const w)
+{
+    struct per_engine_data * const ped = ped(w);
+    bool evt = false;
+    ped->in_cb = true;
+
+#ifndef NO_SERVER
+    while (!sl_empty(&ped->accept_queue)) {
+        struct q_conn * const c = q_accept(w, 0);
+        if (ped->cb.conn_accepted) {
+            ped->cb_conn = c;
+            ped->cb.conn_accepted(c, ped->cb_arg);
+            evt = true;
+            if (ped->cb_conn == 0)
+                continue;
+        }
+        // deliver any (0-RTT) data that arrived before the accept
+        evt |= dispatch_conn(ped, c);
+    }
+#endif
+
+    while (!sl_empty(&ped->c_ready)) {
+        struct q_conn * const c = sl_first(&ped->c_ready);
+        sl_remove_head(&ped->c_ready, node_rx_ext);
+        c->in_c_ready = false;
+#ifndef NO_SERVER
+        if (!is_clnt(c) && (c->state == conn_idle || c->state == conn_opng))
+            // not accepted yet, will dispatch after accepting
+            continue;
+#endif
+        evt |= dispatch_conn(ped, c);
+    }
+
+    ped->in_cb = false;
+    if (evt)
+        maybe_api_return(w, q_poll, 0, 0);
+    return evt;
+}
+
+
 bool q_is_new_serv_conn(const struct q_conn * const c
 #ifdef NO_SERVER
                         __attribute__((unused))
@@ -1105,8 +1334,10 @@ void q_migrate(struct q_conn * const c,
     }
 
     // close the current w_sock
+    sock_closing(c->sock);
     w_close(c->sock);
     c->sock = new_sock;
+    sock_opened(c->sock);
 
     struct sockaddr_storage ss = {.ss_family = c->peer.addr.af};
     if (c->peer.addr.af == AF_INET) {
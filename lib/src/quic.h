@@ -27,6 +27,7 @@
 
 #pragma once
 
+#include <poll.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -51,14 +52,18 @@
 #endif
 
 #include "frame.h"
+#include "kvec.h"
 #include "tree.h" // IWYU pragma: keep
 
 #ifndef NO_SERVER
-#include "kvec.h"
 #include "tls.h"
 #endif
 
-struct q_conn; // IWYU pragma: no_forward_declare q_conn
+struct q_conn;          // IWYU pragma: no_forward_declare q_conn
+struct q_uring;         // IWYU pragma: no_forward_declare q_uring
+struct q_xdp;           // IWYU pragma: no_forward_declare q_xdp
+struct shard_grp;       // IWYU pragma: no_forward_declare shard_grp
+struct tickets_by_peer; // IWYU pragma: no_forward_declare tickets_by_peer
 
 
 // #define DEBUG_EXTRA ///< Set to log various extra details.
@@ -74,6 +79,7 @@ struct q_conn; // IWYU pragma: no_forward_declare q_conn
 #define MAX_TOK_LEN 166
 #define AEAD_LEN 16
 #define RIT_LEN 16 ///< Length of Retry integrity tag.
+#define HP_SAMPLE_LEN 16 ///< Length of header protection sample.
 
 // Maximum reordering in packets before packet threshold loss detection
 // considers a packet lost. The RECOMMENDED value is 3.
@@ -133,6 +139,81 @@ struct cid {
 };
 
 
+static inline int __attribute__((nonnull, no_instrument_function))
+cid_cmp(const struct cid * const a, const struct cid * const b)
+{
+    // if the lengths are different, memcmp will fail on the first byte
+    return memcmp(&a->len, &b->len, a->len + sizeof(a->len));
+}
+
+
+#ifndef NO_MIGRATION
+static inline khint_t __attribute__((nonnull, no_instrument_function))
+hash_cid(const struct cid * const id)
+{
+    return fnv1a_32(id->id, id->len);
+}
+
+
+static inline int __attribute__((nonnull, no_instrument_function))
+kh_cid_cmp(const struct cid * const a, const struct cid * const b)
+{
+    return cid_cmp(a, b) == 0;
+}
+
+
+KHASH_INIT(conns_by_id, struct cid *, struct q_conn *, 1, hash_cid, kh_cid_cmp)
+#endif
+
+
+#ifndef NO_SRT_MATCHING
+static inline khint_t __attribute__((nonnull, no_instrument_function))
+hash_srt(const uint8_t * const srt)
+{
+    return fnv1a_32(srt, SRT_LEN);
+}
+
+
+static inline int __attribute__((nonnull, no_instrument_function))
+kh_srt_cmp(const uint8_t * const a, const uint8_t * const b)
+{
+    return memcmp(a, b, SRT_LEN) == 0;
+}
+
+
+KHASH_INIT(conns_by_srt, uint8_t *, struct q_conn *, 1, hash_srt, kh_srt_cmp)
+#endif
+
+
+#ifndef NO_OOO_0RTT
+struct ooo_0rtt {
+    splay_entry(ooo_0rtt) node;
+    struct cid cid;   ///< CID of 0-RTT pkt
+    struct w_iov * v; ///< the buffer containing the 0-RTT pkt
+};
+
+
+splay_head(ooo_0rtt_by_cid, ooo_0rtt);
+
+
+static inline int __attribute__((nonnull, no_instrument_function))
+ooo_0rtt_by_cid_cmp(const struct ooo_0rtt * const a,
+                    const struct ooo_0rtt * const b)
+{
+    return cid_cmp(&a->cid, &b->cid);
+}
+
+
+SPLAY_PROTOTYPE(ooo_0rtt_by_cid, ooo_0rtt, node, ooo_0rtt_by_cid_cmp)
+#endif
+
+
+sl_head(q_conn_sl, q_conn);
+
+
+typedef void (*func_ptr)(void);
+
+
 struct pkt_hdr {
     struct cid dcid;  ///< Destination CID.
     struct cid scid;  ///< Source CID.
@@ -187,6 +268,11 @@ struct pkt_meta {
     struct pkt_hdr hdr;   ///< Parsed packet header.
     uint64_t t;           ///< TX or RX timestamp.
 
+    // delivery rate estimation state at TX, see sample_rate()
+    uint64_t first_sent_t; ///< First TX time of the current send interval.
+    uint64_t delivered_t;  ///< Time of the last delivery before this TX.
+    uint64_t delivered;    ///< Bytes delivered before this TX.
+
     uint16_t udp_len;          ///< Length of protected UDP packet at TX/RX.
     uint8_t has_rtx : 1;       ///< Does the w_iov hold truncated data?
     uint8_t is_reset : 1;      ///< This packet is a stateless reset.
@@ -194,11 +280,23 @@ struct pkt_meta {
     uint8_t in_flight : 1;     ///< Does this pkt count towards in_flight?
     uint8_t ack_eliciting : 1; ///< Is this packet ACK-eliciting?
 
-    uint8_t acked : 1; ///< Was this packet ACKed?
-    uint8_t lost : 1;  ///< Have we marked this packet as lost?
-    uint8_t txed : 1;  ///< Did we TX this pkt?
+    uint8_t acked : 1;          ///< Was this packet ACKed?
+    uint8_t lost : 1;           ///< Have we marked this packet as lost?
+    uint8_t txed : 1;           ///< Did we TX this pkt?
+    uint8_t is_app_limited : 1; ///< Was the sender app-limited at TX?
+
+    uint8_t _unused2[4];
+};
+
 
-    uint8_t _unused2[5];
+/// A packet whose AEAD protection has been deferred to enc_aead_flush().
+struct aead_job {
+    struct w_iov * xv;          ///< Buffer to hold the protected packet.
+    const struct pkt_meta * m;  ///< Metadata of the unprotected packet.
+    const uint8_t * pt;         ///< Start of the unprotected packet.
+    uint16_t len;               ///< Length of the unprotected packet.
+    uint16_t pkt_nr_pos;        ///< Offset of the packet number in @p pt.
+    uint8_t _unused[4];
 };
 
 
@@ -215,6 +313,8 @@ struct per_engine_data {
 
     ptls_context_t tls_ctx;
     ptls_aead_context_t * rid_ctx;
+    kvec_t(struct aead_job) aead_jobs; ///< Pkts awaiting AEAD protection.
+    struct tickets_by_peer * tickets; ///< TLS session ticket cache.
 
 #ifdef WITH_OPENSSL
     ptls_openssl_sign_certificate_t sign_cert;
@@ -227,11 +327,61 @@ struct per_engine_data {
     kvec_t(struct w_sock *) serv_socks;
 #endif
 
-#ifdef NO_MIGRATION
+#ifndef NO_MIGRATION
+    khash_t(conns_by_id) conns_by_id;
+#else
     sl_head(conn_head, q_conn) conns;
 #endif
 
-    uint8_t _unused2[4];
+#ifndef NO_SRT_MATCHING
+    khash_t(conns_by_srt) conns_by_srt;
+#endif
+
+    struct q_conn_sl c_ready; ///< Connections with new data for the app.
+    struct q_conn_sl c_zcid;  ///< Connections with zero-length SCIDs.
+
+#ifndef NO_OOO_0RTT
+    /// 0-RTT packets that arrived before the corresponding Initial.
+    struct ooo_0rtt_by_cid ooo_0rtt_by_cid;
+#endif
+
+#if !defined(NDEBUG) && !defined(FUZZING) && defined(FUZZER_CORPUS_COLLECTION)
+    int corpus_pkt_dir; ///< Directory fd for packet fuzzer corpus data.
+    int corpus_frm_dir; ///< Directory fd for frame fuzzer corpus data.
+#endif
+
+#ifndef NO_SERVER
+    struct q_conn_sl c_embr;       ///< Embryonic server connections.
+    struct q_conn_sl accept_queue; ///< Server connections ready for accept.
+    struct shard_grp * shards;     ///< Shard group, if this engine is sharded.
+    uint16_t shard_idx;            ///< Index of this engine in @p shards.
+    uint8_t _unused[6];
+#endif
+
+    // event loop state
+    func_ptr api_func; ///< API function currently waiting in loop_run().
+    void * api_conn;   ///< Connection argument of @p api_func.
+    void * api_strm;   ///< Stream argument of @p api_func.
+    uint64_t now;      ///< Time of the last event loop iteration.
+
+    // event callback state
+    struct q_callbacks cb; ///< Application callbacks, see q_set_callbacks().
+    void * cb_arg;         ///< Argument passed to all callbacks in @p cb.
+    struct q_conn * cb_conn; ///< Connection callbacks are running for.
+    kvec_t(dint_t) cb_sids;  ///< Streams with events, see dispatch_conn().
+    kvec_t(struct pollfd) pfds; ///< Fds to wait on, see q_fds().
+
+    bool break_loop; ///< Exit loop_run() after the current iteration.
+    bool have_cb;    ///< Application has registered callbacks.
+    bool in_cb;      ///< An application callback is executing.
+    bool udp_gso;    ///< Send packet trains with UDP_SEGMENT, see gso.c.
+    bool udp_gro;    ///< Receive via UDP_GRO, see gso.c.
+    bool txtime;     ///< Stamp departure times via SO_TXTIME, see gso.c.
+
+    uint8_t _unused2[6];
+    uint8_t * gro_buf;     ///< Receive buffers for GRO super-datagrams.
+    struct q_uring * uring; ///< io_uring state, see uring.c.
+    struct q_xdp * xdp;     ///< AF_XDP state, see xdp.c.
     uint32_t scratch_len;
     uint8_t scratch[]; // packet-sized scratch space to avoid stack alloc
 };
@@ -240,13 +390,20 @@ struct per_engine_data {
 #define ped(w) ((struct per_engine_data *)((w)->data))
 
 
-extern struct q_conn_sl accept_queue;
-
 /// The versions of QUIC supported by this implementation
 extern const uint32_t ok_vers[];
 extern const uint8_t ok_vers_len;
 
 
+extern void __attribute__((nonnull))
+add_pfd(struct w_engine * const w, const int fd);
+
+extern void __attribute__((nonnull))
+del_pfd(struct w_engine * const w, const int fd);
+
+extern void __attribute__((nonnull))
+wait_pfds(struct w_engine * const w, const int64_t nsec);
+
 extern void __attribute__((nonnull(1, 2)))
 alloc_off(struct w_engine * const w,
           struct w_iov_sq * const q,
@@ -273,9 +430,10 @@ dup_iov(const struct w_iov * const v,
         const uint16_t off);
 
 
-#if !defined(NDEBUG) && !defined(FUZZING) && defined(FUZZER_CORPUS_COLLECTION)
-extern int corpus_pkt_dir, corpus_frm_dir;
+extern bool __attribute__((nonnull)) dispatch_events(struct w_engine * const w);
 
+
+#if !defined(NDEBUG) && !defined(FUZZING) && defined(FUZZER_CORPUS_COLLECTION)
 extern void __attribute__((nonnull))
 write_to_corpus(const int dir, const void * const data, const size_t len);
 #endif
@@ -326,10 +484,11 @@ cid2str(const struct cid * const cid, char * const dst, const size_t len_dst);
 
 #define CID_STR_LEN hex_str_len(2 * sizeof(uint_t) + CID_LEN_MAX + 1)
 
-extern char __cid_str[CID_STR_LEN];
-extern char __srt_str[hex_str_len(SRT_LEN)];
-extern char __tok_str[hex_str_len(MAX_TOK_LEN)];
-extern char __rit_str[hex_str_len(RIT_LEN)];
+// per-thread, so that engines running on different threads do not share them
+extern _Thread_local char __cid_str[CID_STR_LEN];
+extern _Thread_local char __srt_str[hex_str_len(SRT_LEN)];
+extern _Thread_local char __tok_str[hex_str_len(MAX_TOK_LEN)];
+extern _Thread_local char __rit_str[hex_str_len(RIT_LEN)];
 
 #define cid_str(cid) cid2str((cid), __cid_str, sizeof(__cid_str))
 
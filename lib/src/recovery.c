@@ -36,12 +36,16 @@
 
 #include <quant/quant.h>
 
+#include "ackfreq.h"
 #include "bitset.h"
+#include "cc.h"
 #include "conn.h"
 #include "diet.h"
+#include "ecn.h"
 #include "frame.h"
 #include "loop.h"
 #include "marshall.h"
+#include "pacer.h"
 #include "pkt.h"
 #include "pn.h"
 #include "qlog.h"
@@ -51,14 +55,6 @@
 #include "tls.h"
 
 
-static inline bool __attribute__((nonnull))
-in_cong_recovery(const struct q_conn * const c, const uint64_t sent_t)
-{
-    // see InRecovery() pseudo code
-    return sent_t <= c->rec.rec_start_t;
-}
-
-
 static bool __attribute__((nonnull))
 have_keys(struct q_conn * const c, const pn_t t)
 {
@@ -167,7 +163,7 @@ void set_ld_timer(struct q_conn * const c)
 
     // see SetLossDetectionTimer() pseudo code
 
-    const uint64_t now = loop_now();
+    const uint64_t now = loop_now(c->w);
     const struct pn_space * const pn = earliest_pn(c, true);
     if (pn->loss_t) {
         c->rec.ld_alarm_val = pn->loss_t;
@@ -219,10 +215,8 @@ void congestion_event(struct q_conn * const c, const uint64_t sent_t)
     if (in_cong_recovery(c, sent_t))
         return;
 
-    c->rec.rec_start_t = loop_now();
-    c->rec.cur.cwnd /= kLossReductionDivisor;
-    c->rec.cur.ssthresh = c->rec.cur.cwnd =
-        MAX(c->rec.cur.cwnd, kMinimumWindow(c->rec.max_pkt_size));
+    c->rec.rec_start_t = loop_now(c->w);
+    c->rec.cc->on_loss(c, sent_t);
 }
 
 
@@ -263,8 +257,13 @@ void on_pkt_lost(struct pkt_meta * const m, const bool is_lost)
     struct pn_space * const pn = m->pn;
     struct q_conn * const c = pn->c;
 
-    if (m->in_flight)
+    if (m->in_flight) {
         remove_from_in_flight(m);
+        if (is_lost) {
+            c->rec.lost += m->udp_len;
+            ecn_on_lost(c, w_iov(c->w, pm_idx(c->w, m))->flags);
+        }
+    }
 
     // rest of function is not from pseudo code
 
@@ -278,7 +277,6 @@ void on_pkt_lost(struct pkt_meta * const m, const bool is_lost)
         c->pmtud_pkt = UINT16_MAX;
     }
 
-    diet_insert(&pn->acked_or_lost, m->hdr.nr, 0);
     pm_by_nr_del(&pn->sent_pkts, m);
 
     if (is_lost == false)
@@ -319,6 +317,10 @@ void on_pkt_lost(struct pkt_meta * const m, const bool is_lost)
                 }
             }
 
+    // a lost ACK_FREQUENCY is not RTX'ed, its current values are sent anew
+    if (unlikely(has_frm(m->frms, FRM_AFQ)))
+        c->tx_ack_freq = true;
+
     static const struct frames strm_ctrl =
         // FRM_SDB is automatically RTX'ed XXX fix this mess
         bitset_t_initializer(1 << FRM_RST | 1 << FRM_STP /*| 1 << FRM_SDB*/);
@@ -333,6 +335,7 @@ void on_pkt_lost(struct pkt_meta * const m, const bool is_lost)
                "strm " FMT_SID " cnt %" PRIu " < lost %" PRIu, m->strm->id,
                w_iov_sq_cnt(&m->strm->out), m->strm->lost_cnt);
 #endif
+        need_tx_update(m->strm);
     }
 }
 
@@ -369,7 +372,7 @@ detect_lost_pkts(struct pn_space * const pn, const bool do_cc)
             NS_PER_US * 9 * MAX(c->rec.cur.latest_rtt, c->rec.cur.srtt) / 8);
 
     // Packets sent before this time are deemed lost.
-    const uint64_t lost_send_t = loop_now() - loss_del;
+    const uint64_t lost_send_t = loop_now(c->w) - loss_del;
 
 #ifndef NDEBUG
     struct diet lost = diet_initializer(lost);
@@ -378,7 +381,8 @@ detect_lost_pkts(struct pn_space * const pn, const bool do_cc)
     uint64_t lg_lost_tx_t = 0;
     bool in_flight_lost = false;
     struct pkt_meta * m;
-    kh_foreach_value(&pn->sent_pkts, m, {
+    // pkts above lg_acked cannot be lost yet
+    pm_ring_foreach (m, &pn->sent_pkts, pn->lg_acked) {
         DEBUG_ensure(m->acked == false,
                      "%s ACKed %s pkt %" PRIu " in sent_pkts", conn_type(c),
                      pkt_type_str(m->hdr.flags, &m->hdr.vers), m->hdr.nr);
@@ -386,9 +390,6 @@ detect_lost_pkts(struct pn_space * const pn, const bool do_cc)
                      conn_type(c), pkt_type_str(m->hdr.flags, &m->hdr.vers),
                      m->hdr.nr);
 
-        if (unlikely(m->hdr.nr > pn->lg_acked))
-            continue;
-
         // Mark packet as lost, or set time when it should be marked.
         if (m->t <= lost_send_t ||
             pn->lg_acked >= m->hdr.nr + kPacketThreshold) {
@@ -413,7 +414,7 @@ detect_lost_pkts(struct pn_space * const pn, const bool do_cc)
             if (m->strm == 0 || m->has_rtx)
                 free_iov(w_iov(c->w, pm_idx(c->w, m)), m);
         }
-    });
+    }
 
 #ifndef NDEBUG
     int pos = 0;
@@ -431,11 +432,11 @@ detect_lost_pkts(struct pn_space * const pn, const bool do_cc)
         if (i->lo == i->hi)
             pos += snprintf((char *)&tmp[pos], tmp_len - (size_t)pos,
                             FMT_PNR_OUT "%s", i->lo,
-                            splay_next(diet, &lost, i) ? ", " : "");
+                            diet_next(diet, &lost, i) ? ", " : "");
         else
             pos += snprintf((char *)&tmp[pos], tmp_len - (size_t)pos,
                             FMT_PNR_OUT ".." FMT_PNR_OUT "%s", i->lo, i->hi,
-                            splay_next(diet, &lost, i) ? ", " : "");
+                            diet_next(diet, &lost, i) ? ", " : "");
     }
     diet_free(&lost);
 
@@ -448,7 +449,7 @@ detect_lost_pkts(struct pn_space * const pn, const bool do_cc)
     if (do_cc && in_flight_lost) {
         congestion_event(c, lg_lost_tx_t);
         if (in_persistent_cong(pn, lg_lost))
-            c->rec.cur.cwnd = kMinimumWindow(c->rec.max_pkt_size);
+            c->rec.cc->on_persistent_congestion(c);
     }
 
     log_cc(c);
@@ -539,7 +540,7 @@ void on_pkt_sent(struct pkt_meta * const m)
 {
     // see OnPacketSent() pseudo code
 
-    const uint64_t now = loop_now();
+    const uint64_t now = loop_now(m->pn->c->w);
     pm_by_nr_ins(&m->pn->sent_pkts, m);
     // nr is set in enc_pkt()
     m->t = now;
@@ -554,8 +555,20 @@ void on_pkt_sent(struct pkt_meta * const m)
             c->rec.ae_in_flight++;
         }
 
+        // remember the delivery state for sample_rate()
+        if (c->rec.cur.in_flight == 0) {
+            c->rec.first_sent_t = c->rec.delivered_t = now;
+            if (c->rec.cc->tx_start)
+                c->rec.cc->tx_start(c);
+        }
+        m->first_sent_t = c->rec.first_sent_t;
+        m->delivered_t = c->rec.delivered_t;
+        m->delivered = c->rec.delivered;
+        m->is_app_limited = c->rec.app_limited != 0;
+
         // OnPacketSentCC
         c->rec.cur.in_flight += m->udp_len;
+        pacer_sent(c, m->udp_len);
     }
 
     // we call set_ld_timer(c) once for a TX'ed burst in do_tx() instead of here
@@ -608,7 +621,7 @@ void on_ack_received_1(struct pkt_meta * const lg_ack, const uint_t ack_del)
                        : MAX(pn->lg_acked, lg_ack->hdr.nr);
 
     if (is_ack_eliciting(&pn->tx_frames)) {
-        c->rec.cur.latest_rtt = (uint_t)NS_TO_US(loop_now() - lg_ack->t);
+        c->rec.cur.latest_rtt = (uint_t)NS_TO_US(loop_now(c->w) - lg_ack->t);
         update_rtt(c, likely(pn->type == pn_data) ? ack_del : 0);
     }
 
@@ -616,13 +629,59 @@ void on_ack_received_1(struct pkt_meta * const lg_ack, const uint_t ack_del)
 }
 
 
+static void __attribute__((nonnull))
+sample_rate(struct q_conn * const c, const struct acked * const a)
+{
+    // see draft-cheng-iccrg-delivery-rate-estimation
+    const uint64_t now = loop_now(c->w);
+    c->rec.delivered_t = now;
+    if (c->rec.app_limited && c->rec.delivered > c->rec.app_limited)
+        c->rec.app_limited = 0;
+    c->rec.first_sent_t = a->sent_t;
+
+    // use the longer of the send and ACK intervals, to not overestimate
+    struct rate_sample * const rs = &c->rec.rs;
+    rs->delivered = c->rec.delivered - a->delivered;
+    rs->interval =
+        NS_TO_US(MAX(a->sent_t - a->first_sent_t, now - a->delivered_t));
+    rs->is_app_limited = a->is_app_limited;
+
+    // intervals shorter than min_rtt likely saw ACK compression
+    rs->bw = rs->interval && rs->interval >= c->rec.cur.min_rtt
+                 ? rs->delivered * US_PER_S / rs->interval
+                 : 0;
+}
+
+
 void on_ack_received_2(struct pn_space * const pn)
 {
     // see OnAckReceived() pseudo code
 
     struct q_conn * const c = pn->c;
+
+    // OnPacketsAcked, for all pkts of the ACK frame at once
+    if (c->rec.acked.bytes) {
+        sample_rate(c, &c->rec.acked);
+        c->rec.cc->on_ack(c, &c->rec.acked);
+        c->rec.acked = (struct acked){0};
+#ifndef NO_QINFO
+        c->i.max_cwnd = MAX(c->i.max_cwnd, c->rec.cur.cwnd);
+#endif
+    }
+
     detect_lost_pkts(pn, true);
     c->rec.pto_cnt = 0;
+
+    if (pn->type == pn_data)
+        ack_freq_update(c);
+}
+
+
+void on_app_limited(struct q_conn * const c)
+{
+    // rate samples taken until the current flight is ACKed are app-limited
+    c->rec.app_limited = MAX(c->rec.delivered + c->rec.cur.in_flight, 1);
+    c->rec.cc->app_limited(c);
 }
 
 
@@ -632,21 +691,22 @@ on_pkt_acked_cc(const struct pkt_meta * const m)
     // OnPacketAckedCC
     remove_from_in_flight(m);
 
+    // the CC sees the whole ACK frame in on_ack_received_2()
     struct q_conn * const c = m->pn->c;
-    if (in_cong_recovery(c, m->t))
-        return;
-
-    // TODO: IsAppLimited check
-
-    if (c->rec.cur.cwnd < c->rec.cur.ssthresh)
-        c->rec.cur.cwnd += m->udp_len;
-    else
-        c->rec.cur.cwnd +=
-            (c->rec.max_pkt_size * (uint_t)m->udp_len) / c->rec.cur.cwnd;
-
-#ifndef NO_QINFO
-    c->i.max_cwnd = MAX(c->i.max_cwnd, c->rec.cur.cwnd);
-#endif
+    struct acked * const a = &c->rec.acked;
+    c->rec.delivered += m->udp_len;
+    a->bytes += m->udp_len;
+    if (in_cong_recovery(c, m->t) == false)
+        a->cc_bytes += m->udp_len;
+
+    // take the rate sample from the most recently sent pkt
+    if (m->t >= a->sent_t) {
+        a->sent_t = m->t;
+        a->first_sent_t = m->first_sent_t;
+        a->delivered_t = m->delivered_t;
+        a->delivered = m->delivered;
+        a->is_app_limited = m->is_app_limited;
+    }
 }
 
 
@@ -657,7 +717,6 @@ void on_pkt_acked(struct w_iov * const v, struct pkt_meta * m)
     struct q_conn * const c = pn->c;
     if (m->in_flight && m->lost == false)
         on_pkt_acked_cc(m);
-    diet_insert(&pn->acked_or_lost, m->hdr.nr, 0);
     pm_by_nr_del(&pn->sent_pkts, m);
 
     // rest of function is not from pseudo code
@@ -725,6 +784,7 @@ void on_pkt_acked(struct w_iov * const v, struct pkt_meta * m)
                 free_iov(s->out_una, mou);
             }
         }
+        need_tx_update(s);
 
         if (s->id >= 0 && s->out_una == 0) {
             if (unlikely(m->is_fin || c->did_0rtt)) {
@@ -733,7 +793,12 @@ void on_pkt_acked(struct w_iov * const v, struct pkt_meta * m)
                 strm_to_state(s, s->state == strm_hcrm ? strm_clsd : strm_hclo);
             }
             if (c->did_0rtt)
-                maybe_api_return(q_connect, c, 0);
+                maybe_api_return(c->w, q_connect, c, 0);
+            if (ped(c->w)->have_cb) {
+                // let dispatch_events() tell the app
+                s->tx_acked = true;
+                c->have_new_data = true;
+            }
         }
 
     } else
@@ -746,11 +811,30 @@ void init_rec(struct q_conn * const c)
     timeout_del(&c->rec.ld_alarm);
     c->rec.pto_cnt = 0;
     c->rec.max_pkt_size = MIN_INI_LEN;
-    c->rec.cur = (struct cc_state){.cwnd = kInitialWindow(c->rec.max_pkt_size),
-                                   .ssthresh = UINT_T_MAX,
-                                   .min_rtt = UINT_T_MAX};
+    c->rec.cur = (struct cc_state){.min_rtt = UINT_T_MAX};
+    c->rec.delivered = c->rec.app_limited = c->rec.lost = 0;
+    c->rec.delivered_t = c->rec.first_sent_t = loop_now(c->w);
+    c->rec.rs = (struct rate_sample){0};
+    c->rec.acked = (struct acked){0};
+    // keep the ECN settings the conn was configured with
+    init_ecn(c, c->rec.ecn.enabled, c->rec.ecn.l4s);
+    c->rec.cc->init(c);
 #if !defined(NDEBUG) || !defined(NO_QLOG)
     c->rec.prev = c->rec.cur;
 #endif
     timeout_setcb(&c->rec.ld_alarm, on_ld_timeout, c);
 }
+
+
+const struct cc_ops * cc_lookup(const uint8_t algo)
+{
+    switch (algo) {
+    case q_cc_cubic:
+        return &cc_cubic;
+    case q_cc_bbr:
+        return &cc_bbr;
+    case q_cc_newreno:
+    default:
+        return &cc_newreno;
+    }
+}
@@ -33,6 +33,9 @@
 #include <quant/quant.h>
 #include <timeout.h>
 
+#include "cc.h"
+#include "ecn.h"
+
 struct pkt_meta; // IWYU pragma: no_forward_declare pkt_meta
 struct pn_space; // IWYU pragma: no_forward_declare pn_space
 struct q_conn;   // IWYU pragma: no_forward_declare q_conn
@@ -55,10 +58,24 @@ struct cc_state {
 };
 
 
+/// A delivery rate sample, see draft-cheng-iccrg-delivery-rate-estimation.
+struct rate_sample {
+    uint64_t delivered; // bytes delivered over the interval
+    uint64_t interval;  // in usec
+    uint64_t bw;        // bytes/sec, zero if the sample is invalid
+    bool is_app_limited;
+    uint8_t _unused[7];
+};
+
+
 struct recovery {
     struct timeout ld_alarm; // loss_detection_timer
     timeout_t ld_alarm_val;
 
+    const struct cc_ops * cc; // congestion controller, see cc.h
+    union cc_priv cc_priv;    // its private state
+    struct hystart hystart;   // slow start state for loss-based CCs
+
     uint64_t rec_start_t; // recovery_start_time
     uint_t ae_in_flight;  // nr of ACK-eliciting pkts inflight
 
@@ -73,6 +90,17 @@ struct recovery {
     struct cc_state prev;
 #endif
 
+    // delivery rate estimation
+    uint64_t delivered;    // bytes delivered so far
+    uint64_t delivered_t;  // time delivered was last updated
+    uint64_t first_sent_t; // TX time of the pkt that last updated delivered
+    uint64_t app_limited;  // delivered at the end of app-limited phase, or 0
+    uint64_t lost;         // bytes lost so far
+    struct rate_sample rs; // sample from the most recently ACKed pkt
+    struct acked acked;    // pkts ACKed by the current ACK frame
+
+    struct ecn ecn; // ECN validation and L4S state
+
     uint16_t pto_cnt;      // pto_count
     uint16_t max_pkt_size; // max_datagram_size
 
@@ -82,6 +110,10 @@ struct recovery {
 };
 
 
+// see InRecovery() pseudo code
+#define in_cong_recovery(c, sent_t) ((sent_t) <= (c)->rec.rec_start_t)
+
+
 #if !defined(NDEBUG) || !defined(NO_QLOG)
 extern void __attribute__((nonnull)) log_cc(struct q_conn * const c);
 #else
@@ -109,5 +141,7 @@ extern void __attribute__((nonnull)) set_ld_timer(struct q_conn * const c);
 extern void __attribute__((nonnull))
 on_pkt_lost(struct pkt_meta * const m, const bool is_lost);
 
+extern void __attribute__((nonnull)) on_app_limited(struct q_conn * const c);
+
 extern void __attribute__((nonnull))
 detect_all_lost_pkts(struct q_conn * const c, const bool do_cc);
@@ -0,0 +1,67 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <stdint.h>
+
+#include <quant/quant.h>
+
+#include "bitset.h"
+#include "rxhist.h"
+
+
+void rx_hist_insert(struct rx_hist * const h, const uint_t nr)
+{
+    if (unlikely(nr >= h->base + RX_HIST_WIN)) {
+        // slide the window up, forgetting what drops out at the bottom
+        const uint_t base = nr - RX_HIST_WIN + 1;
+        if (base - h->base >= RX_HIST_WIN)
+            bit_zero(RX_HIST_WIN, &h->win);
+        else
+            for (uint_t n = h->base; n < base; n++)
+                bit_clr(RX_HIST_WIN, n & (RX_HIST_WIN - 1), &h->win);
+        h->base = base;
+        if (h->run_lo < base)
+            h->run_lo = base;
+    }
+    bit_set(RX_HIST_WIN, nr & (RX_HIST_WIN - 1), &h->win);
+
+    if (nr >= h->end) {
+        // a new largest packet number, which may start a new run
+        if (nr != h->end || h->end == 0)
+            h->run_lo = nr;
+        h->end = nr + 1;
+
+    } else if (nr + 1 == h->run_lo) {
+        // a late packet joined the latest run to whatever is below it
+        h->run_lo = nr;
+        while (h->run_lo > h->base &&
+               bit_isset(RX_HIST_WIN, (h->run_lo - 1) & (RX_HIST_WIN - 1),
+                         &h->win))
+            h->run_lo--;
+    }
+}
@@ -0,0 +1,90 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <quant/quant.h>
+
+#include "bitset.h"
+
+
+/// Number of packet numbers tracked individually below the largest one
+/// received; must be a power of two. Anything older is treated as received.
+#define RX_HIST_WIN 1024
+
+bitset_define(rx_hist_win, RX_HIST_WIN);
+
+
+/// Received packet numbers, for duplicate detection. The window is a bitmap
+/// ring over [base, base + RX_HIST_WIN); see RFC9000 section 12.3 for why
+/// everything below base can be treated as a duplicate.
+struct rx_hist {
+    struct rx_hist_win win; ///< Bit (nr % RX_HIST_WIN) is set if nr was RX'ed.
+    uint_t base;            ///< Packet numbers below this count as RX'ed.
+    uint_t end;             ///< Largest RX'ed packet number + 1 (0 = none).
+    uint_t run_lo; ///< Start of the run of RX'ed packets that ends at end - 1.
+};
+
+
+extern void __attribute__((nonnull))
+rx_hist_insert(struct rx_hist * const h, const uint_t nr);
+
+
+static inline void __attribute__((nonnull))
+rx_hist_init(struct rx_hist * const h)
+{
+    *h = (struct rx_hist){.base = 0};
+}
+
+
+static inline bool __attribute__((nonnull))
+rx_hist_find(const struct rx_hist * const h, const uint_t nr)
+{
+    if (nr < h->base)
+        return true;
+    if (nr >= h->end)
+        return false;
+    return bit_isset(RX_HIST_WIN, nr & (RX_HIST_WIN - 1), &h->win);
+}
+
+
+static inline uint_t __attribute__((nonnull))
+rx_hist_max(const struct rx_hist * const h)
+{
+    return h->end ? h->end - 1 : 0;
+}
+
+
+static inline bool __attribute__((nonnull))
+rx_hist_empty(const struct rx_hist * const h)
+{
+    return h->end == 0;
+}
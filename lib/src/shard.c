@@ -0,0 +1,291 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef NO_SERVER
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include <quant/quant.h>
+
+#include "conn.h"
+#include "quic.h"
+#include "shard.h"
+
+
+struct shard_arg {
+    struct w_engine * w;
+    q_shard_func func;
+    void * arg;
+};
+
+
+struct w_engine * q_init_shards(const char * const ifname,
+                                const struct q_conf * const conf,
+                                const uint16_t num)
+{
+    // the shard index is encoded in the first byte of our CIDs
+    ensure(num >= 1 && num <= 256, "can only create between 1 and 256 shards");
+
+    struct shard_grp * const grp = calloc(1, sizeof(*grp));
+    ensure(grp, "could not calloc");
+    grp->num = num;
+    grp->w = calloc(num, sizeof(*grp->w));
+    grp->mbox = calloc(num, sizeof(*grp->mbox));
+    grp->thr = calloc(num, sizeof(*grp->thr));
+    ensure(grp->w && grp->mbox && grp->thr, "could not calloc");
+
+    for (uint16_t i = 0; i < num; i++) {
+        ensure(pthread_mutex_init(&grp->mbox[i].lock, 0) == 0,
+               "pthread_mutex_init");
+        sq_init(&grp->mbox[i].q);
+        ensure(pipe(grp->mbox[i].wake) == 0, "pipe");
+        for (int j = 0; j <= 1; j++)
+            ensure(fcntl(grp->mbox[i].wake[j], F_SETFL, O_NONBLOCK) == 0,
+                   "fcntl");
+
+        // each shard gets its own buffer pool, timer wheel and conn tables
+        grp->w[i] = q_init(ifname, conf);
+        ped(grp->w[i])->shards = grp;
+        ped(grp->w[i])->shard_idx = i;
+        add_pfd(grp->w[i], grp->mbox[i].wake[0]);
+    }
+
+    warn(NTE, "initialized %u shard%s on %s", num, plural(num), ifname);
+    return grp->w[0];
+}
+
+
+struct w_engine * q_shard(const struct w_engine * const w, const uint16_t idx)
+{
+    const struct shard_grp * const grp = ped(w)->shards;
+    if (grp == 0)
+        return idx == 0 ? (struct w_engine *)w : 0;
+    return idx < grp->num ? grp->w[idx] : 0;
+}
+
+
+uint16_t q_num_shards(const struct w_engine * const w)
+{
+    return ped(w)->shards ? ped(w)->shards->num : 1;
+}
+
+
+static void * __attribute__((nonnull)) shard_main(void * const arg)
+{
+    const struct shard_arg * const sa = arg;
+    sa->func(sa->w, sa->arg);
+    return 0;
+}
+
+
+static void pin_shard(const pthread_t thr, const uint16_t idx)
+{
+#ifdef __linux__
+    const long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_cpus <= 0)
+        return;
+
+    cpu_set_t cs;
+    CPU_ZERO(&cs);
+    CPU_SET((size_t)(idx % num_cpus), &cs);
+    if (pthread_setaffinity_np(thr, sizeof(cs), &cs) != 0)
+        warn(WRN, "could not pin shard %u to cpu %ld", idx, idx % num_cpus);
+#else
+    (void)thr;
+    (void)idx;
+#endif
+}
+
+
+void q_run_shards(struct w_engine * const w,
+                  const q_shard_func func,
+                  void * const arg)
+{
+    struct shard_grp * const grp = ped(w)->shards;
+    if (grp == 0) {
+        // not sharded, simply run on the calling thread
+        func(w, arg);
+        return;
+    }
+
+    struct shard_arg * const sa = calloc(grp->num, sizeof(*sa));
+    ensure(sa, "could not calloc");
+
+    for (uint16_t i = 0; i < grp->num; i++) {
+        sa[i] = (struct shard_arg){.w = grp->w[i], .func = func, .arg = arg};
+        ensure(pthread_create(&grp->thr[i], 0, shard_main, &sa[i]) == 0,
+               "pthread_create");
+        pin_shard(grp->thr[i], i);
+    }
+
+    for (uint16_t i = 0; i < grp->num; i++)
+        pthread_join(grp->thr[i], 0);
+
+    free(sa);
+}
+
+
+void q_cleanup_shards(struct w_engine * const w)
+{
+    struct shard_grp * const grp = ped(w)->shards;
+    if (grp == 0) {
+        q_cleanup(w);
+        return;
+    }
+
+    for (uint16_t i = 0; i < grp->num; i++) {
+        struct shard_mbox * const mb = &grp->mbox[i];
+        while (!sq_empty(&mb->q)) {
+            struct shard_dgram * const d = sq_first(&mb->q);
+            sq_remove_head(&mb->q, next);
+            free(d);
+        }
+        pthread_mutex_destroy(&mb->lock);
+        close(mb->wake[0]);
+        close(mb->wake[1]);
+        q_cleanup(grp->w[i]);
+    }
+
+    free(grp->thr);
+    free(grp->mbox);
+    free(grp->w);
+    free(grp);
+}
+
+
+bool shard_handoff(const struct w_sock * const ws,
+                   const struct w_iov * const xv,
+                   const struct cid * const dcid)
+{
+    const struct per_engine_data * const ped = ped(ws->w);
+    if (dcid->len == 0)
+        return false;
+
+    const uint16_t owner = shard_of_cid(ped->shards, dcid);
+    if (owner == ped->shard_idx)
+        return false;
+
+    struct shard_dgram * const d = malloc(sizeof(*d) + xv->len);
+    ensure(d, "could not malloc");
+    d->saddr = xv->saddr;
+    d->laddr = ws->ws_loc;
+    d->len = xv->len;
+    d->flags = xv->flags;
+    d->ttl = xv->ttl;
+    memcpy(d->buf, xv->buf, xv->len);
+
+    struct shard_mbox * const mb = &ped->shards->mbox[owner];
+    pthread_mutex_lock(&mb->lock);
+    const bool was_empty = sq_empty(&mb->q);
+    sq_insert_tail(&mb->q, d, next);
+    pthread_mutex_unlock(&mb->lock);
+
+    // the owner drains the pipe before it empties the queue, so one wakeup
+    // per batch is enough
+    if (was_empty && write(mb->wake[1], "", 1) < 0 && errno != EAGAIN)
+        warn(ERR, "cannot wake shard %u: %s", owner, strerror(errno));
+
+#ifdef DEBUG_EXTRA
+    warn(DBG, "handing %u-byte datagram for cid %s from shard %u to %u",
+         xv->len, cid_str(dcid), ped->shard_idx, owner);
+#endif
+    return true;
+}
+
+
+bool shard_rx(struct w_engine * const w)
+{
+    struct per_engine_data * const ped = ped(w);
+    struct shard_mbox * const mb = &ped->shards->mbox[ped->shard_idx];
+
+    // consume wakeups first, so that later handoffs wake us up again
+    uint8_t buf[64];
+    while (read(mb->wake[0], buf, sizeof(buf)) > 0)
+        ;
+
+    // grab everything other shards have handed to us so far
+    struct shard_dgram_sq q;
+    sq_init(&q);
+    pthread_mutex_lock(&mb->lock);
+    sq_concat(&q, &mb->q);
+    pthread_mutex_unlock(&mb->lock);
+
+    if (sq_empty(&q))
+        return false;
+
+    struct w_iov_sq x = w_iov_sq_initializer(x);
+    struct w_sock * ws = 0;
+    while (!sq_empty(&q)) {
+        struct shard_dgram * const d = sq_first(&q);
+        sq_remove_head(&q, next);
+
+        struct w_sock * const dws = get_local_sock_by_ipnp(ped, &d->laddr);
+        if (unlikely(dws == 0)) {
+            warn(WRN, "no local sock for %u-byte datagram from other shard",
+                 d->len);
+            goto next;
+        }
+
+        if (ws && ws != dws)
+            // process what we have so far for the previous socket
+            do_rx(ws, &x);
+        ws = dws;
+
+        struct w_iov * const xv = w_alloc_iov(w, ws->ws_af, 0, 0);
+        if (unlikely(xv == 0)) {
+            warn(WRN, "no buffer for %u-byte datagram from other shard",
+                 d->len);
+            goto next;
+        }
+        memcpy(xv->buf, d->buf, d->len);
+        xv->len = d->len;
+        xv->saddr = d->saddr;
+        xv->flags = d->flags;
+        xv->ttl = d->ttl;
+        sq_insert_tail(&x, xv, next);
+
+    next:
+        free(d);
+    }
+
+    if (ws)
+        do_rx(ws, &x);
+    return true;
+}
+
+#endif
@@ -0,0 +1,124 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#pragma once
+
+#include <stdint.h>
+
+#include <quant/quant.h>
+
+#include "quic.h"
+
+// IWYU pragma: no_include "conn.h"
+
+#ifndef NO_SERVER
+#include <pthread.h>
+#include <stdbool.h>
+
+
+struct cid; // IWYU pragma: no_forward_declare cid
+
+
+/// A datagram received by one shard for a CID owned by another shard.
+struct shard_dgram {
+    sq_entry(shard_dgram) next;
+    struct w_sockaddr saddr; ///< Remote address the datagram came from.
+    struct w_sockaddr laddr; ///< Local address the datagram arrived on.
+    uint16_t len;            ///< Length of @p buf.
+    uint8_t flags;           ///< TOS/ECN flags of the datagram.
+    uint8_t ttl;             ///< TTL of the datagram.
+    uint8_t _unused[4];
+    uint8_t buf[]; ///< Datagram payload.
+};
+
+
+sq_head(shard_dgram_sq, shard_dgram);
+
+
+/// Per-shard queue of datagrams handed over by other shards.
+struct shard_mbox {
+    pthread_mutex_t lock;
+    struct shard_dgram_sq q;
+    int wake[2]; ///< Pipe that wakes the shard when @p q becomes non-empty.
+};
+
+
+/// State shared by all shards created by q_init_shards().
+struct shard_grp {
+    struct w_engine ** w;     ///< Engines of all shards.
+    struct shard_mbox * mbox; ///< Handoff queues of all shards.
+    pthread_t * thr;          ///< Worker threads started by q_run_shards().
+    uint16_t num;             ///< Number of shards.
+    uint8_t _unused[6];
+};
+
+
+/// Return the index of the shard owning connection ID @p cid.
+///
+/// @param      grp   The shard group.
+/// @param      cid   The connection ID.
+///
+/// @return     Index of the owning shard.
+///
+static inline uint16_t __attribute__((nonnull))
+shard_of_cid(const struct shard_grp * const grp, const struct cid * const cid)
+{
+    return cid->id[0] % grp->num;
+}
+
+
+/// Encode the index of the shard of engine @p w into the first byte of
+/// connection ID @p cid, so that shard_of_cid() maps it back to this shard.
+///
+/// @param      w     The engine.
+/// @param      cid   The connection ID to modify.
+///
+static inline void __attribute__((nonnull))
+shard_tag_cid(const struct w_engine * const w, struct cid * const cid)
+{
+    const struct per_engine_data * const ped = ped(w);
+    if (likely(ped->shards == 0) || cid->len == 0)
+        return;
+    const uint16_t n = ped->shards->num;
+    cid->id[0] = (uint8_t)((cid->id[0] % (256 / n)) * n + ped->shard_idx);
+}
+
+
+extern bool __attribute__((nonnull))
+shard_handoff(const struct w_sock * const ws,
+              const struct w_iov * const xv,
+              const struct cid * const dcid);
+
+extern bool __attribute__((nonnull)) shard_rx(struct w_engine * const w);
+
+#else
+
+#define shard_tag_cid(w, cid)                                                  \
+    do {                                                                       \
+    } while (0)
+
+#endif
@@ -93,6 +93,35 @@ void apply_stream_limits(struct q_stream * const s)
 }
 
 
+void strm_prio_ins(struct q_stream * const s)
+{
+    struct strm_prio * const p = &s->c->strm_prio[s->urgency];
+    if (s->incremental) {
+        dl_insert_tail(&p->inc, s, node_prio);
+        return;
+    }
+
+    // new streams usually have the largest ID, so search from the back
+    struct q_stream * x;
+    dl_foreach_rev (x, &p->seq, node_prio)
+        if (x->id < s->id) {
+            dl_insert_after(&p->seq, x, s, node_prio);
+            return;
+        }
+    dl_insert_head(&p->seq, s, node_prio);
+}
+
+
+void strm_prio_rem(struct q_stream * const s)
+{
+    struct strm_prio * const p = &s->c->strm_prio[s->urgency];
+    if (s->incremental)
+        dl_remove(&p->inc, s, node_prio);
+    else
+        dl_remove(&p->seq, s, node_prio);
+}
+
+
 struct q_stream * new_stream(struct q_conn * const c, const dint_t id)
 {
     struct q_stream * const s = calloc(1, sizeof(*s));
@@ -101,6 +130,7 @@ struct q_stream * new_stream(struct q_conn * const c, const dint_t id)
     sq_init(&s->in);
     s->c = c;
     s->id = id;
+    s->urgency = STRM_URG_DEF;
     strm_to_state(s, strm_open);
 
     if (unlikely(id < 0)) {
@@ -156,6 +186,8 @@ void free_stream(struct q_stream * const s)
 
     if (s->in_ctrl)
         sl_remove(&c->need_ctrl, s, q_stream, node_ctrl);
+    if (s->in_tx)
+        strm_prio_rem(s);
 
     q_free(&s->out);
     q_free(&s->in);
@@ -193,6 +225,7 @@ void reset_stream(struct q_stream * const s, const bool forget)
 
     if (forget) {
         s->out_una = 0;
+        need_tx_update(s);
         q_free(&s->out);
         q_free(&s->in);
         return;
@@ -217,6 +250,7 @@ void reset_stream(struct q_stream * const s, const bool forget)
         m->strm_data_pos = sds;
         m->strm_data_len = sdl;
     }
+    need_tx_update(s);
 }
 
 
@@ -280,6 +314,7 @@ void concat_out(struct q_stream * const s, struct w_iov_sq * const q)
         s->out_una = sq_first(q);
 
     sq_concat(&s->out, q);
+    need_tx_update(s);
 }
 
 
@@ -287,3 +322,20 @@ bool q_is_uni_stream(const struct q_stream * const s)
 {
     return is_uni(s->id);
 }
+
+
+void q_stream_set_priority(struct q_stream * const s,
+                           const uint8_t urgency,
+                           const bool incremental)
+{
+    if (unlikely(s->id < 0))
+        // crypto "streams" are always TX'ed first
+        return;
+
+    if (s->in_tx)
+        strm_prio_rem(s);
+    s->urgency = MIN(urgency, STRM_URG_CNT - 1);
+    s->incremental = incremental;
+    if (s->in_tx)
+        strm_prio_ins(s);
+}
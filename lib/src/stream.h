@@ -74,11 +74,13 @@ SPLAY_PROTOTYPE(ooo_by_off, pkt_meta, off_node, ooo_by_off_cmp)
 
 struct q_stream {
     sl_entry(q_stream) node_ctrl;
+    dl_entry(q_stream) node_prio;
 
     struct q_conn * c; ///< Connection this stream is a part of.
 
     struct w_iov_sq out;    ///< Tail queue containing outbound data.
     struct w_iov * out_una; ///< Lowest un-ACK'ed data chunk.
+    struct w_iov * out_nxt; ///< Where a round-robin TX pass continues.
 
     struct w_iov_sq in; ///< Tail queue containing inbound data.
 #ifndef NO_OOO_DATA
@@ -98,14 +100,19 @@ struct q_stream {
     strm_state_t state; ///< Stream state.
 
     uint8_t in_ctrl : 1; ///< Stream is in connections "needs ctrl" list.
+    uint8_t in_tx : 1;   ///< Stream is in connections TX priority queues.
     uint8_t tx_max_strm_data : 1; ///< We need to open the receive window.
     uint8_t blocked : 1;          ///< We are receive-window-blocked.
-    uint8_t : 5;
+    uint8_t tx_acked : 1; ///< All out data ACK'ed, app not yet notified.
+    uint8_t incremental : 1;      ///< RFC9218 incremental flag.
+    uint8_t : 2;
+
+    uint8_t urgency; ///< RFC9218 urgency, 0 to STRM_URG_CNT - 1.
 
 #if HAVE_64BIT
-    uint8_t _unused[3];
+    uint8_t _unused[2];
 #else
-    uint8_t _unused[7];
+    uint8_t _unused[6];
 #endif
 };
 
@@ -148,6 +155,15 @@ out_fully_acked(const struct q_stream * const s)
 }
 
 
+static inline bool __attribute__((nonnull))
+needs_tx(const struct q_stream * const s)
+{
+    // TX is in order, so any unsent data is at the end of out
+    return s->out_una &&
+           (s->lost_cnt || meta(sq_last(&s->out, w_iov, next)).txed == false);
+}
+
+
 static inline dint_t __attribute__((const)) crpt_strm_id(const epoch_t epoch)
 {
     switch (epoch) { // lgtm [cpp/missing-return]
@@ -206,6 +222,26 @@ need_ctrl_update(struct q_stream * const s)
 }
 
 
+extern void __attribute__((nonnull)) strm_prio_ins(struct q_stream * const s);
+
+extern void __attribute__((nonnull)) strm_prio_rem(struct q_stream * const s);
+
+
+static inline void __attribute__((nonnull))
+need_tx_update(struct q_stream * const s)
+{
+    // only regular streams with unsent or lost data are scheduled for TX,
+    // PTO probes find streams with data in flight via strms_by_id
+    if (unlikely(s->id >= 0 && needs_tx(s) != s->in_tx)) {
+        if (s->in_tx == false)
+            strm_prio_ins(s);
+        else
+            strm_prio_rem(s);
+        s->in_tx = !s->in_tx;
+    }
+}
+
+
 extern struct q_stream * __attribute__((nonnull))
 get_stream(struct q_conn * const c, const dint_t id);
 
@@ -135,8 +135,6 @@ struct tickets_by_peer {
 #endif
 };
 
-static struct tickets_by_peer tickets;
-
 
 #if !defined(PARTICLE) && !defined(RIOT_VERSION)
 static int __attribute__((nonnull))
@@ -166,6 +164,8 @@ static const size_t alpn_cnt = sizeof(alpn) / sizeof(alpn[0]);
 
 #define QUIC_TP 0xffa5
 
+#define HP_BATCH 32 ///< Max. header protection masks computed per call.
+
 #define TP_OCID 0x00    ///< original_connection_id
 #define TP_IDTO 0x01    ///< idle_timeout
 #define TP_SRT 0x02     ///< stateless_reset_token
@@ -185,6 +185,8 @@ static const size_t alpn_cnt = sizeof(alpn) / sizeof(alpn[0]);
 
 #define TP_QR 3127
 
+#define TP_MIAD 0xff04de1b ///< min_ack_delay (ACK frequency extension)
+
 
 // quicly shim
 #define AEAD_BASE_LABEL PTLS_HKDF_EXPAND_LABEL_PREFIX "quic "
@@ -202,11 +204,16 @@ void dispose_cipher(struct st_quicly_cipher_context_t * ctx)
         ptls_cipher_free(ctx->header_protection);
         ctx->header_protection = 0;
     }
+    if (ctx->hp_ecb) {
+        ptls_cipher_free(ctx->hp_ecb);
+        ctx->hp_ecb = 0;
+    }
 }
 
 
 // from quicly (with mods for key update)
 static int setup_cipher(ptls_cipher_context_t ** hp_ctx,
+                        ptls_cipher_context_t ** hp_ecb,
                         ptls_aead_context_t ** aead_ctx,
                         ptls_aead_algorithm_t * aead,
                         ptls_hash_algorithm_t * hash,
@@ -230,6 +237,12 @@ static int setup_cipher(ptls_cipher_context_t ** hp_ctx,
             ret = PTLS_ERROR_NO_MEMORY;
             goto Exit;
         }
+        // an ECB context lets hp_masks() compute many AES masks in one call
+        if (hp_ecb && aead->ecb_cipher &&
+            (*hp_ecb = ptls_cipher_new(aead->ecb_cipher, 1, hpkey)) == NULL) {
+            ret = PTLS_ERROR_NO_MEMORY;
+            goto Exit;
+        }
     }
     if ((*aead_ctx = ptls_aead_new(aead, hash, is_enc, secret,
                                    AEAD_BASE_LABEL)) == NULL) {
@@ -258,6 +271,10 @@ Exit:
             ptls_cipher_free(*hp_ctx);
             *hp_ctx = NULL;
         }
+        if (hp_ecb && *hp_ecb != NULL) {
+            ptls_cipher_free(*hp_ecb);
+            *hp_ecb = NULL;
+        }
     }
     ptls_clear_memory(hpkey, sizeof(hpkey));
     return ret;
@@ -283,8 +300,9 @@ static int setup_initial_key(struct st_quicly_cipher_context_t * ctx,
              ptls_iovec_init(NULL, 0), NULL)) != 0)
         goto Exit;
     if ((ret =
-             setup_cipher(new_secret ? 0 : &ctx->header_protection, &ctx->aead,
-                          cs->aead, cs->hash, is_enc, aead_secret)) != 0)
+             setup_cipher(new_secret ? 0 : &ctx->header_protection,
+                          new_secret ? 0 : &ctx->hp_ecb, &ctx->aead, cs->aead,
+                          cs->hash, is_enc, aead_secret)) != 0)
         goto Exit;
 
 Exit:
@@ -429,6 +447,19 @@ static int chk_tp(ptls_t * tls __attribute__((unused)),
         if (decv(&tp, &pos, end) == false)
             return 1;
 
+        if (tp == TP_MIAD) {
+            if (c->tp_peer.min_ack_del) {
+                err_close(c, ERR_TRANSPORT_PARAMETER, FRM_CRY,
+                          "duplicate tp 0x%" PRIx64, tp);
+                return 1;
+            }
+            if (dec_tp(&c->tp_peer.min_ack_del, &pos, end) == false)
+                return 1;
+            warn(INF, "\tmin_ack_delay = %" PRIu " [us]",
+                 c->tp_peer.min_ack_del);
+            continue;
+        }
+
         // skip unknown TPs
         if (tp >= TP_MAX) {
             uint64_t unknown_len;
@@ -679,6 +710,13 @@ static int chk_tp(ptls_t * tls __attribute__((unused)),
     } else
         c->tp_peer.act_cid_lim = 0;
 
+    if (c->tp_peer.min_ack_del > c->tp_peer.max_ack_del * US_PER_MS) {
+        err_close(c, ERR_TRANSPORT_PARAMETER, FRM_CRY,
+                  "min_ack_delay %" PRIu " > max_ack_delay",
+                  c->tp_peer.min_ack_del);
+        return 1;
+    }
+
     // apply these parameter to all current non-crypto streams
     struct q_stream * s;
     kh_foreach_value(&c->strms_by_id, s, apply_stream_limits(s));
@@ -689,7 +727,7 @@ static int chk_tp(ptls_t * tls __attribute__((unused)),
 
 static void __attribute__((nonnull)) enc_tp(uint8_t ** pos,
                                             const uint8_t * const end,
-                                            const uint16_t tp,
+                                            const uint64_t tp,
                                             const uint_t val)
 {
     encv(pos, end, tp);
@@ -920,6 +958,14 @@ void init_tp(struct q_conn * const c)
                 die("unknown tp 0x%04x", tp_order[j]);
             break;
         }
+
+    // this one doesn't fit into tp_order[]
+    if (c->tp_mine.min_ack_del) {
+        enc_tp(&pos, end, TP_MIAD, c->tp_mine.min_ack_del);
+#ifdef DEBUG_EXTRA
+        warn(INF, "\tmin_ack_delay = %" PRIu " [us]", c->tp_mine.min_ack_del);
+#endif
+    }
     poison_scratch(ped(c->w)->scratch, ped(c->w)->scratch_len);
 
     c->tls.tp_ext[0] = (ptls_raw_extension_t){
@@ -936,9 +982,9 @@ static void init_ticket_prot(struct per_engine_data * const ped)
     uint8_t output[PTLS_MAX_SECRET_SIZE] = {0};
     memcpy(output, quant_commit_hash,
            MIN(quant_commit_hash_len, sizeof(output)));
-    setup_cipher(&ped->dec_tckt.header_protection, &ped->dec_tckt.aead,
+    setup_cipher(&ped->dec_tckt.header_protection, 0, &ped->dec_tckt.aead,
                  cs->aead, cs->hash, 0, output);
-    setup_cipher(&ped->enc_tckt.header_protection, &ped->enc_tckt.aead,
+    setup_cipher(&ped->enc_tckt.header_protection, 0, &ped->enc_tckt.aead,
                  cs->aead, cs->hash, 1, output);
     ptls_clear_memory(output, sizeof(output));
 }
@@ -1026,6 +1072,7 @@ static int save_ticket_cb(ptls_save_ticket_t * self __attribute__((unused)),
                           ptls_iovec_t src)
 {
     struct q_conn * const c = *ptls_get_data_ptr(tls);
+    struct tickets_by_peer * const tickets = ped(c->w)->tickets;
 
 #if !defined(PARTICLE) && !defined(RIOT_VERSION)
     const char * const ticket_store = ped(c->w)->conf.ticket_store;
@@ -1051,14 +1098,14 @@ static int save_ticket_cb(ptls_save_ticket_t * self __attribute__((unused)),
         a = calloc(1, sizeof(char));
 #if !defined(PARTICLE) && !defined(RIOT_VERSION)
     const struct tls_ticket which = {.sni = s, .alpn = a};
-    struct tls_ticket * t = splay_find(tickets_by_peer, &tickets, &which);
+    struct tls_ticket * t = splay_find(tickets_by_peer, tickets, &which);
     if (t == 0) {
         // create new ticket
         t = calloc(1, sizeof(*t));
         ensure(t, "calloc");
         t->sni = s;
         t->alpn = a;
-        ensure(splay_insert(tickets_by_peer, &tickets, t) == 0, "inserted");
+        ensure(splay_insert(tickets_by_peer, tickets, t) == 0, "inserted");
     } else {
         // update current ticket
         free(t->ticket);
@@ -1066,7 +1113,7 @@ static int save_ticket_cb(ptls_save_ticket_t * self __attribute__((unused)),
         free(a);
     }
 #else
-    struct tls_ticket * const t = &tickets.last_ticket;
+    struct tls_ticket * const t = &tickets->last_ticket;
     t->sni = s;
     t->alpn = a;
 #endif
@@ -1082,7 +1129,7 @@ static int save_ticket_cb(ptls_save_ticket_t * self __attribute__((unused)),
     // write all tickets
     // FIXME this currently dumps the entire cache to file on each connection!
 #if !defined(PARTICLE) && !defined(RIOT_VERSION)
-    splay_foreach (t, tickets_by_peer, &tickets) {
+    splay_foreach (t, tickets_by_peer, tickets) {
 #endif
         warn(INF, "writing TLS ticket for %s conn %s (%s %s)", conn_type(c),
              cid_str(c->scid), t->sni, t->alpn);
@@ -1171,14 +1218,15 @@ void init_tls(struct q_conn * const c,
         struct tls_ticket which = {// this works, because of strdup() allocation
                                    .sni = sni,
                                    .alpn = (char *)c->tls.alpn.base};
-        struct tls_ticket * t = splay_find(tickets_by_peer, &tickets, &which);
+        struct tickets_by_peer * const tickets = ped(c->w)->tickets;
+        struct tls_ticket * t = splay_find(tickets_by_peer, tickets, &which);
         if (t == 0) {
             // if we couldn't find a ticket, try without an alpn
             which.alpn = "";
-            t = splay_find(tickets_by_peer, &tickets, &which);
+            t = splay_find(tickets_by_peer, tickets, &which);
         }
 #else
-        struct tls_ticket * const t = &tickets.last_ticket;
+        struct tls_ticket * const t = &ped(c->w)->tickets->last_ticket;
 #endif
         if (t && t->vers != 0) {
             hshk_prop->client.session_ticket =
@@ -1334,7 +1382,13 @@ static void __attribute__((nonnull)) free_ticket(struct tls_ticket * const t)
 #endif
 
 
-static void read_tickets(const struct q_conf * const conf)
+static void __attribute__((nonnull))
+read_tickets(const struct q_conf * const conf,
+             struct tickets_by_peer * const tickets
+#if defined(PARTICLE) || defined(RIOT_VERSION)
+             __attribute__((unused))
+#endif
+)
 {
     warn(INF, "reading TLS tickets from %s", conf->ticket_store);
 
@@ -1401,7 +1455,7 @@ static void read_tickets(const struct q_conf * const conf)
         if (fread(t->ticket, sizeof(*t->ticket), len, fp) != len)
             goto abort;
 
-        ensure(splay_insert(tickets_by_peer, &tickets, t) == 0, "inserted");
+        ensure(splay_insert(tickets_by_peer, tickets, t) == 0, "inserted");
         warn(INF, "got TLS ticket %s %s", t->sni, t->alpn);
         continue;
     abort:
@@ -1494,8 +1548,8 @@ static int update_traffic_key_cb(ptls_update_traffic_key_t * const self
     }
 #endif
 
-    return setup_cipher(&ctx->header_protection, &ctx->aead, cipher->aead,
-                        cipher->hash, is_enc, secret);
+    return setup_cipher(&ctx->header_protection, &ctx->hp_ecb, &ctx->aead,
+                        cipher->aead, cipher->hash, is_enc, secret);
 }
 
 
@@ -1536,12 +1590,13 @@ void init_tls_ctx(const struct q_conf * const conf,
         const int ret = ptls_load_certificates(tls_ctx, conf->tls_cert);
         ensure(ret == 0, "ptls_load_certificates");
     }
-    splay_init(&tickets);
 #endif
 
+    ped->tickets = calloc(1, sizeof(*ped->tickets));
+    ensure(ped->tickets, "could not calloc");
     if (conf && conf->ticket_store) {
         tls_ctx->save_ticket = &save_ticket;
-        read_tickets(conf);
+        read_tickets(conf, ped->tickets);
     }
 #ifndef NO_SERVER
     tls_ctx->encrypt_ticket = &encrypt_ticket;
@@ -1611,12 +1666,13 @@ void free_tls_ctx(struct per_engine_data * const ped)
     // free ticket cache
     struct tls_ticket * t;
     struct tls_ticket * tmp;
-    for (t = splay_min(tickets_by_peer, &tickets); t != 0; t = tmp) {
-        tmp = splay_next(tickets_by_peer, &tickets, t);
-        ensure(splay_remove(tickets_by_peer, &tickets, t), "removed");
+    for (t = splay_min(tickets_by_peer, ped->tickets); t != 0; t = tmp) {
+        tmp = splay_next(tickets_by_peer, ped->tickets, t);
+        ensure(splay_remove(tickets_by_peer, ped->tickets, t), "removed");
         free_ticket(t);
     }
 #endif
+    free(ped->tickets);
 
     for (size_t i = 0; i < ped->tls_ctx.certificates.count; i++)
         free(ped->tls_ctx.certificates.list[i].base);
@@ -1645,6 +1701,29 @@ which_cipher_ctx_out(const struct pkt_meta * const m, const bool kyph)
 }
 
 
+void hp_masks(const struct cipher_ctx * const ctx,
+              const uint8_t * const samples,
+              uint8_t * const masks,
+              const uint16_t n)
+{
+    if (likely(ctx->hp_ecb)) {
+        // for AES, the mask is the ECB encryption of the sample; doing all
+        // samples in one call lets the backend pipeline the AES blocks
+        ptls_cipher_encrypt(ctx->hp_ecb, masks, samples,
+                            (size_t)n * HP_SAMPLE_LEN);
+        return;
+    }
+
+    // ChaCha20 uses the sample as counter and nonce, so one call per sample
+    memset(masks, 0, (size_t)n * HP_SAMPLE_LEN);
+    for (uint16_t i = 0; i < n; i++) {
+        ptls_cipher_init(ctx->header_protection, &samples[i * HP_SAMPLE_LEN]);
+        ptls_cipher_encrypt(ctx->header_protection, &masks[i * HP_SAMPLE_LEN],
+                            &masks[i * HP_SAMPLE_LEN], HP_SAMPLE_LEN);
+    }
+}
+
+
 uint16_t dec_aead(const struct w_iov * const xv,
                   const struct w_iov * const v,
                   const struct pkt_meta * const m,
@@ -1660,7 +1739,8 @@ uint16_t dec_aead(const struct w_iov * const xv,
                           len - hdr_len, m->hdr.nr, xv->buf, hdr_len);
     if (unlikely(ret == SIZE_MAX))
         return 0;
-    memcpy(v->buf, xv->buf, hdr_len);
+    if (v != xv)
+        memcpy(v->buf, xv->buf, hdr_len);
 
 #ifdef DEBUG_PROT
     warn(DBG, "dec %s AEAD over [%u..%u] in [%u..%u]",
@@ -1672,31 +1752,33 @@ uint16_t dec_aead(const struct w_iov * const xv,
 }
 
 
-uint16_t enc_aead(const struct w_iov * const v,
-                  const struct pkt_meta * const m,
-                  struct w_iov * const xv,
-                  const uint16_t pkt_nr_pos)
+static const struct cipher_ctx * __attribute__((nonnull))
+enc_aead_ctx(const struct pkt_meta * const m)
 {
-    const struct cipher_ctx * ctx = which_cipher_ctx_out(m, true);
+    const struct cipher_ctx * const ctx = which_cipher_ctx_out(m, true);
     if (unlikely(ctx == 0 || ctx->aead == 0)) {
         warn(NTE, "no %s crypto context",
              pkt_type_str(m->hdr.flags, &m->hdr.vers));
         return 0;
     }
+    return ctx;
+}
+
 
+static void __attribute__((nonnull))
+enc_aead_payload(const struct cipher_ctx * const ctx,
+                 const uint8_t * const pt,
+                 const uint16_t len,
+                 const struct pkt_meta * const m,
+                 struct w_iov * const xv)
+{
     const uint16_t hdr_len = m->hdr.hdr_len;
-    memcpy(xv->buf, v->buf, hdr_len); // copy pkt header
+    memcpy(xv->buf, pt, hdr_len); // copy pkt header
 
-    const uint16_t plen = v->len - hdr_len + AEAD_LEN;
+    const uint16_t plen = len - hdr_len + AEAD_LEN;
     xv->len = hdr_len + (uint16_t)ptls_aead_encrypt(
-                            ctx->aead, &xv->buf[hdr_len], &v->buf[hdr_len],
-                            plen - AEAD_LEN, m->hdr.nr, v->buf, hdr_len);
-
-    // apply packet protection
-    ctx = which_cipher_ctx_out(m, false);
-    if (likely(pkt_nr_pos) &&
-        unlikely(xor_hp(xv, m, ctx, pkt_nr_pos, true) == false))
-        return 0;
+                            ctx->aead, &xv->buf[hdr_len], &pt[hdr_len],
+                            plen - AEAD_LEN, m->hdr.nr, pt, hdr_len);
 
 #ifdef DEBUG_PROT
     warn(DBG, "enc %s AEAD over [%u..%u] in [%u..%u]",
@@ -1704,10 +1786,98 @@ uint16_t enc_aead(const struct w_iov * const v,
          hdr_len + plen - AEAD_LEN - 1, hdr_len + plen - AEAD_LEN,
          hdr_len + plen - 1);
 #endif
+}
+
+
+uint16_t enc_aead(const struct w_iov * const v,
+                  const struct pkt_meta * const m,
+                  struct w_iov * const xv,
+                  const uint16_t pkt_nr_pos)
+{
+    const struct cipher_ctx * ctx = enc_aead_ctx(m);
+    if (unlikely(ctx == 0))
+        return 0;
+
+    enc_aead_payload(ctx, v->buf, v->len, m, xv);
+
+    // apply packet protection
+    ctx = which_cipher_ctx_out(m, false);
+    if (likely(pkt_nr_pos) &&
+        unlikely(xor_hp(xv, m, ctx, pkt_nr_pos, true) == false))
+        return 0;
+
     return xv->len;
 }
 
 
+uint16_t enc_aead_queue(const struct w_iov * const v,
+                        const struct pkt_meta * const m,
+                        struct w_iov * const xv,
+                        const uint16_t pkt_nr_pos)
+{
+    if (unlikely(enc_aead_ctx(m) == 0))
+        return 0;
+
+    struct per_engine_data * const ped = ped(xv->w);
+    const struct aead_job job = {.xv = xv,
+                                 .m = m,
+                                 .pt = v->buf,
+                                 .len = v->len,
+                                 .pkt_nr_pos = pkt_nr_pos};
+    kv_push(struct aead_job, ped->aead_jobs, job);
+
+    // the length of the protected pkt is known before we protect it
+    xv->len = v->len + AEAD_LEN;
+    return xv->len;
+}
+
+
+void enc_aead_flush(struct w_engine * const w)
+{
+    struct per_engine_data * const ped = ped(w);
+    const size_t n = kv_size(ped->aead_jobs);
+
+    // encrypt all payloads back-to-back, so the AEAD stays hot across pkts
+    for (size_t i = 0; i < n; i++) {
+        const struct aead_job * const j = &kv_A(ped->aead_jobs, i);
+        enc_aead_payload(which_cipher_ctx_out(j->m, true), j->pt, j->len,
+                         j->m, j->xv);
+    }
+
+    // then apply header protection, which samples the ciphertext; gather the
+    // samples of consecutive pkts sharing a key, so hp_masks() can batch them
+    uint8_t samples[HP_BATCH][HP_SAMPLE_LEN];
+    uint8_t masks[HP_BATCH][HP_SAMPLE_LEN];
+    size_t idx[HP_BATCH];
+    for (size_t i = 0; i < n;) {
+        const struct cipher_ctx * const ctx =
+            which_cipher_ctx_out(kv_A(ped->aead_jobs, i).m, false);
+        uint16_t b = 0;
+        for (; i < n && b < HP_BATCH; i++) {
+            const struct aead_job * const j = &kv_A(ped->aead_jobs, i);
+            if (which_cipher_ctx_out(j->m, false) != ctx)
+                break;
+            if (unlikely(j->pkt_nr_pos == 0))
+                continue;
+            const uint16_t off = hp_sample_off(j->xv, j->m, j->pkt_nr_pos);
+            ensure(off, "HP sample out of bounds");
+            memcpy(samples[b], &j->xv->buf[off], HP_SAMPLE_LEN);
+            idx[b++] = i;
+        }
+
+        if (b == 0)
+            continue;
+        hp_masks(ctx, samples[0], masks[0], b);
+        for (uint16_t k = 0; k < b; k++) {
+            const struct aead_job * const j = &kv_A(ped->aead_jobs, idx[k]);
+            apply_hp_mask(j->xv, j->m, j->pkt_nr_pos, masks[k], true);
+        }
+    }
+
+    kv_size(ped->aead_jobs) = 0;
+}
+
+
 static ptls_hash_context_t * __attribute__((nonnull))
 prep_hash_ctx(const struct q_conn * const c,
               const ptls_cipher_suite_t * const cs)
@@ -1856,6 +2026,9 @@ void maybe_flip_keys(struct q_conn * const c, const bool out)
 
     const ptls_cipher_suite_t * const cs = ptls_get_cipher(c->tls.t);
     if (likely(cs)) {
+        if (out)
+            // protect queued pkts with the keys they were built for
+            enc_aead_flush(c->w);
         flip_keys(c, out, cs);
         c->do_key_flip = false;
     } else
@@ -71,6 +71,7 @@ nonrandom_bytes(void * const buf, const size_t len)
 struct cipher_ctx {
     ptls_aead_context_t * aead;
     ptls_cipher_context_t * header_protection;
+    ptls_cipher_context_t * hp_ecb; // only for AES-based suites
 };
 
 
@@ -122,6 +123,20 @@ enc_aead(const struct w_iov * const v,
          struct w_iov * const xv,
          const uint16_t pkt_nr_pos);
 
+extern uint16_t __attribute__((nonnull))
+enc_aead_queue(const struct w_iov * const v,
+               const struct pkt_meta * const m,
+               struct w_iov * const xv,
+               const uint16_t pkt_nr_pos);
+
+extern void __attribute__((nonnull)) enc_aead_flush(struct w_engine * const w);
+
+extern void __attribute__((nonnull))
+hp_masks(const struct cipher_ctx * const ctx,
+         const uint8_t * const samples,
+         uint8_t * const masks,
+         const uint16_t n);
+
 extern void __attribute__((nonnull)) make_rtry_tok(struct q_conn * const c);
 
 extern bool __attribute__((nonnull)) verify_rtry_tok(struct q_conn * const c,
@@ -0,0 +1,477 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "uring.h"
+
+#ifdef WITH_IO_URING
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+#include <liburing.h>
+#include <quant/quant.h>
+#include <timeout.h>
+
+#include "conn.h"
+#include "kvec.h"
+#include "quic.h"
+
+// the upper 32 bits of a CQE's user data say which kind of request it is for
+#define URING_RX (1ULL << 32) ///< Multishot recvmsg, low bits are the slot.
+#define URING_TX (2ULL << 32) ///< Sendmsg, low bits are the TX slot.
+#define URING_CANCEL (3ULL << 32) ///< Cancellation of a URING_RX request.
+
+#define URING_BGID 0 ///< Buffer group ID of the provided RX buffers.
+
+
+/// A socket whose datagrams we receive via a multishot recvmsg.
+struct uring_sock {
+    struct w_sock * ws; ///< The socket, or zero once it was closed.
+    bool armed;         ///< The multishot recvmsg is active.
+    uint8_t _unused[7];
+};
+
+
+/// An RX CQE, copied off the CQ for uring_rx().
+struct uring_cqe {
+    uint64_t user_data;
+    int32_t res;
+    uint32_t flags;
+};
+
+
+struct q_uring {
+    struct io_uring ring;
+    struct io_uring_buf_ring * br;
+    uint8_t * rx_bufs; ///< URING_BUFS buffers of @p rx_len bytes.
+    uint8_t * tx_bufs; ///< URING_TX_SLOTS buffers of @p tx_len bytes.
+    kvec_t(struct uring_sock) socks;
+    kvec_t(struct uring_cqe) stash; ///< RX CQEs not yet processed.
+    struct msghdr rx_msg;           ///< Layout template for received data.
+    uint32_t rx_len;                ///< Size of each RX buffer.
+    uint16_t tx_len;                ///< Size of each TX buffer.
+    uint16_t tx_free_cnt;           ///< Number of entries in @p tx_free.
+    uint16_t tx_free[URING_TX_SLOTS]; ///< Unused TX slots.
+
+    struct msghdr tx_msg[URING_TX_SLOTS];
+    struct iovec tx_iov[URING_TX_SLOTS];
+    struct sockaddr_storage tx_name[URING_TX_SLOTS];
+    union {
+        uint8_t buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } tx_ctrl[URING_TX_SLOTS];
+};
+
+
+static void __attribute__((nonnull))
+provide_buf(struct q_uring * const u, const uint16_t bid)
+{
+    io_uring_buf_ring_add(u->br, &u->rx_bufs[(size_t)bid * u->rx_len],
+                          u->rx_len, bid, io_uring_buf_ring_mask(URING_BUFS),
+                          0);
+    io_uring_buf_ring_advance(u->br, 1);
+}
+
+
+static void __attribute__((nonnull))
+arm_sock(struct q_uring * const u, const size_t slot)
+{
+    struct uring_sock * const s = &kv_A(u->socks, slot);
+    struct io_uring_sqe * const sqe = io_uring_get_sqe(&u->ring);
+    if (unlikely(sqe == 0))
+        // the SQ is full, we'll try again after the next submission
+        return;
+
+    io_uring_prep_recvmsg_multishot(sqe, w_fd(s->ws), &u->rx_msg, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    io_uring_sqe_set_data64(sqe, URING_RX | slot);
+    s->armed = true;
+}
+
+
+bool uring_init(struct w_engine * const w)
+{
+    // we can only take over the sockets of the kernel socket backend
+    if (strcmp(w->backend_name, "socket") != 0) {
+        warn(WRN, "io_uring needs the socket backend, not %s",
+             w->backend_name);
+        return false;
+    }
+
+    struct q_uring * const u = calloc(1, sizeof(*u));
+    ensure(u, "could not calloc");
+
+    struct io_uring_params p = {.flags = IORING_SETUP_CQSIZE,
+                                .cq_entries = 4 * URING_BUFS};
+    int ret = io_uring_queue_init_params(URING_BUFS, &u->ring, &p);
+    if (ret < 0) {
+        warn(WRN, "io_uring_queue_init: %s", strerror(-ret));
+        free(u);
+        return false;
+    }
+
+    u->br = io_uring_setup_buf_ring(&u->ring, URING_BUFS, URING_BGID, 0, &ret);
+    if (u->br == 0) {
+        warn(WRN, "io_uring_setup_buf_ring: %s", strerror(-ret));
+        io_uring_queue_exit(&u->ring);
+        free(u);
+        return false;
+    }
+
+    // multishot recvmsg places a header, the peer address and the cmsgs
+    // in front of the payload in each buffer
+    u->rx_msg.msg_namelen = sizeof(struct sockaddr_in6);
+    u->rx_msg.msg_controllen = 2 * CMSG_SPACE(sizeof(int));
+    u->rx_len = (uint32_t)sizeof(struct io_uring_recvmsg_out) +
+                u->rx_msg.msg_namelen + (uint32_t)u->rx_msg.msg_controllen +
+                w->mtu;
+    u->tx_len = w->mtu;
+    u->rx_bufs = calloc(URING_BUFS, u->rx_len);
+    u->tx_bufs = calloc(URING_TX_SLOTS, u->tx_len);
+    ensure(u->rx_bufs && u->tx_bufs, "could not calloc");
+
+    ped(w)->uring = u;
+    ped(w)->txtime = false; // departure times are not stamped here
+    for (uint16_t bid = 0; bid < URING_BUFS; bid++)
+        provide_buf(u, bid);
+    for (uint16_t slot = 0; slot < URING_TX_SLOTS; slot++)
+        u->tx_free[u->tx_free_cnt++] = slot;
+    add_pfd(w, u->ring.ring_fd);
+
+    warn(INF, "using io_uring for socket I/O");
+    return true;
+}
+
+
+void uring_cleanup(struct w_engine * const w)
+{
+    struct q_uring * const u = ped(w)->uring;
+    if (u == 0)
+        return;
+
+    io_uring_free_buf_ring(&u->ring, u->br, URING_BUFS, URING_BGID);
+    io_uring_queue_exit(&u->ring);
+    free(u->rx_bufs);
+    free(u->tx_bufs);
+    kv_destroy(u->socks);
+    kv_destroy(u->stash);
+    free(u);
+    ped(w)->uring = 0;
+}
+
+
+void uring_add_sock(struct w_sock * const ws)
+{
+    struct q_uring * const u = ped(ws->w)->uring;
+    if (u == 0)
+        return;
+
+    // reuse a slot whose multishot recvmsg has finished
+    size_t slot = 0;
+    for (; slot < kv_size(u->socks); slot++)
+        if (kv_A(u->socks, slot).ws == 0 && kv_A(u->socks, slot).armed == false)
+            break;
+    if (slot == kv_size(u->socks))
+        kv_push(struct uring_sock, u->socks, (struct uring_sock){0});
+
+    kv_A(u->socks, slot).ws = ws;
+    arm_sock(u, slot);
+    io_uring_submit(&u->ring);
+}
+
+
+void uring_del_sock(struct w_sock * const ws)
+{
+    struct q_uring * const u = ped(ws->w)->uring;
+    if (u == 0)
+        return;
+
+    for (size_t slot = 0; slot < kv_size(u->socks); slot++) {
+        struct uring_sock * const s = &kv_A(u->socks, slot);
+        if (s->ws != ws)
+            continue;
+
+        // the ring holds a reference to the fd, so closing it is not enough;
+        // the slot stays reserved until the final CQE of the recvmsg arrives
+        s->ws = 0;
+        if (s->armed) {
+            struct io_uring_sqe * const sqe = io_uring_get_sqe(&u->ring);
+            if (sqe) {
+                io_uring_prep_cancel64(sqe, URING_RX | slot, 0);
+                io_uring_sqe_set_data64(sqe, URING_CANCEL);
+                io_uring_submit(&u->ring);
+            }
+        }
+        return;
+    }
+}
+
+
+static void __attribute__((nonnull))
+build_msg(struct q_uring * const u,
+          const size_t i,
+          const struct w_sock * const ws,
+          const struct w_iov * const v)
+{
+    // quant reuses v once we return, so send from a copy
+    struct msghdr * const msg = &u->tx_msg[i];
+    uint8_t * const buf = &u->tx_bufs[i * u->tx_len];
+    memcpy(buf, v->buf, v->len);
+    u->tx_iov[i] = (struct iovec){.iov_base = buf, .iov_len = v->len};
+    *msg = (struct msghdr){.msg_iov = &u->tx_iov[i], .msg_iovlen = 1};
+
+    if (w_connected(ws) == false) {
+        struct sockaddr_storage * const ss = &u->tx_name[i];
+        memset(ss, 0, sizeof(*ss));
+        ss->ss_family = v->wv_af;
+        if (v->wv_af == AF_INET) {
+            struct sockaddr_in * const sin4 = (struct sockaddr_in *)ss;
+            sin4->sin_port = v->wv_port;
+            memcpy(&sin4->sin_addr, &v->wv_addr.ip4, sizeof(sin4->sin_addr));
+            msg->msg_namelen = sizeof(*sin4);
+        } else {
+            struct sockaddr_in6 * const sin6 = (struct sockaddr_in6 *)ss;
+            sin6->sin6_port = v->wv_port;
+            memcpy(&sin6->sin6_addr, &v->wv_addr.ip6,
+                   sizeof(sin6->sin6_addr));
+            msg->msg_namelen = sizeof(*sin6);
+        }
+        msg->msg_name = ss;
+    }
+
+    if (v->flags) {
+        msg->msg_control = u->tx_ctrl[i].buf;
+        msg->msg_controllen = sizeof(u->tx_ctrl[i].buf);
+        struct cmsghdr * const cm = CMSG_FIRSTHDR(msg);
+        cm->cmsg_level = v->wv_af == AF_INET ? IPPROTO_IP : IPPROTO_IPV6;
+        cm->cmsg_type = v->wv_af == AF_INET ? IP_TOS : IPV6_TCLASS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        const int tos = v->flags;
+        memcpy(CMSG_DATA(cm), &tos, sizeof(tos));
+    }
+}
+
+
+static void __attribute__((nonnull)) reap_cqes(struct q_uring * const u)
+{
+    // release the slots of finished sends, keep RX completions for uring_rx()
+    unsigned head;
+    uint32_t cnt = 0;
+    struct io_uring_cqe * cqe;
+    io_uring_for_each_cqe(&u->ring, head, cqe)
+    {
+        const uint64_t kind = cqe->user_data & ~(URING_RX - 1);
+        if (kind == URING_TX) {
+            if (unlikely(cqe->res < 0))
+                warn(WRN, "io_uring sendmsg: %s", strerror(-cqe->res));
+            u->tx_free[u->tx_free_cnt++] =
+                (uint16_t)(cqe->user_data & (URING_RX - 1));
+        } else if (kind == URING_RX)
+            kv_push(struct uring_cqe, u->stash,
+                    ((struct uring_cqe){.user_data = cqe->user_data,
+                                        .res = cqe->res,
+                                        .flags = cqe->flags}));
+        cnt++;
+    }
+    io_uring_cq_advance(&u->ring, cnt);
+}
+
+
+void uring_tx(struct w_sock * const ws, struct w_iov_sq * const q)
+{
+    struct q_uring * const u = ped(ws->w)->uring;
+    struct w_iov * v;
+    sq_foreach (v, q, next) {
+        // only block when all TX slots are in flight
+        reap_cqes(u);
+        while (unlikely(u->tx_free_cnt == 0)) {
+            io_uring_submit_and_wait(&u->ring, 1);
+            reap_cqes(u);
+        }
+
+        struct io_uring_sqe * sqe = io_uring_get_sqe(&u->ring);
+        if (unlikely(sqe == 0)) {
+            io_uring_submit(&u->ring);
+            sqe = io_uring_get_sqe(&u->ring);
+            ensure(sqe, "io_uring SQ full");
+        }
+
+        // each send completes on its own, so one failure affects no others
+        const uint16_t slot = u->tx_free[--u->tx_free_cnt];
+        build_msg(u, slot, ws, v);
+        io_uring_prep_sendmsg(sqe, w_fd(ws), &u->tx_msg[slot], 0);
+        io_uring_sqe_set_data64(sqe, URING_TX | slot);
+    }
+    io_uring_submit(&u->ring);
+}
+
+
+static struct w_sock * __attribute__((nonnull))
+rx_cqe(struct w_engine * const w,
+       const struct uring_cqe * const cqe,
+       struct w_iov ** const xv)
+{
+    struct q_uring * const u = ped(w)->uring;
+    *xv = 0;
+    if ((cqe->user_data & ~(URING_RX - 1)) != URING_RX)
+        return 0;
+
+    struct uring_sock * const s =
+        &kv_A(u->socks, (size_t)(cqe->user_data & (URING_RX - 1)));
+    if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+        // the multishot recvmsg ended, rearm it later if the sock is open
+        s->armed = false;
+
+    if ((cqe->flags & IORING_CQE_F_BUFFER) == 0)
+        return 0;
+    const uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    uint8_t * const buf = &u->rx_bufs[(size_t)bid * u->rx_len];
+
+    struct io_uring_recvmsg_out * const o =
+        cqe->res > 0 && s->ws
+            ? io_uring_recvmsg_validate(buf, cqe->res, &u->rx_msg)
+            : 0;
+    if (unlikely(o == 0 || (o->flags & MSG_TRUNC))) {
+        provide_buf(u, bid);
+        return 0;
+    }
+
+    const struct sockaddr * const sa = io_uring_recvmsg_name(o);
+    const uint32_t len = io_uring_recvmsg_payload_length(o, cqe->res,
+                                                         &u->rx_msg);
+    struct w_iov * const v = w_alloc_iov(w, sa->sa_family, 0, 0);
+    if (unlikely(v == 0 || len > v->len)) {
+        warn(WRN, "cannot buffer %u-byte io_uring datagram", len);
+        if (v)
+            w_free_iov(v);
+        provide_buf(u, bid);
+        return 0;
+    }
+
+    uint8_t tos = 0;
+    uint8_t ttl = 0;
+    for (struct cmsghdr * cm = io_uring_recvmsg_cmsg_firsthdr(o, &u->rx_msg);
+         cm; cm = io_uring_recvmsg_cmsg_nexthdr(o, &u->rx_msg, cm)) {
+        int val = 0;
+        memcpy(&val, CMSG_DATA(cm),
+               MIN(sizeof(val), cm->cmsg_len - CMSG_LEN(0)));
+        if ((cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_TOS) ||
+            (cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_TCLASS))
+            tos = (uint8_t)val;
+        else if ((cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_TTL) ||
+                 (cm->cmsg_level == IPPROTO_IPV6 &&
+                  cm->cmsg_type == IPV6_HOPLIMIT))
+            ttl = (uint8_t)val;
+    }
+
+    w_to_waddr(&v->wv_addr, sa);
+    v->wv_port = sa->sa_family == AF_INET
+                     ? ((const struct sockaddr_in *)(const void *)sa)->sin_port
+                     : ((const struct sockaddr_in6 *)(const void *)sa)
+                           ->sin6_port;
+    v->flags = tos;
+    v->ttl = ttl;
+    v->len = (uint16_t)len;
+    memcpy(v->buf, io_uring_recvmsg_payload(o, &u->rx_msg), len);
+    provide_buf(u, bid);
+
+    *xv = v;
+    return s->ws;
+}
+
+
+bool uring_rx(struct w_engine * const w, const int64_t nsec)
+{
+    struct per_engine_data * const ped = ped(w);
+    struct q_uring * const u = ped->uring;
+
+    struct io_uring_cqe * cqe;
+    if (kv_size(u->stash) == 0 && io_uring_peek_cqe(&u->ring, &cqe) != 0) {
+        if (nsec == 0)
+            return false;
+        if (nsec < 0) {
+            if (io_uring_wait_cqe(&u->ring, &cqe) != 0)
+                return false;
+        } else {
+            const int64_t ns_per_s = NS_PER_S;
+            struct __kernel_timespec ts = {.tv_sec = nsec / ns_per_s,
+                                           .tv_nsec = nsec % ns_per_s};
+            if (io_uring_wait_cqe_timeout(&u->ring, &cqe, &ts) != 0)
+                return false;
+        }
+    }
+
+    ped->now = w_now();
+    timeouts_update(ped->wheel, ped->now);
+
+    // collect what the TX path stashed, followed by what is on the CQ now
+    reap_cqes(u);
+
+    // process the datagrams in batches per socket
+    struct w_iov_sq x = w_iov_sq_initializer(x);
+    struct w_sock * ws = 0;
+    bool did_rx = false;
+    for (size_t i = 0; i < kv_size(u->stash); i++) {
+        struct w_iov * xv;
+        struct w_sock * const xws = rx_cqe(w, &kv_A(u->stash, i), &xv);
+        if (xv == 0)
+            continue;
+        if (ws && ws != xws)
+            do_rx(ws, &x);
+        ws = xws;
+        sq_insert_tail(&x, xv, next);
+        did_rx = true;
+    }
+    kv_size(u->stash) = 0;
+    if (ws)
+        do_rx(ws, &x);
+
+    // rearm the recvmsg of any open socket whose multishot ended
+    bool rearmed = false;
+    for (size_t slot = 0; slot < kv_size(u->socks); slot++)
+        if (kv_A(u->socks, slot).ws && kv_A(u->socks, slot).armed == false) {
+            arm_sock(u, slot);
+            rearmed = true;
+        }
+    if (rearmed)
+        io_uring_submit(&u->ring);
+
+    return did_rx;
+}
+
+#endif
@@ -0,0 +1,69 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <warpcore/warpcore.h>
+
+#ifdef WITH_IO_URING
+
+/// Number of buffers provided to the kernel for receiving.
+#define URING_BUFS 256
+
+/// Maximum number of sendmsg requests in flight.
+#define URING_TX_SLOTS 256
+
+
+extern bool __attribute__((nonnull)) uring_init(struct w_engine * const w);
+
+extern void __attribute__((nonnull)) uring_cleanup(struct w_engine * const w);
+
+extern void __attribute__((nonnull)) uring_add_sock(struct w_sock * const ws);
+
+extern void __attribute__((nonnull)) uring_del_sock(struct w_sock * const ws);
+
+extern void __attribute__((nonnull))
+uring_tx(struct w_sock * const ws, struct w_iov_sq * const q);
+
+extern bool __attribute__((nonnull))
+uring_rx(struct w_engine * const w, const int64_t nsec);
+
+#else
+
+#define uring_add_sock(ws)                                                     \
+    do {                                                                       \
+    } while (0)
+
+#define uring_del_sock(ws)                                                     \
+    do {                                                                       \
+    } while (0)
+
+#endif
@@ -0,0 +1,687 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "xdp.h"
+
+#ifdef WITH_AF_XDP
+
+#include <errno.h>
+#include <inttypes.h>
+#include <net/if.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+#include <linux/ethtool.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+#include <bpf/bpf.h>
+#include <quant/quant.h>
+#include <timeout.h>
+#include <xdp/xsk.h>
+
+#include "conn.h"
+#include "kvec.h"
+#include "quic.h"
+
+#define IP4_HLEN 20 ///< We neither send nor accept IPv4 options.
+#define IP6_HLEN 40 ///< We neither send nor accept IPv6 extension headers.
+#define UDP_HLEN 8
+
+#define XDP_UMEM_LEN (XDP_NUM_FRAMES * XDP_FRAME_SIZE)
+
+
+/// Next-hop MAC address learned from a received frame.
+struct xdp_mac {
+    struct w_addr addr;     ///< IP address of the peer.
+    uint8_t mac[ETH_ALEN];  ///< Source MAC of the last frame from @p addr.
+    bool valid;
+    uint8_t _unused[1];
+};
+
+
+struct q_xdp {
+    struct xsk_ring_prod fq;
+    struct xsk_ring_cons cq;
+    struct xsk_ring_cons rx;
+    struct xsk_ring_prod tx;
+    struct xsk_umem * umem;
+    struct xsk_socket * xsk;
+    uint8_t * area;                  ///< The UMEM.
+    kvec_t(struct w_sock *) socks;   ///< Sockets whose ports we steer.
+    uint64_t free_frames[XDP_NUM_FRAMES / 2]; ///< Unused TX frames.
+    struct xdp_mac macs[XDP_NUM_MACS];
+    uint32_t num_free;  ///< Number of entries in @p free_frames.
+    uint32_t xdp_flags; ///< Mode the XDP program is attached in.
+    int ifindex;
+    int prog_fd;
+    int ports_fd; ///< BPF array map, non-zero for UDP ports we steer.
+    int xsks_fd;  ///< BPF XSK map, holds our AF_XDP socket.
+    uint8_t mac[ETH_ALEN];
+    uint8_t _unused[2];
+};
+
+
+// minimal BPF assembler, see linux/filter.h
+#define INSN(c, d, s, o, i)                                                    \
+    ((struct bpf_insn){                                                        \
+        .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i)})
+#define MOV64_REG(d, s) INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define MOV64_IMM(d, i) INSN(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define ADD64_IMM(d, i) INSN(BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, i)
+#define AND64_IMM(d, i) INSN(BPF_ALU64 | BPF_AND | BPF_K, d, 0, 0, i)
+#define LDX_MEM(sz, d, s, o) INSN(BPF_LDX | (sz) | BPF_MEM, d, s, o, 0)
+#define STX_MEM(sz, d, s, o) INSN(BPF_STX | (sz) | BPF_MEM, d, s, o, 0)
+#define JMP_REG(op, d, s, o) INSN(BPF_JMP | (op) | BPF_X, d, s, o, 0)
+#define JMP_IMM(op, d, i, o) INSN(BPF_JMP | (op) | BPF_K, d, 0, o, i)
+#define JMP_A(o) INSN(BPF_JMP | BPF_JA, 0, 0, o, 0)
+#define LD_MAP_FD(d, fd)                                                       \
+    INSN(BPF_LD | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd),              \
+        INSN(0, 0, 0, 0, 0)
+#define CALL(f) INSN(BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define EXIT() INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+// offset of a jump at instruction index "from" to index "to"
+#define J(from, to) ((to) - (from) - 1)
+
+
+static int load_prog(const int ports_fd, const int xsks_fd)
+{
+    // redirect UDP packets for ports marked in ports_fd to our XSK, and
+    // pass everything else (including all other traffic) to the kernel
+    enum { L_V4 = 10, L_V6 = 20, L_LOOKUP = 26, L_PASS = 41 };
+    const struct bpf_insn prog[] = {
+        /* 0 */ MOV64_REG(BPF_REG_6, BPF_REG_1),
+        /* 1 */
+        LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct xdp_md, data)),
+        /* 2 */
+        LDX_MEM(BPF_W, BPF_REG_3, BPF_REG_6, offsetof(struct xdp_md, data_end)),
+        /* 3 */ MOV64_REG(BPF_REG_4, BPF_REG_2),
+        /* 4 */ ADD64_IMM(BPF_REG_4, ETH_HLEN + IP4_HLEN + UDP_HLEN),
+        /* 5 */ JMP_REG(BPF_JGT, BPF_REG_4, BPF_REG_3, J(5, L_PASS)),
+        /* 6 */ LDX_MEM(BPF_H, BPF_REG_5, BPF_REG_2, 12),
+        /* 7 */ JMP_IMM(BPF_JEQ, BPF_REG_5, htons(ETH_P_IP), J(7, L_V4)),
+        /* 8 */ JMP_IMM(BPF_JEQ, BPF_REG_5, htons(ETH_P_IPV6), J(8, L_V6)),
+        /* 9 */ JMP_A(J(9, L_PASS)),
+
+        // IPv4 without options, unfragmented
+        /* 10 */ LDX_MEM(BPF_B, BPF_REG_5, BPF_REG_2, ETH_HLEN + 9),
+        /* 11 */ JMP_IMM(BPF_JNE, BPF_REG_5, IPPROTO_UDP, J(11, L_PASS)),
+        /* 12 */ LDX_MEM(BPF_B, BPF_REG_5, BPF_REG_2, ETH_HLEN),
+        /* 13 */ AND64_IMM(BPF_REG_5, 0x0f),
+        /* 14 */ JMP_IMM(BPF_JNE, BPF_REG_5, IP4_HLEN / 4, J(14, L_PASS)),
+        // leave fragments to the kernel, which reassembles them
+        /* 15 */ LDX_MEM(BPF_H, BPF_REG_5, BPF_REG_2, ETH_HLEN + 6),
+        /* 16 */ AND64_IMM(BPF_REG_5, htons(IP_MF | IP_OFFMASK)),
+        /* 17 */ JMP_IMM(BPF_JNE, BPF_REG_5, 0, J(17, L_PASS)),
+        /* 18 */ LDX_MEM(BPF_H, BPF_REG_5, BPF_REG_2, ETH_HLEN + IP4_HLEN + 2),
+        /* 19 */ JMP_A(J(19, L_LOOKUP)),
+
+        // IPv6 without extension headers
+        /* 20 */ MOV64_REG(BPF_REG_4, BPF_REG_2),
+        /* 21 */ ADD64_IMM(BPF_REG_4, ETH_HLEN + IP6_HLEN + UDP_HLEN),
+        /* 22 */ JMP_REG(BPF_JGT, BPF_REG_4, BPF_REG_3, J(22, L_PASS)),
+        /* 23 */ LDX_MEM(BPF_B, BPF_REG_5, BPF_REG_2, ETH_HLEN + 6),
+        /* 24 */ JMP_IMM(BPF_JNE, BPF_REG_5, IPPROTO_UDP, J(24, L_PASS)),
+        /* 25 */ LDX_MEM(BPF_H, BPF_REG_5, BPF_REG_2, ETH_HLEN + IP6_HLEN + 2),
+
+        // is the destination port one of ours?
+        /* 26 */ STX_MEM(BPF_W, BPF_REG_10, BPF_REG_5, -4),
+        /* 27 */ LD_MAP_FD(BPF_REG_1, ports_fd),
+        /* 29 */ MOV64_REG(BPF_REG_2, BPF_REG_10),
+        /* 30 */ ADD64_IMM(BPF_REG_2, -4),
+        /* 31 */ CALL(BPF_FUNC_map_lookup_elem),
+        /* 32 */ JMP_IMM(BPF_JEQ, BPF_REG_0, 0, J(32, L_PASS)),
+        /* 33 */ LDX_MEM(BPF_B, BPF_REG_1, BPF_REG_0, 0),
+        /* 34 */ JMP_IMM(BPF_JEQ, BPF_REG_1, 0, J(34, L_PASS)),
+        /* 35 */
+        LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_6,
+                offsetof(struct xdp_md, rx_queue_index)),
+        /* 36 */ LD_MAP_FD(BPF_REG_1, xsks_fd),
+        /* 38 */ MOV64_IMM(BPF_REG_3, XDP_PASS),
+        /* 39 */ CALL(BPF_FUNC_redirect_map),
+        /* 40 */ EXIT(),
+
+        /* 41 */ MOV64_IMM(BPF_REG_0, XDP_PASS),
+        /* 42 */ EXIT(),
+    };
+
+    return bpf_prog_load(BPF_PROG_TYPE_XDP, "quant_xdp", "GPL", prog,
+                         sizeof(prog) / sizeof(prog[0]), 0);
+}
+
+
+static bool __attribute__((nonnull))
+get_mac(const char * const ifname, uint8_t * const mac)
+{
+    const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return false;
+    struct ifreq ifr = {0};
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+    const bool ok = ioctl(fd, SIOCGIFHWADDR, &ifr) == 0;
+    if (ok)
+        memcpy(mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+    close(fd);
+    return ok;
+}
+
+
+static uint32_t __attribute__((nonnull)) rx_queues(const char * const ifname)
+{
+    // drivers without channel support have a single queue
+    uint32_t n = 1;
+    const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return n;
+    struct ethtool_channels ch = {.cmd = ETHTOOL_GCHANNELS};
+    struct ifreq ifr = {.ifr_data = (char *)&ch};
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+    if (ioctl(fd, SIOCETHTOOL, &ifr) == 0)
+        n = MAX(ch.rx_count + ch.combined_count, 1);
+    close(fd);
+    return n;
+}
+
+
+static struct xdp_mac * __attribute__((nonnull))
+mac_slot(struct q_xdp * const x, const struct w_addr * const a)
+{
+    uint32_t h;
+    memcpy(&h, a->af == AF_INET ? (const uint8_t *)&a->ip4 : &a->ip6[12],
+           sizeof(h));
+    return &x->macs[(h ^ (h >> 16)) % XDP_NUM_MACS];
+}
+
+
+static uint32_t __attribute__((nonnull))
+csum_add(uint32_t sum, const uint8_t * const buf, const size_t len)
+{
+    size_t i = 0;
+    for (; i + 1 < len; i += 2)
+        sum += (uint32_t)(buf[i] << 8 | buf[i + 1]);
+    if (len & 1)
+        sum += (uint32_t)(buf[i] << 8);
+    return sum;
+}
+
+
+static uint16_t csum_fold(uint32_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+
+static uint16_t __attribute__((nonnull))
+build_frame(const struct q_xdp * const x,
+            const struct w_sock * const ws,
+            const struct w_iov * const v,
+            const struct w_sockaddr * const dst,
+            const uint8_t * const dmac,
+            uint8_t * const f)
+{
+    const bool v4 = dst->addr.af == AF_INET;
+    memcpy(f, dmac, ETH_ALEN);
+    memcpy(f + ETH_ALEN, x->mac, ETH_ALEN);
+    f[12] = v4 ? 0x08 : 0x86;
+    f[13] = v4 ? 0x00 : 0xdd;
+
+    uint8_t * const ip = f + ETH_HLEN;
+    uint8_t * const udp = ip + (v4 ? IP4_HLEN : IP6_HLEN);
+    const uint16_t ulen = UDP_HLEN + v->len;
+    memcpy(udp, &ws->ws_lport, sizeof(ws->ws_lport));
+    memcpy(udp + 2, &dst->port, sizeof(dst->port));
+    udp[4] = (uint8_t)(ulen >> 8);
+    udp[5] = (uint8_t)ulen;
+    udp[6] = udp[7] = 0;
+    memcpy(udp + UDP_HLEN, v->buf, v->len);
+
+    uint32_t sum;
+    if (v4) {
+        const uint16_t tlen = IP4_HLEN + ulen;
+        const uint8_t hdr[] = {0x45, v->flags, (uint8_t)(tlen >> 8),
+                               (uint8_t)tlen, 0, 0, 0x40, 0, 64, IPPROTO_UDP,
+                               0, 0};
+        memcpy(ip, hdr, sizeof(hdr));
+        memcpy(ip + 12, &ws->ws_laddr.ip4, sizeof(ws->ws_laddr.ip4));
+        memcpy(ip + 16, &dst->addr.ip4, sizeof(dst->addr.ip4));
+        const uint16_t ipsum = csum_fold(csum_add(0, ip, IP4_HLEN));
+        ip[10] = (uint8_t)(ipsum >> 8);
+        ip[11] = (uint8_t)ipsum;
+        sum = csum_add(0, ip + 12, 8);
+    } else {
+        const uint8_t hdr[] = {(uint8_t)(0x60 | v->flags >> 4),
+                               (uint8_t)(v->flags << 4),
+                               0,
+                               0,
+                               (uint8_t)(ulen >> 8),
+                               (uint8_t)ulen,
+                               IPPROTO_UDP,
+                               64};
+        memcpy(ip, hdr, sizeof(hdr));
+        memcpy(ip + 8, ws->ws_laddr.ip6, sizeof(ws->ws_laddr.ip6));
+        memcpy(ip + 24, dst->addr.ip6, sizeof(dst->addr.ip6));
+        sum = csum_add(0, ip + 8, 32);
+    }
+
+    // UDP checksum over the pseudo header and the datagram
+    sum = csum_add(sum + IPPROTO_UDP + ulen, udp, ulen);
+    uint16_t usum = csum_fold(sum);
+    if (usum == 0)
+        usum = 0xffff;
+    udp[6] = (uint8_t)(usum >> 8);
+    udp[7] = (uint8_t)usum;
+
+    return (uint16_t)(udp + ulen - f);
+}
+
+
+static void __attribute__((nonnull)) reap_tx(struct q_xdp * const x)
+{
+    uint32_t idx;
+    const uint32_t n =
+        xsk_ring_cons__peek(&x->cq, XDP_NUM_FRAMES / 2 - x->num_free, &idx);
+    for (uint32_t i = 0; i < n; i++)
+        x->free_frames[x->num_free++] =
+            *xsk_ring_cons__comp_addr(&x->cq, idx++);
+    xsk_ring_cons__release(&x->cq, n);
+}
+
+
+void xdp_cleanup(struct w_engine * const w)
+{
+    struct q_xdp * const x = ped(w)->xdp;
+    if (x == 0)
+        return;
+
+    if (x->xsk) {
+        xsk_socket__delete(x->xsk);
+        bpf_xdp_detach(x->ifindex, x->xdp_flags, 0);
+    }
+    if (x->umem)
+        xsk_umem__delete(x->umem);
+    if (x->area)
+        munmap(x->area, XDP_UMEM_LEN);
+    if (x->prog_fd >= 0)
+        close(x->prog_fd);
+    if (x->ports_fd >= 0)
+        close(x->ports_fd);
+    if (x->xsks_fd >= 0)
+        close(x->xsks_fd);
+    kv_destroy(x->socks);
+    free(x);
+    ped(w)->xdp = 0;
+}
+
+
+bool xdp_init(struct w_engine * const w, const char * const ifname)
+{
+    // we steal packets from the sockets of the kernel socket backend
+    if (strcmp(w->backend_name, "socket") != 0) {
+        warn(WRN, "AF_XDP needs the socket backend, not %s", w->backend_name);
+        return false;
+    }
+
+    // we only bind an XSK to queue 0, so RSS must not spread flows
+    const uint32_t nq = rx_queues(ifname);
+    if (nq > 1) {
+        warn(WRN,
+             "AF_XDP needs %s to have one RX queue, not %" PRIu32
+             " (ethtool -L %s combined 1)",
+             ifname, nq, ifname);
+        return false;
+    }
+
+    struct q_xdp * const x = calloc(1, sizeof(*x));
+    ensure(x, "could not calloc");
+    ped(w)->xdp = x;
+    x->prog_fd = x->ports_fd = x->xsks_fd = -1;
+
+    x->ifindex = (int)if_nametoindex(ifname);
+    if (x->ifindex == 0 || get_mac(ifname, x->mac) == false)
+        goto fail;
+
+    x->ports_fd = bpf_map_create(BPF_MAP_TYPE_ARRAY, "quant_ports",
+                                 sizeof(uint32_t), sizeof(uint8_t),
+                                 UINT16_MAX + 1, 0);
+    x->xsks_fd = bpf_map_create(BPF_MAP_TYPE_XSKMAP, "quant_xsks",
+                                sizeof(uint32_t), sizeof(int), 1, 0);
+    if (x->ports_fd < 0 || x->xsks_fd < 0)
+        goto fail;
+    x->prog_fd = load_prog(x->ports_fd, x->xsks_fd);
+    if (x->prog_fd < 0)
+        goto fail;
+
+    x->area = mmap(0, XDP_UMEM_LEN, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (x->area == MAP_FAILED) {
+        x->area = 0;
+        goto fail;
+    }
+    const struct xsk_umem_config ucfg = {.fill_size = XDP_NUM_FRAMES / 2,
+                                         .comp_size = XDP_NUM_FRAMES / 2,
+                                         .frame_size = XDP_FRAME_SIZE};
+    if (xsk_umem__create(&x->umem, x->area, XDP_UMEM_LEN, &x->fq, &x->cq,
+                         &ucfg) != 0)
+        goto fail;
+
+    // prefer native mode with zero-copy, but fall back to copying and to
+    // generic mode, which also works for veth
+    static const struct {
+        uint32_t xdp_flags;
+        uint16_t bind_flags;
+    } modes[] = {{XDP_FLAGS_DRV_MODE, XDP_ZEROCOPY},
+                 {XDP_FLAGS_DRV_MODE, XDP_COPY},
+                 {XDP_FLAGS_SKB_MODE, XDP_COPY}};
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        if (bpf_xdp_attach(x->ifindex, x->prog_fd,
+                           modes[m].xdp_flags | XDP_FLAGS_UPDATE_IF_NOEXIST,
+                           0) != 0)
+            continue;
+        const struct xsk_socket_config scfg = {
+            .rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+            .tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+            .libxdp_flags = XSK_LIBXDP_FLAGS__INHIBIT_PROG_LOAD,
+            .xdp_flags = modes[m].xdp_flags,
+            .bind_flags = XDP_USE_NEED_WAKEUP | modes[m].bind_flags};
+        if (xsk_socket__create(&x->xsk, ifname, 0, x->umem, &x->rx, &x->tx,
+                               &scfg) == 0) {
+            x->xdp_flags = modes[m].xdp_flags;
+            break;
+        }
+        bpf_xdp_detach(x->ifindex, modes[m].xdp_flags, 0);
+    }
+    if (x->xsk == 0)
+        goto fail;
+
+    const uint32_t queue = 0;
+    const int xsk_fd = xsk_socket__fd(x->xsk);
+    if (bpf_map_update_elem(x->xsks_fd, &queue, &xsk_fd, BPF_ANY) != 0)
+        goto fail;
+
+    // the first half of the UMEM receives, the second half transmits
+    uint32_t idx;
+    const uint32_t nrx = XDP_NUM_FRAMES / 2;
+    ensure(xsk_ring_prod__reserve(&x->fq, nrx, &idx) == nrx,
+           "fill ring too small");
+    for (uint32_t i = 0; i < nrx; i++) {
+        *xsk_ring_prod__fill_addr(&x->fq, idx++) = i * XDP_FRAME_SIZE;
+        x->free_frames[x->num_free++] = (uint64_t)(nrx + i) * XDP_FRAME_SIZE;
+    }
+    xsk_ring_prod__submit(&x->fq, nrx);
+    add_pfd(w, xsk_fd);
+
+    ped(w)->txtime = false; // bypasses the qdisc
+    warn(INF, "using AF_XDP on %s in %s mode", ifname,
+         x->xdp_flags == XDP_FLAGS_SKB_MODE ? "generic" : "native");
+    return true;
+
+fail:
+    warn(WRN, "cannot use AF_XDP on %s: %s", ifname, strerror(errno));
+    xdp_cleanup(w);
+    return false;
+}
+
+
+void xdp_add_sock(struct w_sock * const ws)
+{
+    struct q_xdp * const x = ped(ws->w)->xdp;
+    if (x == 0)
+        return;
+
+    kv_push(struct w_sock *, x->socks, ws);
+    const uint32_t port = ws->ws_lport;
+    const uint8_t on = 1;
+    if (bpf_map_update_elem(x->ports_fd, &port, &on, BPF_ANY) != 0)
+        warn(WRN, "cannot steer port %u to AF_XDP", ntohs(ws->ws_lport));
+}
+
+
+void xdp_del_sock(struct w_sock * const ws)
+{
+    struct q_xdp * const x = ped(ws->w)->xdp;
+    if (x == 0)
+        return;
+
+    bool port_used = false;
+    for (size_t i = 0; i < kv_size(x->socks);) {
+        if (kv_A(x->socks, i) == ws) {
+            kv_A(x->socks, i) = kv_A(x->socks, kv_size(x->socks) - 1);
+            kv_size(x->socks)--;
+            continue;
+        }
+        port_used |= kv_A(x->socks, i)->ws_lport == ws->ws_lport;
+        i++;
+    }
+
+    if (port_used == false) {
+        const uint32_t port = ws->ws_lport;
+        const uint8_t off = 0;
+        bpf_map_update_elem(x->ports_fd, &port, &off, BPF_ANY);
+    }
+}
+
+
+void xdp_tx(struct w_sock * const ws, struct w_iov_sq * const q)
+{
+    struct q_xdp * const x = ped(ws->w)->xdp;
+    reap_tx(x);
+
+    struct w_iov_sq done = w_iov_sq_initializer(done);
+    struct w_iov_sq slow = w_iov_sq_initializer(slow);
+    uint32_t sent = 0;
+    while (!sq_empty(q)) {
+        struct w_iov * const v = sq_first(q);
+        sq_remove_head(q, next);
+
+        const struct w_sockaddr * const dst =
+            w_connected(ws) ? &ws->ws_rem : &v->saddr;
+        const struct xdp_mac * const m = mac_slot(x, &dst->addr);
+        const uint16_t hlen = ETH_HLEN + UDP_HLEN +
+                              (dst->addr.af == AF_INET ? IP4_HLEN : IP6_HLEN);
+        uint32_t idx;
+        if (m->valid == false || w_addr_cmp(&m->addr, &dst->addr) == false ||
+            x->num_free == 0 || hlen + v->len > XDP_FRAME_SIZE ||
+            xsk_ring_prod__reserve(&x->tx, 1, &idx) != 1) {
+            // no next-hop MAC yet (or no room), let the kernel handle it
+            sq_insert_tail(&slow, v, next);
+            continue;
+        }
+
+        const uint64_t addr = x->free_frames[--x->num_free];
+        struct xdp_desc * const d = xsk_ring_prod__tx_desc(&x->tx, idx);
+        d->addr = addr;
+        d->len = build_frame(x, ws, v, dst, m->mac,
+                             xsk_umem__get_data(x->area, addr));
+        sq_insert_tail(&done, v, next);
+        sent++;
+    }
+
+    if (sent) {
+        xsk_ring_prod__submit(&x->tx, sent);
+        if (xsk_ring_prod__needs_wakeup(&x->tx))
+            sendto(xsk_socket__fd(x->xsk), 0, 0, MSG_DONTWAIT, 0, 0);
+    }
+
+    if (!sq_empty(&slow)) {
+        w_tx(ws, &slow);
+        do
+            w_nic_tx(ws->w);
+        while (w_tx_pending(&slow));
+        sq_concat(&done, &slow);
+    }
+    sq_concat(q, &done);
+}
+
+
+static struct w_sock * __attribute__((nonnull))
+rx_frame(struct w_engine * const w,
+         struct q_xdp * const x,
+         const uint8_t * const f,
+         const uint32_t len,
+         struct w_iov ** const xv)
+{
+    *xv = 0;
+    if (len < ETH_HLEN + IP4_HLEN + UDP_HLEN)
+        return 0;
+
+    // the XDP program only redirects UDP over option-less IPv4 or IPv6
+    const uint8_t * const ip = f + ETH_HLEN;
+    struct w_sockaddr src = {0};
+    struct w_sockaddr dst = {0};
+    const uint8_t * udp;
+    uint8_t tos;
+    uint8_t ttl;
+    if (f[12] == 0x08) {
+        src.addr.af = dst.addr.af = AF_INET;
+        memcpy(&src.addr.ip4, ip + 12, sizeof(src.addr.ip4));
+        memcpy(&dst.addr.ip4, ip + 16, sizeof(dst.addr.ip4));
+        tos = ip[1];
+        ttl = ip[8];
+        udp = ip + IP4_HLEN;
+    } else {
+        if (len < ETH_HLEN + IP6_HLEN + UDP_HLEN)
+            return 0;
+        src.addr.af = dst.addr.af = AF_INET6;
+        memcpy(src.addr.ip6, ip + 8, sizeof(src.addr.ip6));
+        memcpy(dst.addr.ip6, ip + 24, sizeof(dst.addr.ip6));
+        tos = (uint8_t)(ip[0] << 4 | ip[1] >> 4);
+        ttl = ip[7];
+        udp = ip + IP6_HLEN;
+    }
+    memcpy(&src.port, udp, sizeof(src.port));
+    memcpy(&dst.port, udp + 2, sizeof(dst.port));
+    const uint16_t ulen = (uint16_t)(udp[4] << 8 | udp[5]);
+    if (ulen < UDP_HLEN || udp + ulen > f + len)
+        return 0;
+
+    struct w_sock * ws = 0;
+    for (size_t i = 0; i < kv_size(x->socks); i++)
+        if (kv_A(x->socks, i)->ws_lport == dst.port &&
+            kv_A(x->socks, i)->ws_af == dst.addr.af) {
+            ws = kv_A(x->socks, i);
+            break;
+        }
+    if (ws == 0)
+        return 0;
+
+    // remember the next hop, so we can send to this peer via AF_XDP
+    struct xdp_mac * const m = mac_slot(x, &src.addr);
+    m->addr = src.addr;
+    memcpy(m->mac, f + ETH_ALEN, ETH_ALEN);
+    m->valid = true;
+
+    const uint16_t plen = ulen - UDP_HLEN;
+    struct w_iov * const v = w_alloc_iov(w, dst.addr.af, 0, 0);
+    if (unlikely(v == 0 || plen > v->len)) {
+        warn(WRN, "cannot buffer %u-byte AF_XDP datagram", plen);
+        if (v)
+            w_free_iov(v);
+        return 0;
+    }
+    memcpy(v->buf, udp + UDP_HLEN, plen);
+    v->len = plen;
+    v->saddr = src;
+    v->flags = tos;
+    v->ttl = ttl;
+    *xv = v;
+    return ws;
+}
+
+
+bool xdp_rx(struct w_engine * const w, const int64_t nsec)
+{
+    struct per_engine_data * const ped = ped(w);
+    struct q_xdp * const x = ped->xdp;
+
+    uint32_t idx;
+    uint32_t n = xsk_ring_cons__peek(&x->rx, XDP_BATCH, &idx);
+    if (n == 0 && nsec != 0) {
+        // wait for our XSK and the kernel sockets, see q_fds()
+        wait_pfds(w, nsec);
+        n = xsk_ring_cons__peek(&x->rx, XDP_BATCH, &idx);
+    }
+    if (n == 0) {
+        if (xsk_ring_prod__needs_wakeup(&x->fq))
+            recvfrom(xsk_socket__fd(x->xsk), 0, 0, MSG_DONTWAIT, 0, 0);
+        return false;
+    }
+
+    ped->now = w_now();
+    timeouts_update(ped->wheel, ped->now);
+
+    // copy the datagrams out and hand the frames straight back to the kernel
+    struct w_iov * xv[XDP_BATCH];
+    struct w_sock * xws[XDP_BATCH];
+    uint32_t fidx;
+    ensure(xsk_ring_prod__reserve(&x->fq, n, &fidx) == n, "fill ring full");
+    for (uint32_t i = 0; i < n; i++) {
+        const struct xdp_desc * const d =
+            xsk_ring_cons__rx_desc(&x->rx, idx + i);
+        xws[i] = rx_frame(w, x, xsk_umem__get_data(x->area, d->addr), d->len,
+                          &xv[i]);
+        *xsk_ring_prod__fill_addr(&x->fq, fidx + i) =
+            xsk_umem__extract_addr(d->addr);
+    }
+    xsk_ring_cons__release(&x->rx, n);
+    xsk_ring_prod__submit(&x->fq, n);
+
+    // process the datagrams in batches per socket
+    struct w_iov_sq q = w_iov_sq_initializer(q);
+    struct w_sock * ws = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (xv[i] == 0)
+            continue;
+        if (ws && ws != xws[i])
+            do_rx(ws, &q);
+        ws = xws[i];
+        sq_insert_tail(&q, xv[i], next);
+    }
+    if (ws)
+        do_rx(ws, &q);
+    return true;
+}
+
+#endif
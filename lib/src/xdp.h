@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <warpcore/warpcore.h>
+
+#ifdef WITH_AF_XDP
+
+/// Interface name prefix that makes q_init() use the AF_XDP datapath. Only
+/// queue 0 is bound, so the interface must have a single RX queue (e.g., via
+/// "ethtool -L <if> combined 1"); xdp_init() refuses it otherwise.
+#define XDP_IFNAME_PREFIX "xdp:"
+
+/// Number of UMEM frames; half are used for RX, half for TX.
+#define XDP_NUM_FRAMES 4096
+
+/// Size of a UMEM frame.
+#define XDP_FRAME_SIZE 2048
+
+/// Maximum number of frames handled per RX or completion batch.
+#define XDP_BATCH 64
+
+/// Number of entries in the peer MAC address cache.
+#define XDP_NUM_MACS 256
+
+
+extern bool __attribute__((nonnull))
+xdp_init(struct w_engine * const w, const char * const ifname);
+
+extern void __attribute__((nonnull)) xdp_cleanup(struct w_engine * const w);
+
+extern void __attribute__((nonnull)) xdp_add_sock(struct w_sock * const ws);
+
+extern void __attribute__((nonnull)) xdp_del_sock(struct w_sock * const ws);
+
+extern void __attribute__((nonnull))
+xdp_tx(struct w_sock * const ws, struct w_iov_sq * const q);
+
+extern bool __attribute__((nonnull))
+xdp_rx(struct w_engine * const w, const int64_t nsec);
+
+#else
+
+#define xdp_add_sock(ws)                                                       \
+    do {                                                                       \
+    } while (0)
+
+#define xdp_del_sock(ws)                                                       \
+    do {                                                                       \
+    } while (0)
+
+#endif
@@ -0,0 +1,300 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <quant/quant.h>
+
+#include "diet.h"
+#include "tree.h"
+
+
+// The splay-tree DIET that diet.c replaced, kept as a baseline. Only the
+// operations on the hot paths are included.
+
+struct sival {
+    splay_entry(sival) node;
+    uint_t lo;
+    uint_t hi;
+    uint64_t t;
+};
+
+
+static inline int __attribute__((nonnull))
+sival_cmp(const struct sival * const a, const struct sival * const b)
+{
+    if ((a->lo >= b->lo && a->lo <= b->hi) ||
+        (b->lo >= a->lo && b->lo <= a->hi))
+        return 0;
+    return (a->lo > b->lo) - (a->lo < b->lo);
+}
+
+
+splay_head(sdiet, sival);
+
+SPLAY_PROTOTYPE(sdiet, sival, node, sival_cmp)
+SPLAY_GENERATE(sdiet, sival, node, sival_cmp)
+
+
+static struct sival * sdiet_find(struct sdiet * const d, const uint_t n)
+{
+    if (splay_empty(d))
+        return 0;
+    sdiet_splay(d, &(const struct sival){.lo = n, .hi = n});
+    if (n < splay_root(d)->lo || n > splay_root(d)->hi)
+        return 0;
+    return splay_root(d);
+}
+
+
+static struct sival * make_sival(const uint_t n, const uint64_t t)
+{
+    struct sival * const i = calloc(1, sizeof(*i));
+    ensure(i, "could not calloc");
+    i->lo = i->hi = n;
+    i->t = t;
+    return i;
+}
+
+
+static void
+sdiet_insert(struct sdiet * const d, const uint_t n, const uint64_t t)
+{
+    if (splay_empty(d))
+        goto new_ival;
+
+    sdiet_find(d, n);
+    struct sival * const r = splay_root(d);
+    if (n >= r->lo && n <= r->hi) {
+        r->t = t;
+        return;
+    }
+
+    if (n < r->lo) {
+        struct sival * max = splay_left(r, node);
+        while (max && splay_right(max, node))
+            max = splay_right(max, node);
+
+        if (n + 1 == r->lo)
+            r->lo--;
+        else if (max && max->hi + 1 == n)
+            max->hi++;
+        else
+            goto new_ival;
+
+        if (max && max->hi == r->lo - 1) {
+            splay_right(max, node) = splay_right(r, node);
+            max->hi = r->hi;
+            splay_root(d) = splay_left(r, node);
+            free(r);
+            splay_count(d)--;
+        }
+        splay_root(d)->t = t;
+        return;
+    }
+
+    struct sival * min = splay_right(r, node);
+    while (min && splay_left(min, node))
+        min = splay_left(min, node);
+
+    if (n == r->hi + 1)
+        r->hi++;
+    else if (min && min->lo - 1 == n)
+        min->lo--;
+    else
+        goto new_ival;
+
+    if (min && min->lo == r->hi + 1) {
+        splay_left(min, node) = splay_left(r, node);
+        min->lo = r->lo;
+        splay_root(d) = splay_right(r, node);
+        free(r);
+        splay_count(d)--;
+    }
+    splay_root(d)->t = t;
+    return;
+
+new_ival:
+    splay_insert(sdiet, d, make_sival(n, t));
+}
+
+
+static void sdiet_remove_ival(struct sdiet * const d, uint_t lo, uint_t hi)
+{
+again:
+    if (splay_empty(d))
+        return;
+
+    sdiet_splay(d, &(const struct sival){.lo = lo, .hi = hi});
+    struct sival * const r = splay_root(d);
+    if (hi < r->lo || lo > r->hi)
+        return;
+
+    if (lo > r->lo) {
+        if (hi < r->hi) {
+            struct sival * const i = make_sival(r->lo, r->t);
+            splay_count(d)++;
+            i->hi = lo - 1;
+            r->lo = hi + 1;
+            splay_left(i, node) = splay_left(r, node);
+            splay_left(r, node) = 0;
+            splay_right(i, node) = r;
+            splay_root(d) = i;
+            return;
+        }
+        if (hi > r->hi) {
+            const uint_t root_hi = r->hi;
+            r->hi = lo - 1;
+            lo = root_hi + 1;
+            goto again;
+        }
+        r->hi = lo - 1;
+        return;
+    }
+
+    if (lo < r->lo) {
+        if (hi < r->hi) {
+            const uint_t root_lo = r->lo;
+            r->lo = hi + 1;
+            hi = root_lo - 1;
+            goto again;
+        }
+        if (hi <= r->hi)
+            hi = r->lo - 1;
+        goto free_root;
+    }
+
+    if (hi < r->hi) {
+        r->lo = hi + 1;
+        return;
+    }
+    hi = r->hi + 1;
+
+free_root:
+    splay_remove(sdiet, d, r);
+    free(r);
+    goto again;
+}
+
+
+static void sdiet_free(struct sdiet * const d)
+{
+    while (!splay_empty(d)) {
+        struct sival * const i = splay_min(sdiet, d);
+        splay_remove(sdiet, d, i);
+        free(i);
+    }
+}
+
+
+#define N 200000
+#define ROUNDS 10
+
+static uint_t seq[N];
+
+// workloads, modeled after the pn->recv and pn->recv_all use; the lossy one
+// is never trimmed and accumulates thousands of intervals
+enum { in_order, reordered, lossy };
+static const char * const wl_str[] = {"in-order", "reordered", "lossy"};
+
+
+static void make_seq(const int wl)
+{
+    for (uint_t i = 0; i < N; i++)
+        seq[i] = i;
+
+    if (wl == reordered)
+        // swap neighbors now and then
+        for (uint_t i = 1; i < N; i++) {
+            if (w_rand_uniform32(20) == 0) {
+                const uint_t tmp = seq[i];
+                seq[i] = seq[i - 1];
+                seq[i - 1] = tmp;
+            }
+        }
+    else if (wl == lossy)
+        // lose 1% of values for good
+        for (uint_t i = 0; i < N; i++)
+            if (w_rand_uniform32(100) == 0)
+                seq[i] = i > 0 ? seq[i - 1] : 0;
+}
+
+
+static uint64_t run_diet(const bool trim)
+{
+    const uint64_t start = w_now();
+    for (uint_t r = 0; r < ROUNDS; r++) {
+        struct diet d = diet_initializer(d);
+        for (uint_t i = 0; i < N; i++) {
+            diet_insert(&d, seq[i], i);
+            ensure(diet_find(&d, seq[i]), "found");
+            // every so often, the peer ACKs our ACK
+            if (trim && i % 64 == 63)
+                diet_remove_ival(&d, &(const struct ival){.lo = 0,
+                                                          .hi = seq[i] - 32});
+        }
+        diet_free(&d);
+    }
+    return w_now() - start;
+}
+
+
+static uint64_t run_sdiet(const bool trim)
+{
+    const uint64_t start = w_now();
+    for (uint_t r = 0; r < ROUNDS; r++) {
+        struct sdiet d = splay_initializer(d);
+        for (uint_t i = 0; i < N; i++) {
+            sdiet_insert(&d, seq[i], i);
+            ensure(sdiet_find(&d, seq[i]), "found");
+            if (trim && i % 64 == 63)
+                sdiet_remove_ival(&d, 0, seq[i] - 32);
+        }
+        sdiet_free(&d);
+    }
+    return w_now() - start;
+}
+
+
+int main()
+{
+    w_init_rand();
+
+    for (int wl = in_order; wl <= lossy; wl++) {
+        make_seq(wl);
+        const uint64_t splay_ns = run_sdiet(wl != lossy);
+        const uint64_t flat_ns = run_diet(wl != lossy);
+        warn(NTE, "%-9s splay %.1f ns/op, flat %.1f ns/op (%.2fx)",
+             wl_str[wl], (double)splay_ns / (N * ROUNDS),
+             (double)flat_ns / (N * ROUNDS), (double)splay_ns / flat_ns);
+    }
+
+    return 0;
+}
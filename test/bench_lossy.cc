@@ -0,0 +1,241 @@
+// Copyright (c) 2014-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <fcntl.h>
+#include <libgen.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <random>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <quant/quant.h>
+
+
+// Throughput of the congestion controllers over a lossy, delayed path. The
+// path is a UDP relay thread on the loopback interface, which drops and
+// delays datagrams in both directions.
+
+#define SERV_PORT 55555
+#define RELAY_PORT 55556
+#define ONE_WAY_DELAY std::chrono::milliseconds(10)
+#define XFER_LEN (4 * 1024 * 1024)
+
+
+static struct w_engine * w;
+static std::atomic<bool> relay_done{false};
+static std::atomic<uint32_t> loss_permille{0};
+
+
+struct dgram {
+    std::chrono::steady_clock::time_point t;
+    struct sockaddr_in6 to;
+    std::vector<uint8_t> buf;
+    int fd;
+};
+
+
+static void relay()
+{
+    const auto lo = [](const uint16_t port) {
+        struct sockaddr_in6 sa = {};
+        sa.sin6_family = AF_INET6;
+        sa.sin6_port = bswap16(port);
+        inet_pton(AF_INET6, "::1", &sa.sin6_addr);
+        return sa;
+    };
+
+    // clnt_fd faces the client, serv_fd the server
+    const int clnt_fd = socket(AF_INET6, SOCK_DGRAM, 0);
+    const int serv_fd = socket(AF_INET6, SOCK_DGRAM, 0);
+    ensure(clnt_fd >= 0 && serv_fd >= 0, "socket");
+    const struct sockaddr_in6 relay_sa = lo(RELAY_PORT);
+    ensure(bind(clnt_fd, reinterpret_cast<const struct sockaddr *>(&relay_sa),
+                sizeof(relay_sa)) == 0,
+           "bind");
+    const struct sockaddr_in6 serv_sa = lo(SERV_PORT);
+
+    std::minstd_rand rnd(1); // NOLINT
+    std::uniform_int_distribution<uint32_t> dist(0, 999);
+    std::deque<struct dgram> q;
+    struct sockaddr_in6 clnt_sa = {};
+    struct pollfd fds[] = {{clnt_fd, POLLIN, 0}, {serv_fd, POLLIN, 0}};
+
+    while (relay_done == false) {
+        int to = 100;
+        if (!q.empty())
+            to = int(std::chrono::duration_cast<std::chrono::milliseconds>(
+                         q.front().t - std::chrono::steady_clock::now())
+                         .count());
+        poll(fds, 2, to < 0 ? 0 : to);
+
+        for (auto & fd : fds) {
+            if ((fd.revents & POLLIN) == 0)
+                continue;
+            struct dgram d = {std::chrono::steady_clock::now() + ONE_WAY_DELAY,
+                              serv_sa, std::vector<uint8_t>(UINT16_MAX),
+                              serv_fd};
+            struct sockaddr_in6 from = {};
+            socklen_t from_len = sizeof(from);
+            const ssize_t n =
+                recvfrom(fd.fd, d.buf.data(), d.buf.size(), 0,
+                         reinterpret_cast<struct sockaddr *>(&from), &from_len);
+            if (n <= 0 || dist(rnd) < loss_permille)
+                continue;
+            d.buf.resize(size_t(n));
+            if (fd.fd == clnt_fd)
+                clnt_sa = from;
+            else {
+                d.to = clnt_sa;
+                d.fd = clnt_fd;
+            }
+            q.push_back(std::move(d));
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        while (!q.empty() && q.front().t <= now) {
+            const struct dgram & d = q.front();
+            sendto(d.fd, d.buf.data(), d.buf.size(), 0,
+                   reinterpret_cast<const struct sockaddr *>(&d.to),
+                   sizeof(d.to));
+            q.pop_front();
+        }
+    }
+
+    close(clnt_fd);
+    close(serv_fd);
+}
+
+
+static uint64_t io(struct q_conn * const cc, struct q_conn * const sc)
+{
+    struct q_stream * const cs = q_rsv_stream(cc, true);
+    if (unlikely(cs == nullptr))
+        return 0;
+
+    struct w_iov_sq o = w_iov_sq_initializer(o);
+    q_alloc(w, &o, cc, q_conn_af(cc), XFER_LEN);
+    q_write(cs, &o, true);
+
+    struct w_iov_sq i = w_iov_sq_initializer(i);
+    struct q_stream * const ss = q_read(sc, &i, true);
+    if (likely(ss)) {
+        q_read_stream(ss, &i, true);
+        q_free_stream(ss);
+    }
+    q_free_stream(cs);
+
+    const uint64_t ilen = w_iov_sq_len(&i);
+    q_free(&i);
+    q_free(&o);
+    return ilen;
+}
+
+
+static void BM_lossy(benchmark::State & state)
+{
+    struct q_conn_conf conf = {};
+    conf.cc_algo = uint8_t(state.range(0));
+    loss_permille = uint32_t(state.range(1));
+
+    struct sockaddr_in6 sip = {};
+    sip.sin6_family = AF_INET6;
+    sip.sin6_port = bswap16(RELAY_PORT);
+    inet_pton(sip.sin6_family, "::1", &sip.sin6_addr);
+    struct q_conn * const cc =
+        q_connect(w, reinterpret_cast<struct sockaddr *>(&sip), // NOLINT
+                  "localhost", nullptr, nullptr, true, nullptr, &conf);
+    struct q_conn * const sc = cc ? q_accept(w, &conf) : nullptr;
+    if (cc == nullptr || sc == nullptr) {
+        state.SkipWithError("could not connect");
+        return;
+    }
+
+    for (auto _ : state)
+        if (io(cc, sc) != XFER_LEN) {
+            state.SkipWithError("error");
+            break;
+        }
+    state.SetBytesProcessed(int64_t(state.iterations()) * XFER_LEN);
+
+#ifndef NO_QINFO
+    struct q_conn_info ci = {};
+    q_info(cc, &ci);
+    state.counters["lost"] = double(ci.pkts_out_lost);
+    state.counters["rtx"] = double(ci.pkts_out_rtx);
+    state.counters["max_cwnd"] = double(ci.max_cwnd);
+    state.counters["cc_bw"] = double(ci.cc_bw);
+#endif
+
+    q_close(cc, 0, nullptr);
+    q_close(sc, 0, nullptr);
+}
+
+
+BENCHMARK(BM_lossy)
+    ->ArgNames({"cc", "loss_permille"})
+    ->ArgsProduct({{q_cc_newreno, q_cc_cubic, q_cc_bbr}, {0, 1, 10, 30}})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+
+int main(int argc, char ** argv)
+{
+#ifndef NDEBUG
+    util_dlevel = WRN; // default to maximum compiled-in verbosity
+#endif
+
+    // init
+    const int cwd = open(".", O_CLOEXEC);
+    ensure(cwd != -1, "cannot open");
+    ensure(chdir(dirname(argv[0])) == 0, "cannot chdir");
+    const struct q_conf conf = {nullptr, nullptr, "dummy.crt", "dummy.key",
+                                nullptr, nullptr, 1000000};
+    w = q_init("lo"
+#ifndef __linux__
+               "0"
+#endif
+               ,
+               &conf);
+    ensure(fchdir(cwd) == 0, "cannot fchdir");
+
+    q_bind(w, 0, SERV_PORT);
+    std::thread r(relay);
+
+    benchmark::Initialize(&argc, argv);
+    benchmark::RunSpecifiedBenchmarks();
+
+    relay_done = true;
+    r.join();
+    q_cleanup(w);
+}
@@ -0,0 +1,162 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <quant/quant.h>
+
+#include "conn.h"
+#include "diet.h"
+#include "frame.h"
+#include "marshall.h"
+#include "pkt.h"
+#include "pn.h"
+
+
+#define N 20000
+
+
+static void chk(struct pn_space * const pn, struct pkt_meta * const m)
+{
+    // what the ACK frame must contain: the largest ACK_MAX_RNGS intervals
+    struct ival want[ACK_MAX_RNGS];
+    uint_t cnt = 0;
+    for (struct ival * i = diet_max_ival(&pn->recv);
+         i != 0 && cnt < ACK_MAX_RNGS; i = diet_prev_ival(&pn->recv, i))
+        want[cnt++] = *i;
+
+    uint8_t buf[1500];
+    uint8_t * p = buf;
+    ensure(enc_ack_frame(&pn->c->i, &p, buf, buf + sizeof(buf), m, pn),
+           "enc_ack_frame failed");
+    ensure(diet_cnt(&pn->recv) <= ACK_MAX_RNGS, "recv not trimmed");
+
+    // decode the ACK frame and compare
+    const uint8_t * pos = buf;
+    const uint8_t * const end = p;
+    uint64_t type;
+    uint64_t lg;
+    uint64_t del;
+    uint64_t rng_cnt;
+    uint64_t rng;
+    ensure(decv(&type, &pos, end) && type == FRM_ACK, "type");
+    ensure(decv(&lg, &pos, end) && lg == want[0].hi, "largest");
+    ensure(decv(&del, &pos, end), "delay");
+    ensure(decv(&rng_cnt, &pos, end) && rng_cnt == cnt - 1, "range count");
+    ensure(decv(&rng, &pos, end) && rng == want[0].hi - want[0].lo,
+           "first range");
+    for (uint_t n = 1; n < cnt; n++) {
+        uint64_t gap;
+        ensure(decv(&gap, &pos, end) && decv(&rng, &pos, end), "pair %" PRIu,
+               n);
+        ensure(gap == want[n - 1].lo - want[n].hi - 2 &&
+                   rng == want[n].hi - want[n].lo,
+               "pair %" PRIu ": gap %" PRIu64 " rng %" PRIu64 " [%" PRIu
+               "..%" PRIu "]",
+               n, gap, rng, want[n].lo, want[n].hi);
+    }
+    ensure(pos == end, "trailing bytes");
+}
+
+
+int main(int argc
+#ifdef NDEBUG
+         __attribute__((unused))
+#endif
+         ,
+         char * argv[])
+{
+    w_init_rand();
+#ifndef NDEBUG
+    util_dlevel = DLEVEL; // default to maximum compiled-in verbosity
+#endif
+
+    // enc_ack_frame() needs a connection, so make one
+    const int cwd = open(".", O_CLOEXEC);
+    ensure(cwd != -1, "cannot open");
+    ensure(chdir(dirname(argv[0])) == 0, "cannot chdir");
+    __extension__ const struct q_conf conf = {.tls_cert = "dummy.crt",
+                                              .tls_key = "dummy.key"};
+    struct w_engine * const w = q_init("lo"
+#ifndef __linux__
+                                       "0"
+#endif
+                                       ,
+                                       &conf);
+    ensure(fchdir(cwd) == 0, "cannot fchdir");
+    q_bind(w, 0, 55557);
+    struct sockaddr_in6 sip = {.sin6_family = AF_INET6,
+                               .sin6_port = bswap16(55557)};
+    inet_pton(AF_INET6, "::1", &sip.sin6_addr);
+    struct q_conn * const c = q_connect(w, (const struct sockaddr *)&sip,
+                                        "localhost", 0, 0, true, 0, 0);
+    ensure(c, "is zero");
+
+    // start over with an empty receive history
+    struct pn_space * const pn = &c->pns[pn_data];
+    diet_free(&pn->recv);
+    memset(&pn->ack_cache, 0, sizeof(pn->ack_cache));
+    pn->ect0_cnt = pn->ect1_cnt = pn->ce_cnt = 0;
+    struct pkt_meta m = {.pn = pn, .hdr.type = SH};
+
+    // mostly in-order arrivals with gaps and reordering, so that ACK frames
+    // both reuse cached gap/rng pairs and need more than ACK_MAX_RNGS ranges
+    uint_t top = 0;
+    for (uint_t i = 0; i < N; i++) {
+        const uint_t r = w_rand_uniform32(100);
+        if (r < 70) {
+            uint_t nr = top + 1 + w_rand_uniform32(i % 3 == 0 ? 1 : 8);
+            if (w_rand_uniform32(4) == 0 && top > 50)
+                nr = top - w_rand_uniform32(50);
+            diet_insert(&pn->recv, nr, 0);
+            top = MAX(top, nr);
+        } else if (r < 72 && !diet_empty(&pn->recv)) {
+            // the peer ACKed some of our ACKs
+            const uint_t x = diet_max(&pn->recv);
+            if (x > 200) {
+                const uint_t hi = x - 100 - w_rand_uniform32(100);
+                diet_remove_ival(&pn->recv, &(struct ival){.lo = 0, .hi = hi});
+            }
+        } else if (!diet_empty(&pn->recv))
+            chk(pn, &m);
+    }
+
+    // don't let the connection ACK what it never received
+    diet_free(&pn->recv);
+    q_close(c, 0, 0);
+    q_cleanup(w);
+    return 0;
+}
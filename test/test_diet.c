@@ -71,8 +71,8 @@ static void chk(struct diet * const d)
 {
     struct ival * i;
     struct ival * next;
-    for (i = splay_min(diet, d); i != 0; i = next) {
-        next = splay_next(diet, d, i);
+    for (i = diet_min_ival(d); i != 0; i = next) {
+        next = diet_next(diet, d, i);
         ensure(next == 0 || i->hi + 1 < next->lo,
                "%" PRIu "-%" PRIu " %" PRIu "-%" PRIu, i->lo, i->hi, next->lo,
                next->hi);
@@ -104,7 +104,7 @@ int main()
     }
 
     // remove all items
-    while (!splay_empty(&d)) {
+    while (!diet_empty(&d)) {
         const uint_t x = w_rand_uniform32(N);
         struct ival * const i = diet_find(&d, x);
         if (i) {
@@ -0,0 +1,190 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifndef NDEBUG
+#include <stdlib.h>
+#include <sys/param.h>
+#endif
+
+#include <quant/quant.h>
+
+
+struct state {
+    struct w_engine * w;
+    struct q_conn * sc;
+    struct q_stream * cs;
+    struct q_stream * cs2;
+    struct q_stream * ss;
+    struct w_iov_sq i;
+    uint_t readable;
+    uint_t acked;
+    bool closed;
+    uint8_t _unused[7];
+};
+
+
+static void conn_accepted(struct q_conn * const c, void * const arg)
+{
+    struct state * const st = arg;
+    ensure(st->sc == 0, "only one conn");
+    st->sc = c;
+}
+
+
+static void strm_readable(struct q_stream * const s, void * const arg)
+{
+    struct state * const st = arg;
+    ensure(s != st->cs && s != st->cs2, "clnt strm should not get data");
+    q_read_stream(s, &st->i, false);
+    st->readable++;
+
+    if (st->ss == 0)
+        // opening a stream from a callback must not upset event dispatch
+        st->ss = q_rsv_stream(st->sc, true);
+}
+
+
+static void strm_acked(struct q_stream * const s, void * const arg)
+{
+    struct state * const st = arg;
+    ensure(s == st->cs || s == st->cs2, "only clnt strms send data");
+    st->acked++;
+    q_stop(st->w);
+}
+
+
+static void conn_closed(struct q_conn * const c __attribute__((unused)),
+                        void * const arg)
+{
+    struct state * const st = arg;
+    st->closed = true;
+}
+
+
+int main(int argc
+#ifdef NDEBUG
+         __attribute__((unused))
+#endif
+         ,
+         char * argv[])
+{
+#ifndef NDEBUG
+    util_dlevel = DLEVEL; // default to maximum compiled-in verbosity
+    int ch;
+    while ((ch = getopt(argc, argv, "v:")) != -1)
+        if (ch == 'v')
+            util_dlevel = MIN(DLEVEL, MAX(0, (short)strtoul(optarg, 0, 10)));
+#endif
+
+    // init
+    const int cwd = open(".", O_CLOEXEC);
+    ensure(cwd != -1, "cannot open");
+    ensure(chdir(dirname(argv[0])) == 0, "cannot chdir");
+    __extension__ const struct q_conf conf = {.tls_cert = "dummy.crt",
+                                              .tls_key = "dummy.key"};
+    struct w_engine * const w = q_init("lo"
+#ifndef __linux__
+                                       "0"
+#endif
+                                       ,
+                                       &conf);
+    ensure(fchdir(cwd) == 0, "cannot fchdir");
+
+    // register callbacks
+    struct state st = {.w = w, .i = w_iov_sq_initializer(st.i)};
+    const struct q_callbacks cb = {.conn_accepted = conn_accepted,
+                                   .conn_closed = conn_closed,
+                                   .strm_readable = strm_readable,
+                                   .strm_acked = strm_acked};
+    q_set_callbacks(w, &cb, &st);
+
+    // bind server socket
+    q_bind(w, 0, 55556);
+
+    // connect to server, which accepts via the callback
+    struct sockaddr_in6 sip = {.sin6_family = AF_INET6,
+                               .sin6_port = bswap16(55556)};
+    inet_pton(AF_INET6, "::1", &sip.sin6_addr);
+    struct q_conn * const cc = q_connect(w, (const struct sockaddr *)&sip,
+                                         "localhost", 0, 0, true, 0, 0);
+    ensure(cc, "is zero");
+
+    // send data on a new stream
+    st.cs = q_rsv_stream(cc, true);
+    struct w_iov_sq o = w_iov_sq_initializer(o);
+    q_alloc(w, &o, cc, AF_INET, 4096);
+    struct w_iov * const ov = sq_first(&o);
+    q_write(st.cs, &o, true);
+
+    // run until the client data has been ACKed
+    q_run(w);
+    ensure(st.acked == 1, "not acked");
+    ensure(st.sc, "not accepted");
+    ensure(st.readable, "not readable");
+    ensure(st.ss, "no strm opened in callback");
+
+    struct w_iov * const iv = sq_first(&st.i);
+    ensure(iv, "no data");
+    ensure(strncmp((char *)ov->buf, (char *)iv->buf, ov->len) == 0,
+           "data mismatch");
+
+    q_free(&st.i);
+    q_free(&o);
+
+    // a poll with nothing to do must time out without any events
+    const uint_t readable = st.readable;
+    q_poll(w, 10 * NS_PER_MS);
+    ensure(st.readable == readable && st.acked == 1, "unexpected event");
+
+    // a poll must deliver the events for new data on another stream
+    st.cs2 = q_rsv_stream(cc, true);
+    q_alloc(w, &o, cc, AF_INET, 1024);
+    q_write(st.cs2, &o, true);
+    for (int n = 0; n < 100 && (st.readable == readable || st.acked == 1);
+         n++)
+        q_poll(w, 10 * NS_PER_MS);
+    ensure(st.readable > readable, "no readable event");
+    ensure(st.acked == 2, "no acked event");
+    ensure(w_iov_sq_len(&st.i) == 1024, "got %" PRIu " bytes",
+           w_iov_sq_len(&st.i));
+    q_free(&st.i);
+    q_free(&o);
+
+    // close connections
+    q_close(cc, 0, 0);
+    q_close(st.sc, 0, 0);
+    q_cleanup(w);
+}
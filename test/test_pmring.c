@@ -0,0 +1,188 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/param.h>
+
+#include <quant/quant.h>
+
+#include "bitset.h"
+#include "pn.h"
+#include "quic.h"
+
+
+#define N 4096
+bitset_define(values, N);
+
+static struct pkt_meta pm[N];
+
+
+static void chk(const struct pm_ring * const r,
+                const struct values * const v,
+                const uint_t max)
+{
+    uint_t cnt = 0;
+    uint_t lo = UINT_T_MAX;
+    uint_t hi = 0;
+    for (uint_t x = 0; x < max; x++) {
+        const bool in = bit_isset(N, x, v);
+        ensure(pm_ring_get(r, x) == (in ? &pm[x] : 0), "%" PRIu, x);
+        if (in) {
+            cnt++;
+            lo = MIN(lo, x);
+            hi = x + 1;
+        }
+    }
+    ensure(r->cnt == cnt, "cnt %" PRIu " != %" PRIu, r->cnt, cnt);
+    ensure((r->cap & (r->cap - 1)) == 0, "cap %" PRIu, r->cap);
+    if (cnt == 0)
+        return;
+    ensure(r->base == lo, "base %" PRIu " != %" PRIu, r->base, lo);
+    ensure(r->end == hi, "end %" PRIu " != %" PRIu, r->end, hi);
+    ensure(r->end - r->base <= r->cap, "span %" PRIu " > cap %" PRIu,
+           r->end - r->base, r->cap);
+
+    // forward iteration visits exactly the tracked pkts, in order
+    struct pkt_meta * m;
+    uint_t seen = 0;
+    uint_t prev = 0;
+    pm_ring_foreach (m, r, UINT_T_MAX) {
+        ensure(bit_isset(N, m->hdr.nr, v), "%" PRIu " visited", m->hdr.nr);
+        ensure(seen == 0 || m->hdr.nr > prev, "%" PRIu " <= %" PRIu,
+               m->hdr.nr, prev);
+        prev = m->hdr.nr;
+        seen++;
+    }
+    ensure(seen == cnt, "seen %" PRIu " != %" PRIu, seen, cnt);
+}
+
+
+static void
+ins(struct pm_ring * const r, struct values * const v, const uint_t x)
+{
+    bit_set(N, x, v);
+    pm_by_nr_ins(r, &pm[x]);
+}
+
+
+static void
+del(struct pm_ring * const r, struct values * const v, const uint_t x)
+{
+    bit_clr(N, x, v);
+    pm_by_nr_del(r, &pm[x]);
+}
+
+
+static void
+rev(struct pm_ring * const r, struct values * const v, uint_t * const nr)
+{
+    // retire a random range top-down like dec_ack_frame() does, while sending
+    // some new pkts above it
+    const uint_t lo = r->base + w_rand_uniform32((uint32_t)(r->end - r->base));
+    const uint_t hi = lo + w_rand_uniform32((uint32_t)(r->end - lo));
+    uint_t exp = 0;
+    for (uint_t x = lo; x <= hi; x++)
+        exp += bit_isset(N, x, v);
+
+    struct pkt_meta * m;
+    uint_t seen = 0;
+    uint_t prev = UINT_T_MAX;
+    pm_ring_foreach_rev (m, r, lo, hi) {
+        const uint_t x = m->hdr.nr;
+        ensure(x >= lo && x <= hi, "%" PRIu " outside %" PRIu "-%" PRIu, x,
+               lo, hi);
+        ensure(x < prev, "%" PRIu " >= %" PRIu, x, prev);
+        ensure(bit_isset(N, x, v), "%" PRIu " visited", x);
+        prev = x;
+        seen++;
+        if (w_rand_uniform32(2) && *nr < N) {
+            del(r, v, x);
+            ins(r, v, (*nr)++);
+        }
+    }
+    ensure(seen == exp, "seen %" PRIu " != %" PRIu, seen, exp);
+}
+
+
+int main()
+{
+    w_init_rand();
+#ifndef NDEBUG
+    util_dlevel = DLEVEL; // default to maximum compiled-in verbosity
+#endif
+    for (uint_t x = 0; x < N; x++)
+        pm[x].hdr.nr = x;
+
+    struct pm_ring r = {0};
+    struct values v = bitset_t_initializer(0);
+
+    // a long run of unACKed pkts first, so the ring grows, then a mix of
+    // ACKs from the middle and both ends, bursts and ACK frame sweeps, with
+    // the pkt numbers wrapping around the ring many times
+    uint_t nr = 0;
+    while (nr < N) {
+        uint_t p = nr < 200 ? 0 : w_rand_uniform32(100);
+        if (r.end - r.base > 400)
+            // ACK the oldest pkt when the ring spans too many pkt numbers
+            p = 60;
+        if (r.cnt == 0 || p < 30)
+            ins(&r, &v, nr++);
+        else if (p == 30) {
+            // burst
+            for (uint_t n = w_rand_uniform32(64); n && nr < N; n--)
+                ins(&r, &v, nr++);
+        } else if (p < 33)
+            // jump, e.g. skipped pkt numbers
+            nr = MIN(nr + w_rand_uniform32(8), N);
+        else if (p < 50) {
+            const uint_t x =
+                r.base + w_rand_uniform32((uint32_t)(r.end - r.base));
+            if (bit_isset(N, x, &v))
+                del(&r, &v, x);
+        } else if (p < 85)
+            del(&r, &v, r.base);
+        else if (p < 95)
+            del(&r, &v, r.end - 1);
+        else
+            rev(&r, &v, &nr);
+        chk(&r, &v, nr);
+    }
+
+    // drain, and make sure an empty ring can be reused
+    while (r.cnt) {
+        del(&r, &v, r.base);
+        chk(&r, &v, N);
+    }
+    ins(&r, &v, N - 1);
+    chk(&r, &v, N);
+    del(&r, &v, N - 1);
+    ensure(r.cnt == 0 && r.base == N && r.end == N, "empty");
+
+    free(r.slot);
+    return 0;
+}
@@ -0,0 +1,97 @@
+// SPDX-License-Identifier: BSD-2-Clause
+//
+// Copyright (c) 2016-2020, NetApp, Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <stdint.h>
+#include <sys/param.h>
+
+#include <quant/quant.h>
+
+#include "bitset.h"
+#include "rxhist.h"
+
+
+#define N (8 * RX_HIST_WIN)
+bitset_define(values, N);
+
+
+static void chk(const struct rx_hist * const h, const struct values * const v)
+{
+    for (uint_t x = 0; x < N; x++)
+        ensure(rx_hist_find(h, x) == (x < h->base || bit_isset(N, x, v)),
+               "%" PRIu " base %" PRIu, x, h->base);
+
+    if (rx_hist_empty(h))
+        return;
+    const uint_t max = rx_hist_max(h);
+    ensure(bit_isset(N, max, v), "max %" PRIu, max);
+    uint_t lo = max;
+    while (lo > h->base && bit_isset(N, lo - 1, v))
+        lo--;
+    ensure(h->run_lo == lo, "run_lo %" PRIu " != %" PRIu, h->run_lo, lo);
+}
+
+
+int main()
+{
+    w_init_rand();
+#ifndef NDEBUG
+    util_dlevel = DLEVEL; // default to maximum compiled-in verbosity
+#endif
+    struct rx_hist h;
+    rx_hist_init(&h);
+    struct values v = bitset_t_initializer(0);
+
+    // a long in-order run first, then mostly in-order arrivals with some
+    // reordering, loss and big jumps
+    uint_t nr = 0;
+    while (nr < N) {
+        uint_t x = nr;
+        const uint_t r = nr < 2 * RX_HIST_WIN ? 100 : w_rand_uniform32(100);
+        if (r < 10 && nr > 0)
+            x = nr - 1 - w_rand_uniform32(MIN(nr, RX_HIST_WIN + 8));
+        else if (r < 20)
+            x = nr += w_rand_uniform32(8);
+        else if (r == 20)
+            x = nr += w_rand_uniform32(2 * RX_HIST_WIN);
+        if (x >= N)
+            break;
+        if (x == nr)
+            nr++;
+
+        if (rx_hist_find(&h, x))
+            continue;
+        bit_set(N, x, &v);
+        rx_hist_insert(&h, x);
+        ensure(rx_hist_find(&h, x), "%" PRIu " not found", x);
+        ensure(rx_hist_max(&h) + 1 == nr, "max %" PRIu " != %" PRIu,
+               rx_hist_max(&h), nr - 1);
+        chk(&h, &v);
+    }
+
+    return 0;
+}